@@ -0,0 +1,297 @@
+
+#include "benchmark.h"
+#include "eds_memmap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+
+namespace benchmark
+{
+
+double latency_recorder::percentile(double p)
+{
+  if (samples.empty()) {
+    return 0;
+  }
+
+  size_t index = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+/* Writing 5 to clear_refs resets VmHWM since Linux 4.0,
+   on older kernels the peak RSS of the whole process is reported.
+*/
+void reset_peak_rss()
+{
+  std::ofstream clear_refs("/proc/self/clear_refs");
+
+  clear_refs << "5\n";
+}
+
+size_t peak_rss_kb()
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::strtoul(line.c_str() + 6, nullptr, 10);
+    }
+  }
+
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void check(bool condition, const char* what)
+{
+  if (not condition) {
+    std::cerr << "check failed: " << what << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+double elapsed_ns(clock::time_point start, clock::time_point end)
+{
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+/* System calls and copies made by eds_memmap, from start to end */
+static void add_stats_delta(result& config, const eds_memmap_stats& start,
+                            const eds_memmap_stats& end)
+{
+  config.syscalls +=
+    (end.mmap_calls - start.mmap_calls)
+    + (end.mremap_in_place - start.mremap_in_place)
+    + (end.mremap_moved - start.mremap_moved)
+    + (end.munmap_calls - start.munmap_calls)
+    + (end.mprotect_calls - start.mprotect_calls)
+    + (end.madvise_calls - start.madvise_calls)
+    + (end.mbind_calls - start.mbind_calls);
+  config.copied_bytes +=
+    (end.copied_small_to_large - start.copied_small_to_large)
+    + (end.copied_large_to_small - start.copied_large_to_small)
+    + (end.copied_large_to_large - start.copied_large_to_large);
+}
+
+void run_workload(const options& opts, std::ostream& out, result config,
+                  workload_function workload)
+{
+  if (not selected(opts, config)) {
+    return;
+  }
+
+  for (size_t bytes = opts.min_bytes; bytes <= opts.max_bytes; bytes *= 2) {
+    if (bytes < config.element_size) {
+      continue;
+    }
+
+    std::vector<double> runs;
+    latency_recorder latency;
+    eds_memmap_stats start, end;
+
+    config.count = bytes / config.element_size;
+    config.syscalls = 0;
+    config.copied_bytes = 0;
+    reset_peak_rss();
+    for (unsigned run = 0; run < opts.repeat; ++run) {
+      eds_memmap_get_stats(&start);
+      runs.push_back(workload(config.count, latency) / config.count);
+      eds_memmap_get_stats(&end);
+      add_stats_delta(config, start, end);
+    }
+    config.syscalls /= opts.repeat;
+    config.copied_bytes /= opts.repeat;
+    std::sort(runs.begin(), runs.end());
+    config.ns_per_op = runs[runs.size() / 2];
+    config.events = latency.count() / opts.repeat;
+    config.event_p50_ns = latency.percentile(0.5);
+    config.event_p99_ns = latency.percentile(0.99);
+    config.peak_rss_kb = peak_rss_kb();
+    print_csv(out, config);
+  }
+}
+
+bool selected(const options& opts, const result& config)
+{
+  std::string name =
+    config.container + "/" + config.element + "/" + config.workload;
+
+  return name.find(opts.filter) != std::string::npos;
+}
+
+void print_csv_header(std::ostream& out)
+{
+  out << "container,element,element_size,workload,count,ns_per_op,"
+    "events,event_p50_ns,event_p99_ns,peak_rss_kb,syscalls,copied_bytes\n";
+}
+
+void print_csv(std::ostream& out, const result& r)
+{
+  out << r.container << ',' << r.element << ',' << r.element_size << ','
+    << r.workload << ',' << r.count << ',' << r.ns_per_op << ','
+    << r.events << ',' << r.event_p50_ns << ',' << r.event_p99_ns << ','
+    << r.peak_rss_kb << ',' << r.syscalls << ',' << r.copied_bytes
+    << std::endl;
+}
+
+}
+
+static void usage(const char* name)
+{
+  std::cerr << "Usage: " << name << " [options]\n"
+    "  --quick          only use sizes up to 4 MiB\n"
+    "  --max-bytes N    largest container size in bytes\n"
+    "  --repeat N       number of runs of each benchmark\n"
+    "  --filter TEXT    only run benchmarks whose\n"
+    "                   container/element/workload name contains TEXT\n"
+    "  --output FILE    write the CSV to FILE instead of stdout\n"
+    "  --huge-pages P   huge page policy of memmap: off, advise or tlb\n"
+    "  --huge-treshold N\n"
+    "                   smallest memmap storage using huge pages\n"
+    "  --mmap-treshold N\n"
+    "                   smallest memmap storage using mmap\n"
+    "  --calibrate      measure the mmap treshold on this host\n"
+    "  --cache-bytes N  keep up to N bytes of destroyed memmap storage\n"
+    "                   mapped for reuse\n"
+    "  --parallel-treshold N\n"
+    "                   smallest memmap fill or copy split across threads\n"
+    "  --worker-threads N\n"
+    "                   threads helping with large fills and copies\n"
+    "  --numa P         NUMA policy of memmap: default, bind:NODE,\n"
+    "                   preferred:NODE, interleave or local\n";
+}
+
+static bool parse_huge_pages(const char* name, eds_memmap_huge_pages& policy)
+{
+  if (std::strcmp(name, "off") == 0) {
+    policy = EDS_MEMMAP_HUGE_OFF;
+  }
+  else if (std::strcmp(name, "advise") == 0) {
+    policy = EDS_MEMMAP_HUGE_ADVISE;
+  }
+  else if (std::strcmp(name, "tlb") == 0) {
+    policy = EDS_MEMMAP_HUGE_TLB;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_numa(const char* name, eds_memmap_numa_policy& policy,
+                       int& node)
+{
+  const char* colon = std::strchr(name, ':');
+  size_t length = colon ? size_t(colon - name) : std::strlen(name);
+
+  node = colon ? std::atoi(colon + 1) : 0;
+  if (length == 7 and std::strncmp(name, "default", length) == 0) {
+    policy = EDS_MEMMAP_NUMA_DEFAULT;
+  }
+  else if (length == 4 and std::strncmp(name, "bind", length) == 0) {
+    policy = EDS_MEMMAP_NUMA_BIND;
+  }
+  else if (length == 9 and std::strncmp(name, "preferred", length) == 0) {
+    policy = EDS_MEMMAP_NUMA_PREFERRED;
+  }
+  else if (length == 10 and std::strncmp(name, "interleave", length) == 0) {
+    policy = EDS_MEMMAP_NUMA_INTERLEAVE;
+  }
+  else if (length == 5 and std::strncmp(name, "local", length) == 0) {
+    policy = EDS_MEMMAP_NUMA_LOCAL;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  benchmark::options opts;
+  std::ofstream output_file;
+  std::ostream* output = &std::cout;
+  eds_memmap_config config = {};
+
+  opts.min_bytes = 0x1000;
+  opts.max_bytes = 0x10000000;
+  opts.repeat = 3;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--quick") == 0) {
+      opts.max_bytes = 0x400000;
+      opts.repeat = 1;
+    }
+    else if (std::strcmp(argv[i], "--max-bytes") == 0 and i + 1 < argc) {
+      opts.max_bytes = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if (std::strcmp(argv[i], "--repeat") == 0 and i + 1 < argc) {
+      opts.repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 0));
+    }
+    else if (std::strcmp(argv[i], "--filter") == 0 and i + 1 < argc) {
+      opts.filter = argv[++i];
+    }
+    else if (std::strcmp(argv[i], "--output") == 0 and i + 1 < argc) {
+      output_file.open(argv[++i]);
+      if (not output_file) {
+        std::cerr << "Unable to open " << argv[i] << "\n";
+        return EXIT_FAILURE;
+      }
+      output = &output_file;
+    }
+    else if (std::strcmp(argv[i], "--huge-pages") == 0 and i + 1 < argc
+             and parse_huge_pages(argv[i + 1], config.huge_pages)) {
+      ++i;
+    }
+    else if (std::strcmp(argv[i], "--huge-treshold") == 0 and i + 1 < argc) {
+      config.huge_treshold = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if (std::strcmp(argv[i], "--mmap-treshold") == 0 and i + 1 < argc) {
+      config.mmap_treshold = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if (std::strcmp(argv[i], "--calibrate") == 0) {
+      config.calibrate = 1;
+    }
+    else if (std::strcmp(argv[i], "--cache-bytes") == 0 and i + 1 < argc) {
+      config.cache_bytes = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if (std::strcmp(argv[i], "--parallel-treshold") == 0
+             and i + 1 < argc)
+    {
+      config.parallel_treshold = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if (std::strcmp(argv[i], "--numa") == 0 and i + 1 < argc
+             and parse_numa(argv[i + 1], config.numa_policy,
+                            config.numa_node)) {
+      ++i;
+    }
+    else if (std::strcmp(argv[i], "--worker-threads") == 0 and i + 1 < argc) {
+      config.worker_threads = std::strtoul(argv[++i], nullptr, 0);
+    }
+    else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  eds_memmap_initialize(&config);
+  std::cerr << "mmap treshold: " << eds_memmap_get_mmap_treshold() << "\n";
+
+  *output << std::fixed << std::setprecision(2);
+  benchmark::print_csv_header(*output);
+  benchmark::run_vector_benchmarks(opts, *output);
+  benchmark::run_queue_benchmarks(opts, *output);
+  benchmark::run_file_benchmarks(opts, *output);
+
+  return EXIT_SUCCESS;
+}
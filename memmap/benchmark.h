@@ -2,27 +2,94 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
-#ifdef USE_MEMMAP
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
 
-#include "memmap.h"
-typedef eds::memmap<int> int_vector_type;
-static constexpr char vector_name[] = "mremap_vector";
+namespace benchmark
+{
 
-#elif defined(USE_REALLOC_VECTOR)
+typedef std::chrono::steady_clock clock;
 
-#include "realloc_vector.h"
-typedef eds::realloc_vector<int> int_vector_type;
-static constexpr char vector_name[] = "realloc_vector";
+struct options
+{
+  size_t min_bytes;
+  size_t max_bytes;
+  unsigned repeat;
+  std::string filter;
+};
 
-#else
+/* One line of the CSV output */
+struct result
+{
+  std::string container;
+  std::string element;
+  std::string workload;
+  size_t element_size;
+  size_t count;
+  double ns_per_op;
+  size_t events;
+  double event_p50_ns;
+  double event_p99_ns;
+  size_t peak_rss_kb;
+  size_t syscalls;
+  size_t copied_bytes;
+};
 
-#include <vector>
-typedef ::std::vector<int> int_vector_type;
-static constexpr char vector_name[] = "std::vector";
+/* Collects the latency of individual growth (or shrink) steps,
+   the steps not growing the container are not timed at all.
+*/
+class latency_recorder
+{
+private:
+
+  std::vector<double> samples;
+
+public:
+
+  void add(clock::time_point start, clock::time_point end)
+  {
+    samples.push_back(
+      std::chrono::duration<double, std::nano>(end - start).count());
+  }
+
+  size_t count() const noexcept
+  {
+    return samples.size();
+  }
+
+  double percentile(double p);
+};
+
+double elapsed_ns(clock::time_point start, clock::time_point end);
+
+/* Each workload returns the total time spent on count elements, and
+   records the latency of every step growing (or shrinking) the storage.
+*/
+typedef double (*workload_function)(size_t count, latency_recorder&);
+
+/* Runs a workload for each size, writing a line of config per size */
+void run_workload(const options&, std::ostream&, result config,
+                  workload_function);
+
+void reset_peak_rss();
+size_t peak_rss_kb();
+
+/* Ends the benchmark with an error when a workload got a wrong result,
+   assert is compiled out of the benchmark.
+*/
+void check(bool condition, const char* what);
+
+bool selected(const options&, const result&);
+void print_csv_header(std::ostream&);
+void print_csv(std::ostream&, const result&);
 
-#endif
+void run_vector_benchmarks(const options&, std::ostream&);
+void run_queue_benchmarks(const options&, std::ostream&);
+void run_file_benchmarks(const options&, std::ostream&);
 
-void stress_vector(int_vector_type&);
-void loop_stress_vector();
+}
 
 #endif /* BENCHMARK_H */
@@ -0,0 +1,327 @@
+
+#ifndef EDS_CONCURRENT_MEMMAP_H
+#define EDS_CONCURRENT_MEMMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "eds_memmap.h"
+
+namespace eds
+{
+
+/* An array which many threads append to at the same time, without
+   locks, in a reserved range of address space, see
+   memmap::reserve_address_space. The elements never move.
+
+   A thread appending claims the next index with a fetch_add on the
+   number of claimed elements, constructs the element there, and sets
+   the bit of the index in a bitmap, which lives in a reserved range
+   of its own. The pages of both are committed as the array grows,
+   by the first thread needing them, while the threads needing the
+   same pages wait for it.
+   size() is the published watermark: the number of elements from the
+   first one which are complete. Readers may access those from any
+   thread, while appends go on behind them.
+
+   Constructing an element must not throw, a claimed index which is
+   never completed would stop the watermark there. Appending beyond
+   the reserved range, or failing to commit pages, throws
+   std::bad_alloc, and the elements behind the first index which
+   failed are not published either.
+*/
+template<typename type>
+class concurrent_memmap
+{
+private:
+
+    typedef std::atomic<uint64_t> word_type;
+    static constexpr size_t word_bits = 64;
+
+    /* The smallest growth step, in bytes */
+    static constexpr size_t min_commit = 0x10000;
+
+    static constexpr size_t cache_line = 64;
+
+    type* head;
+    word_type* bitmap;
+    size_t max_count;
+    char head_padding[cache_line];
+
+    std::atomic<size_t> claimed;
+    char claimed_padding[cache_line];
+
+    /* Elements backed by committed pages, for the elements as well as
+       their bits.
+    */
+    std::atomic<size_t> committed;
+    std::atomic<bool> growing;
+    char committed_padding[cache_line];
+
+    mutable std::atomic<size_t> published;
+
+    static size_t bitmap_bytes(size_t count) noexcept
+    {
+        return (count + word_bits - 1) / word_bits * sizeof(word_type);
+    }
+
+    /* Commits the pages of at least count elements, or waits
+       for the thread committing them.
+    */
+    void commit(size_t count)
+    {
+        while (committed.load(std::memory_order_acquire) < count) {
+            bool expected = false;
+
+            if (not growing.compare_exchange_weak(expected, true,
+                                                  std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            try {
+                grow(count);
+            }
+            catch (...) {
+                growing.store(false, std::memory_order_release);
+                throw;
+            }
+            growing.store(false, std::memory_order_release);
+        }
+    }
+
+    /* Runs in one thread at a time, doubling the committed pages */
+    void grow(size_t count)
+    {
+        size_t old_count = committed.load(std::memory_order_relaxed);
+        size_t new_count;
+
+        if (old_count >= count) {
+            return;
+        }
+        new_count = std::max(count, std::max(2 * old_count,
+                                             min_commit / sizeof(type)));
+        new_count = std::min(new_count, max_count);
+        if (eds_memmap_commit_high((char*)(void*)head,
+                                   old_count * sizeof(type),
+                                   (new_count - old_count) * sizeof(type))
+                == nullptr
+            or eds_memmap_commit_high((char*)(void*)bitmap,
+                                      bitmap_bytes(old_count),
+                                      bitmap_bytes(new_count)
+                                      - bitmap_bytes(old_count))
+                == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        committed.store(new_count, std::memory_order_release);
+    }
+
+    /* Claims count indexes, with their pages committed */
+    size_t claim(size_t count)
+    {
+        size_t index = claimed.fetch_add(count, std::memory_order_relaxed);
+
+        if (index > max_count or count > max_count - index) {
+            throw std::bad_alloc();
+        }
+        commit(index + count);
+        return index;
+    }
+
+    /* Publishes the elements [index, index + count) */
+    void complete(size_t index, size_t count) noexcept
+    {
+        while (count != 0) {
+            size_t bit = index % word_bits;
+            size_t bits = std::min(count, word_bits - bit);
+            uint64_t mask = (bits == word_bits ? ~uint64_t(0)
+                                               : (uint64_t(1) << bits) - 1);
+
+            bitmap[index / word_bits].fetch_or(mask << bit,
+                                               std::memory_order_release);
+            index += bits;
+            count -= bits;
+        }
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef type& reference;
+    typedef const type& const_reference;
+    typedef const type* const_iterator;
+
+    /* Reserves address space for max_count elements */
+    explicit concurrent_memmap(size_type count):
+        head(nullptr),
+        bitmap(nullptr),
+        max_count(count),
+        claimed(0),
+        committed(0),
+        growing(false),
+        published(0)
+    {
+        if (count == 0 or count > ((size_t(0) - 1) / 2) / sizeof(type)) {
+            throw std::bad_alloc();
+        }
+        head = (type*)(void*)eds_memmap_reserve(count * sizeof(type));
+        bitmap = (word_type*)(void*)eds_memmap_reserve(bitmap_bytes(count));
+        if (head == nullptr or bitmap == nullptr) {
+            release();
+            throw std::bad_alloc();
+        }
+    }
+
+    concurrent_memmap(const concurrent_memmap&) = delete;
+    concurrent_memmap& operator=(const concurrent_memmap&) = delete;
+
+    /* No thread may be appending anymore */
+    ~concurrent_memmap()
+    {
+        size_t count = size();
+
+        for (size_t index = 0; index < count; ++index) {
+            head[index].~type();
+        }
+        release();
+    }
+
+    size_type max_size() const noexcept
+    {
+        return max_count;
+    }
+
+    /* Safe to call from any thread, returns the index of the element */
+    size_type push_back(const type& value)
+    {
+        return emplace_back(value);
+    }
+
+    size_type push_back(type&& value)
+    {
+        return emplace_back(std::move(value));
+    }
+
+    template<typename... arg_types>
+    size_type emplace_back(arg_types&&... ctor_args)
+    {
+        static_assert(std::is_nothrow_constructible<type, arg_types...>::value,
+                      "a claimed element must be completed");
+
+        size_t index = claim(1);
+
+        ::new((void*)(head + index)) type(std::forward<arg_types>(ctor_args)...);
+        complete(index, 1);
+        return index;
+    }
+
+    /* Appends count items as one block, claimed with a single fetch_add,
+       returns the index of the first one.
+    */
+    size_type append(const type* items, size_type count)
+    {
+        static_assert(std::is_nothrow_copy_constructible<type>::value,
+                      "a claimed element must be completed");
+
+        size_t index = claim(count);
+
+        if (std::is_trivially_copyable<type>::value) {
+            std::memcpy((void*)(head + index), (const void*)items,
+                        count * sizeof(type));
+        }
+        else {
+            for (size_t item = 0; item < count; ++item) {
+                ::new((void*)(head + index + item)) type(items[item]);
+            }
+        }
+        complete(index, count);
+        return index;
+    }
+
+    /* The number of complete elements from the first one, which only
+       grows. Whoever reads it advances it over the bits set since.
+    */
+    size_type size() const noexcept
+    {
+        size_t done = published.load(std::memory_order_acquire);
+        size_t end = done;
+        size_t limit = committed.load(std::memory_order_acquire);
+
+        while (end < limit) {
+            uint64_t word = bitmap[end / word_bits].load(
+                std::memory_order_acquire) >> (end % word_bits);
+            size_t ones = (~word == 0 ? word_bits - end % word_bits
+                                      : __builtin_ctzll(~word));
+
+            end += ones;
+            if (ones == 0 or end % word_bits != 0) {
+                break;
+            }
+        }
+        end = std::min(end, limit);
+        while (done < end
+               and not published.compare_exchange_weak(
+                   done, end, std::memory_order_acq_rel,
+                   std::memory_order_acquire))
+        {
+        }
+        return std::max(done, end);
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    /* Only for positions below a size() seen before */
+    const_reference operator[](size_type position) const noexcept
+    {
+        return head[position];
+    }
+
+    reference operator[](size_type position) noexcept
+    {
+        return head[position];
+    }
+
+    const type* data() const noexcept
+    {
+        return head;
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return head;
+    }
+
+    /* The end of the published elements */
+    const_iterator cend() const noexcept
+    {
+        return head + size();
+    }
+
+private:
+
+    void release() noexcept
+    {
+        if (head != nullptr) {
+            eds_memmap_release((char*)(void*)head, max_count * sizeof(type));
+        }
+        if (bitmap != nullptr) {
+            eds_memmap_release((char*)(void*)bitmap, bitmap_bytes(max_count));
+        }
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_CONCURRENT_MEMMAP_H */
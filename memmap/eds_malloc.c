@@ -0,0 +1,286 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+/* malloc, calloc, realloc, free and posix_memalign, for LD_PRELOAD:
+
+     LD_PRELOAD=./libeds_malloc.so program
+
+   Blocks of at least the treshold are eds_memmap regions, so realloc
+   grows them with mremap, instead of copying their bytes, and
+   everything else is forwarded to the malloc of glibc.
+
+   A large block starts with a header, right in front of the pointer
+   handed out, in the place of the size field of a glibc chunk. Sizes
+   of glibc chunks are multiples of 16, with flags in the lowest three
+   bits, so the fourth bit marks a large block.
+
+   Environment:
+     EDS_MALLOC_TRESHOLD    the smallest block mapped as an eds_memmap
+                            region, at least the mmap treshold,
+                            which it sets
+     EDS_MALLOC_CACHE_BYTES the cache_bytes of eds_memmap_config
+*/
+
+#include "eds_memmap.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef RSIZE_MAX
+#define RSIZE_MAX (SIZE_MAX / 2)
+#endif
+
+/* The allocator of glibc, under its own names */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* mem, size_t size);
+extern void __libc_free(void* mem);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+#define LARGE_BLOCK 8
+#define HEADER_SIZE 16
+
+struct block_header
+{
+    size_t size;  /* bytes of the region */
+    size_t tag;   /* the offset of the block in the region, shifted
+                     left by 4, or'ed with LARGE_BLOCK */
+};
+
+/* Until the constructor ran, every block goes to glibc */
+static size_t large_treshold = SIZE_MAX;
+static size_t (*libc_usable_size)(void*);
+
+static size_t
+read_size(const char* name, size_t default_value)
+{
+    const char* value = getenv(name);
+
+    if (value == NULL || *value == 0) {
+        return default_value;
+    }
+    return strtoull(value, NULL, 0);
+}
+
+__attribute__((constructor))
+static void
+initialize(void)
+{
+    struct eds_memmap_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.mmap_treshold = read_size("EDS_MALLOC_TRESHOLD", 0);
+    config.cache_bytes = read_size("EDS_MALLOC_CACHE_BYTES", 0);
+    eds_memmap_initialize(&config);
+    /* The POSIX way of converting dlsym's result to a function */
+    *(void**)&libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    /* Smaller regions live in malloc'd memory, which would come
+       back here.
+    */
+    large_treshold = eds_memmap_get_mmap_treshold();
+}
+
+static struct block_header*
+header_of(void* mem)
+{
+    return (struct block_header*)((char*)mem - HEADER_SIZE);
+}
+
+static bool
+is_large(void* mem)
+{
+    return (header_of(mem)->tag & LARGE_BLOCK) != 0;
+}
+
+static size_t
+offset_of(void* mem)
+{
+    return header_of(mem)->tag >> 4;
+}
+
+static char*
+region_of(void* mem)
+{
+    return (char*)mem - offset_of(mem);
+}
+
+/* Places the block at offset in the region of size bytes */
+static void*
+tag_block(char* region, size_t size, size_t offset)
+{
+    struct block_header* header;
+
+    header = (struct block_header*)(region + offset - HEADER_SIZE);
+    header->size = size;
+    header->tag = (offset << 4) | LARGE_BLOCK;
+    return region + offset;
+}
+
+/* offset is a multiple of 16, up to the page size, regions of the
+   treshold or more start on a page.
+*/
+static void*
+large_malloc(size_t size, size_t offset, bool zeroed)
+{
+    char* region;
+
+    if (size > RSIZE_MAX - offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (zeroed) {
+        region = eds_memmap_expand_high_zeroed(NULL, 0, offset + size);
+    }
+    else {
+        region = eds_memmap_create(offset + size);
+    }
+    if (region == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return tag_block(region, offset + size, offset);
+}
+
+static void
+large_free(void* mem)
+{
+    eds_memmap_destroy(region_of(mem), header_of(mem)->size);
+}
+
+/* Grows or shrinks the region at its end. Shrinking below the mmap
+   treshold moves it to malloc'd memory, where it stays a large block.
+*/
+static void*
+large_realloc(void* mem, size_t size)
+{
+    size_t offset = offset_of(mem);
+    size_t old_size = header_of(mem)->size;
+    char* region;
+
+    if (size > RSIZE_MAX - offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    else if (offset + size > old_size) {
+        region = eds_memmap_expand_high(region_of(mem), old_size,
+                                        offset + size - old_size);
+    }
+    else if (offset + size < old_size) {
+        region = eds_memmap_shrink_high(region_of(mem), old_size,
+                                        old_size - (offset + size));
+    }
+    else {
+        return mem;
+    }
+    if (region == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return tag_block(region, offset + size, offset);
+}
+
+void* malloc(size_t size)
+{
+    if (size < large_treshold) {
+        return __libc_malloc(size);
+    }
+    return large_malloc(size, HEADER_SIZE, false);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    else if (count * size < large_treshold) {
+        return __libc_calloc(count, size);
+    }
+    return large_malloc(count * size, HEADER_SIZE, true);
+}
+
+void free(void* mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+    else if (is_large(mem)) {
+        large_free(mem);
+    }
+    else {
+        __libc_free(mem);
+    }
+}
+
+/* A block of glibc growing beyond the treshold is copied into a large
+   block once, from then on it grows with mremap.
+*/
+void* realloc(void* mem, size_t size)
+{
+    void* new_mem;
+
+    if (mem == NULL) {
+        return malloc(size);
+    }
+    else if (size == 0) {
+        free(mem);
+        return NULL;
+    }
+    else if (is_large(mem)) {
+        return large_realloc(mem, size);
+    }
+    else if (size < large_treshold) {
+        return __libc_realloc(mem, size);
+    }
+    new_mem = large_malloc(size, HEADER_SIZE, false);
+    if (new_mem != NULL) {
+        size_t old_size = libc_usable_size(mem);
+
+        memcpy(new_mem, mem, old_size < size ? old_size : size);
+        __libc_free(mem);
+    }
+    return new_mem;
+}
+
+/* Large blocks are aligned within their first page, beyond that
+   glibc aligns them.
+*/
+int posix_memalign(void** mem, size_t alignment, size_t size)
+{
+    void* new_mem;
+
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    else if (size < large_treshold
+             || alignment > eds_memmap_get_page_size())
+    {
+        new_mem = __libc_memalign(alignment, size);
+    }
+    else {
+        new_mem = large_malloc(size, alignment < HEADER_SIZE ? HEADER_SIZE
+                                                             : alignment,
+                               false);
+    }
+    if (new_mem == NULL) {
+        return ENOMEM;
+    }
+    *mem = new_mem;
+    return 0;
+}
+
+size_t malloc_usable_size(void* mem)
+{
+    if (mem == NULL) {
+        return 0;
+    }
+    else if (is_large(mem)) {
+        return header_of(mem)->size - offset_of(mem);
+    }
+    return libc_usable_size(mem);
+}
@@ -0,0 +1,178 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+/* Checks the allocator of libeds_malloc.so, run as
+
+     EDS_MALLOC_TRESHOLD=262144 LD_PRELOAD=./libeds_malloc.so \
+         ./eds_malloc_check
+
+   (make check_malloc). Large blocks tell themselves from glibc's by a
+   bit of the word in front of them, which is part of the size of a
+   glibc chunk, so blocks of glibc, also aligned ones it handed out
+   directly, are freed and resized through the shim here.
+*/
+
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRESHOLD ((size_t)262144)
+
+static int failures;
+
+static void
+check(bool condition, const char* what)
+{
+    if (!condition) {
+        fprintf(stderr, "check failed: %s\n", what);
+        ++failures;
+    }
+}
+
+static void
+fill(unsigned char* mem, size_t size)
+{
+    size_t index;
+
+    for (index = 0; index < size; ++index) {
+        mem[index] = (unsigned char)(index * 7 + index / 251);
+    }
+}
+
+static bool
+is_filled(const unsigned char* mem, size_t size)
+{
+    size_t index;
+
+    for (index = 0; index < size; ++index) {
+        if (mem[index] != (unsigned char)(index * 7 + index / 251)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+is_zero(const unsigned char* mem, size_t size)
+{
+    size_t index;
+
+    for (index = 0; index < size; ++index) {
+        if (mem[index] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Blocks of glibc are at least as large as asked for, and the ones
+   of the shim hold exactly that.
+*/
+static void
+check_malloc_free(void)
+{
+    size_t small = 1000;
+    size_t large = 2 * TRESHOLD + 5;
+    unsigned char* small_mem = malloc(small);
+    unsigned char* large_mem = malloc(large);
+    unsigned char* zeroed = calloc(large, 1);
+
+    check(small_mem != NULL && large_mem != NULL && zeroed != NULL,
+          "malloc");
+    check(malloc_usable_size(large_mem) == large,
+          "malloc maps blocks of the treshold or more, is it preloaded?");
+    check(malloc_usable_size(small_mem) >= small,
+          "malloc_usable_size of a glibc block");
+    check(is_zero(zeroed, large), "calloc of a large block");
+    fill(small_mem, small);
+    fill(large_mem, large);
+    check(is_filled(small_mem, small) && is_filled(large_mem, large),
+          "malloc");
+    free(small_mem);
+    free(large_mem);
+    free(zeroed);
+}
+
+/* A block grows from glibc's across the treshold, with mremap beyond
+   it, and shrinks back below it again, keeping its bytes.
+*/
+static void
+check_realloc(void)
+{
+    size_t sizes[] = {100, TRESHOLD - 100, TRESHOLD + 100, 4 * TRESHOLD,
+                      16 * TRESHOLD + 3, TRESHOLD + 1, TRESHOLD / 2, 50};
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char* mem = NULL;
+    size_t kept = 0;
+    size_t index;
+
+    for (index = 0; index < count; ++index) {
+        unsigned char* new_mem = realloc(mem, sizes[index]);
+
+        check(new_mem != NULL, "realloc");
+        if (new_mem == NULL) {
+            free(mem);
+            return;
+        }
+        mem = new_mem;
+        check(is_filled(mem, kept < sizes[index] ? kept : sizes[index]),
+              "realloc keeps the bytes across the treshold");
+        check(malloc_usable_size(mem) >= sizes[index],
+              "malloc_usable_size of a reallocated block");
+        fill(mem, sizes[index]);
+        kept = sizes[index];
+    }
+    free(mem);
+}
+
+/* Aligned blocks of the shim, of glibc through posix_memalign, and of
+   glibc directly, through memalign, which the shim leaves alone.
+*/
+static void
+check_aligned(void)
+{
+    size_t alignments[] = {8, 64, 4096, 65536};
+    size_t count = sizeof(alignments) / sizeof(alignments[0]);
+    size_t sizes[] = {100, 2 * TRESHOLD + 5};
+    void* unaligned = NULL;
+    size_t index;
+    size_t which;
+
+    for (index = 0; index < count; ++index) {
+        size_t alignment = alignments[index];
+
+        for (which = 0; which < 2; ++which) {
+            void* mem = NULL;
+            unsigned char* direct = memalign(alignment, sizes[which]);
+
+            check(posix_memalign(&mem, alignment, sizes[which]) == 0
+                  && (size_t)mem % alignment == 0,
+                  "posix_memalign");
+            check(direct != NULL && (size_t)direct % alignment == 0,
+                  "memalign");
+            check(malloc_usable_size(mem) >= sizes[which]
+                  && malloc_usable_size(direct) >= sizes[which],
+                  "malloc_usable_size of an aligned block");
+            fill(mem, sizes[which]);
+            fill(direct, sizes[which]);
+            direct = realloc(direct, 3 * sizes[which]);
+            check(direct != NULL && is_filled(direct, sizes[which]),
+                  "realloc of a memalign block");
+            free(mem);
+            free(direct);
+        }
+    }
+    check(posix_memalign(&unaligned, 3, 100) != 0 && unaligned == NULL,
+          "posix_memalign of an alignment which isn't a power of two");
+}
+
+int
+main(void)
+{
+    check_malloc_free();
+    check_realloc();
+    check_aligned();
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
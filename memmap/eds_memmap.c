@@ -10,22 +10,37 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <linux/mempolicy.h>
 
 #ifndef RSIZE_MAX
 #define RSIZE_MAX (SIZE_MAX / 2)
 #endif
 
 /* all allocation with size below mmap_treshold
-   are just forwarded to libc malloc/free
+   are just forwarded to libc malloc/free.
+   It is only set by eds_memmap_initialize, changing it while
+   regions exist would confuse malloc'd and mmap'd regions.
 */
-#ifdef EDS_MMAP_TRESHOLD
-static const size_t mmap_treshold = EDS_MMAP_TRESHOLD;
-#else
-static const size_t mmap_treshold = 0x20000;
+#ifndef EDS_MMAP_TRESHOLD
+#define EDS_MMAP_TRESHOLD 0x20000
 #endif
+static size_t mmap_treshold = EDS_MMAP_TRESHOLD;
 
 
 /* Forgetting to call eds_memmap_initialize leaves page_size at zero,
@@ -34,12 +49,247 @@ static const size_t mmap_treshold = 0x20000;
 static size_t page_size;
 static size_t page_mask;
 
+/* Regions of at least huge_treshold bytes are aligned to, and sized in
+   multiples of huge_page_size when huge pages are enabled.
+   This is the allocation unit of the region, while all other
+   mmap'd regions use page_size as their unit.
+*/
+static enum eds_memmap_huge_pages huge_pages = EDS_MEMMAP_HUGE_OFF;
+static size_t huge_page_size;
+static size_t huge_treshold = SIZE_MAX;
+
+/* The NUMA policy of new mappings, see eds_memmap_set_numa_policy.
+   numa_nodes is one more than the highest online node, and a single
+   node makes all policies no-ops.
+*/
+#define MAX_NUMA_NODES 1024
+static enum eds_memmap_numa_policy numa_policy = EDS_MEMMAP_NUMA_DEFAULT;
+static int numa_node;
+static int numa_nodes = 1;
+
+/* Limits of the cache of released mappings, disabled while
+   cache_bytes is zero. See mapping_cache.
+*/
+#define DEFAULT_CACHE_MAX_AGE_MS 1000
+static size_t cache_bytes;
+static size_t thread_cache_bytes;
+static uint64_t cache_max_age_ns;
+
+/* eds_memmap_fill and eds_memmap_copy split operations of at least
+   parallel_treshold bytes across the worker threads, and use
+   non-temporal stores for operations of at least stream_treshold
+   bytes, which wouldn't fit in the cache anyway.
+*/
+#define DEFAULT_PARALLEL_TRESHOLD 0x1000000
+#define DEFAULT_MAX_WORKERS 7
+#define DEFAULT_STREAM_TRESHOLD 0x800000
+static size_t parallel_treshold = DEFAULT_PARALLEL_TRESHOLD;
+static size_t stream_treshold = DEFAULT_STREAM_TRESHOLD;
+static unsigned worker_count;
+
+/* Per thread state: the statistics counters, and the cache of
+   released mappings. The destructor of thread_key cleans up
+   after an exiting thread.
+*/
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread bool thread_registered;
+
+static void flush_thread_cache(void);
+
+#ifndef EDS_MEMMAP_NO_STATS
+
+/* Each thread counts events in its own thread_stats, only ever written
+   by that thread. The stores are relaxed atomics, plain stores on any
+   common architecture, so eds_memmap_get_stats can read the counters
+   of other threads. The counters of exited threads are added to
+   retired_stats.
+   The byte counts describe the whole process, they are updated with
+   atomic additions, along with the system calls changing them.
+*/
+struct thread_stats
+{
+    struct eds_memmap_stats counters;
+    struct thread_stats* next;
+};
+
+static __thread struct thread_stats thread_stats;
+static struct thread_stats* all_thread_stats;
+static struct eds_memmap_stats retired_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t mapped_bytes;
+static size_t peak_mapped_bytes;
+static size_t cached_bytes;
+static size_t reserved_bytes;
+
+static void register_thread(void);
+
+static void
+count_event(size_t* counter, size_t n)
+{
+    if (!thread_registered) {
+        register_thread();
+    }
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void
+count_bytes(size_t* total, size_t added, size_t removed)
+{
+    __atomic_add_fetch(total, added - removed, __ATOMIC_RELAXED);
+}
+
+static void
+count_mapped(size_t added, size_t removed)
+{
+    size_t mapped;
+    size_t peak;
+
+    mapped = __atomic_add_fetch(&mapped_bytes, added - removed,
+                                __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&peak_mapped_bytes, __ATOMIC_RELAXED);
+    while (mapped > peak
+           && !__atomic_compare_exchange_n(&peak_mapped_bytes, &peak, mapped,
+                                           true, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+    {
+    }
+}
+
+#define COUNT(counter, n) count_event(&thread_stats.counters.counter, (n))
+#define COUNT_MAPPED(added, removed) count_mapped((added), (removed))
+#define COUNT_CACHED(added, removed) \
+    count_bytes(&cached_bytes, (added), (removed))
+#define COUNT_RESERVED(added, removed) \
+    count_bytes(&reserved_bytes, (added), (removed))
+
+static void
+add_stats(struct eds_memmap_stats* sum, const struct eds_memmap_stats* stats)
+{
+#define ADD_COUNTER(counter) \
+    sum->counter += __atomic_load_n(&stats->counter, __ATOMIC_RELAXED)
+
+    ADD_COUNTER(mmap_calls);
+    ADD_COUNTER(mremap_in_place);
+    ADD_COUNTER(mremap_moved);
+    ADD_COUNTER(munmap_calls);
+    ADD_COUNTER(mprotect_calls);
+    ADD_COUNTER(madvise_calls);
+    ADD_COUNTER(mbind_calls);
+    ADD_COUNTER(malloc_calls);
+    ADD_COUNTER(realloc_calls);
+    ADD_COUNTER(free_calls);
+    ADD_COUNTER(copied_small_to_large);
+    ADD_COUNTER(copied_large_to_small);
+    ADD_COUNTER(copied_large_to_large);
+    ADD_COUNTER(cache_hits);
+    ADD_COUNTER(cache_misses);
+
+#undef ADD_COUNTER
+}
+
+static void
+link_thread_stats(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    thread_stats.next = all_thread_stats;
+    all_thread_stats = &thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void
+retire_thread_stats(void)
+{
+    struct thread_stats** link;
+
+    pthread_mutex_lock(&stats_lock);
+    for (link = &all_thread_stats; *link != NULL; link = &(*link)->next) {
+        if (*link == &thread_stats) {
+            *link = thread_stats.next;
+            break;
+        }
+    }
+    add_stats(&retired_stats, &thread_stats.counters);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void eds_memmap_get_stats(struct eds_memmap_stats* stats)
+{
+    struct thread_stats* thread;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&stats_lock);
+    add_stats(stats, &retired_stats);
+    for (thread = all_thread_stats; thread != NULL; thread = thread->next) {
+        add_stats(stats, &thread->counters);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    stats->peak_mapped_bytes = __atomic_load_n(&peak_mapped_bytes,
+                                               __ATOMIC_RELAXED);
+    stats->cached_bytes = __atomic_load_n(&cached_bytes, __ATOMIC_RELAXED);
+    stats->reserved_bytes = __atomic_load_n(&reserved_bytes,
+                                            __ATOMIC_RELAXED);
+}
+
+#else /* EDS_MEMMAP_NO_STATS */
+
+#define COUNT(counter, n) ((void)0)
+#define COUNT_MAPPED(added, removed) ((void)0)
+#define COUNT_CACHED(added, removed) ((void)0)
+#define COUNT_RESERVED(added, removed) ((void)0)
+
+static void link_thread_stats(void) {}
+static void retire_thread_stats(void) {}
+
+void eds_memmap_get_stats(struct eds_memmap_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif /* EDS_MEMMAP_NO_STATS */
+
+static void
+thread_exit(void* unused)
+{
+    (void)unused;
+    flush_thread_cache();
+    retire_thread_stats();
+    thread_registered = false;
+}
+
+static void
+create_thread_key(void)
+{
+    if (pthread_key_create(&thread_key, thread_exit) != 0) {
+        abort();
+    }
+}
+
+static void
+register_thread(void)
+{
+    if (!thread_registered) {
+        thread_registered = true;
+        pthread_once(&thread_key_once, create_thread_key);
+        (void)pthread_setspecific(thread_key, &thread_key);
+        link_thread_stats();
+    }
+}
+
 static bool is_power_of_two(size_t value)
 {
     return (value & ~(value - 1)) == value;
 }
 
-void eds_memmap_initialize(void)
+static size_t calibrate_mmap_treshold(void);
+static void configure_workers(const struct eds_memmap_config* config);
+static int count_numa_nodes(void);
+
+void eds_memmap_initialize(const struct eds_memmap_config* config)
 {
     long sysconf_result;
 
@@ -52,55 +302,352 @@ void eds_memmap_initialize(void)
         abort();
     }
     page_mask = ~(page_size - 1);
+
+    mmap_treshold = EDS_MMAP_TRESHOLD;
+    configure_workers(config);
+    numa_nodes = count_numa_nodes();
+    if (config == NULL) {
+        return;
+    }
+    if (config->calibrate) {
+        mmap_treshold = calibrate_mmap_treshold();
+    }
+    else if (config->mmap_treshold != 0) {
+        mmap_treshold = config->mmap_treshold;
+    }
+    if (mmap_treshold < page_size) {
+        mmap_treshold = page_size;
+    }
+    else if (mmap_treshold > RSIZE_MAX) {
+        mmap_treshold = RSIZE_MAX;
+    }
+    eds_memmap_set_huge_pages(config->huge_pages, config->huge_treshold);
+    eds_memmap_set_numa_policy(config->numa_policy, config->numa_node);
+
+    cache_bytes = config->cache_bytes;
+    thread_cache_bytes = config->thread_cache_bytes;
+    if (thread_cache_bytes == 0 || thread_cache_bytes > cache_bytes) {
+        thread_cache_bytes = cache_bytes;
+    }
+    cache_max_age_ns = config->cache_max_age_ms;
+    if (cache_max_age_ns == 0) {
+        cache_max_age_ns = DEFAULT_CACHE_MAX_AGE_MS;
+    }
+    cache_max_age_ns *= 1000000;
+}
+
+size_t eds_memmap_get_mmap_treshold(void)
+{
+    return mmap_treshold;
+}
+
+size_t eds_memmap_get_page_size(void)
+{
+    return page_size;
+}
+
+/* Reads a value such as "Hugepagesize:    2048 kB" from /proc/meminfo,
+   without using malloc.
+*/
+static size_t
+meminfo_bytes(const char* key)
+{
+    char buffer[0x2000];
+    size_t length = 0;
+    ssize_t count;
+    char* line;
+    int fd;
+
+    fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    while (length < sizeof(buffer) - 1
+           && (count = read(fd, buffer + length,
+                            sizeof(buffer) - 1 - length)) > 0)
+    {
+        length += count;
+    }
+    close(fd);
+    buffer[length] = '\0';
+
+    for (line = buffer; line != NULL; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            ++line;
+        }
+        if (strncmp(line, key, strlen(key)) == 0) {
+            return strtoul(line + strlen(key), NULL, 10) * 1024;
+        }
+    }
+    return 0;
 }
 
-static ptrdiff_t
-in_page_offset(char* address)
+void eds_memmap_set_huge_pages(enum eds_memmap_huge_pages policy,
+                               size_t treshold)
 {
     assert(page_size != 0);
-    return ((uintptr_t)address) % page_size;
+
+    if (policy == EDS_MEMMAP_HUGE_OFF) {
+        huge_pages = policy;
+        huge_treshold = SIZE_MAX;
+        return;
+    }
+
+    huge_page_size = meminfo_bytes("Hugepagesize:");
+    if (huge_page_size < page_size || !is_power_of_two(huge_page_size)) {
+        huge_page_size = 0x200000;
+    }
+    if (treshold < huge_page_size) {
+        treshold = huge_page_size;
+    }
+    if (treshold < mmap_treshold) {
+        treshold = mmap_treshold;
+    }
+    huge_pages = policy;
+    huge_treshold = treshold;
+}
+
+/* Reads the highest node in a list such as "0-3,5" from
+   /sys/devices/system/node/online, without using malloc.
+*/
+static int
+count_numa_nodes(void)
+{
+    char list[256];
+    ssize_t length;
+    long highest = 0;
+    char* next;
+    int fd;
+
+    fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 1;
+    }
+    list[length] = 0;
+    for (next = list; *next != 0; ) {
+        long node = strtol(next, &next, 10);
+
+        if (node > highest) {
+            highest = node;
+        }
+        if (*next == 0 || *next == '\n') {
+            break;
+        }
+        ++next;
+    }
+    if (highest >= MAX_NUMA_NODES) {
+        highest = MAX_NUMA_NODES - 1;
+    }
+    return (int)highest + 1;
+}
+
+int eds_memmap_numa_nodes(void)
+{
+    return numa_nodes;
+}
+
+void eds_memmap_set_numa_policy(enum eds_memmap_numa_policy policy, int node)
+{
+    numa_policy = policy;
+    numa_node = node;
+}
+
+/* Sets the policy of the pages [begin, end), and moves the pages
+   already there to match it.
+*/
+static int
+bind_pages(char* begin, char* end,
+           enum eds_memmap_numa_policy policy, int node)
+{
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    int mode;
+    int index;
+
+    if (numa_nodes == 1 || begin >= end) {
+        return 0;
+    }
+    memset(mask, 0, sizeof(mask));
+    switch (policy) {
+    case EDS_MEMMAP_NUMA_BIND:
+    case EDS_MEMMAP_NUMA_PREFERRED:
+        if (node < 0 || node >= numa_nodes) {
+            return -1;
+        }
+        mask[node / (8 * sizeof(unsigned long))] =
+            1ul << (node % (8 * sizeof(unsigned long)));
+        mode = policy == EDS_MEMMAP_NUMA_BIND ? MPOL_BIND : MPOL_PREFERRED;
+        break;
+    case EDS_MEMMAP_NUMA_INTERLEAVE:
+        for (index = 0; index < numa_nodes; ++index) {
+            mask[index / (8 * sizeof(unsigned long))] |=
+                1ul << (index % (8 * sizeof(unsigned long)));
+        }
+        mode = MPOL_INTERLEAVE;
+        break;
+    case EDS_MEMMAP_NUMA_LOCAL:
+        mode = MPOL_LOCAL;
+        break;
+    default:
+        mode = MPOL_DEFAULT;
+        break;
+    }
+    COUNT(mbind_calls, 1);
+    return syscall(SYS_mbind, begin, (unsigned long)(end - begin), mode,
+                   mode == MPOL_DEFAULT || mode == MPOL_LOCAL ? NULL : mask,
+                   (unsigned long)numa_nodes + 1,
+                   (unsigned)MPOL_MF_MOVE) == 0 ? 0 : -1;
+}
+
+/* New mappings follow the global policy, failing to set it
+   only leaves the pages where first touch puts them.
+*/
+static void
+bind_new_mapping(char* address, size_t size)
+{
+    if (numa_policy != EDS_MEMMAP_NUMA_DEFAULT) {
+        (void)bind_pages(address, address + size, numa_policy, numa_node);
+    }
+}
+
+static size_t
+unit_of(size_t size)
+{
+    if (size >= huge_treshold) {
+        return huge_page_size;
+    }
+    else {
+        return page_size;
+    }
+}
+
+/* The kernel can't move hugetlb pages into, or out of a range that is
+   not aligned to the huge page size.
+*/
+static bool
+can_move_pages(size_t size)
+{
+    return huge_pages != EDS_MEMMAP_HUGE_TLB || unit_of(size) == page_size;
+}
+
+/* The unit argument of the following functions is either page_size,
+   or huge_page_size.
+*/
+static size_t
+in_page_offset(char* address, size_t unit)
+{
+    assert(unit != 0);
+    return ((uintptr_t)address) % unit;
 }
 
 static char*
-page_boundary(char* address)
+page_boundary(char* address, size_t unit)
 {
-    assert(page_mask != 0);
-    return (char*)(((uintptr_t)address) & page_mask);
+    assert(unit != 0);
+    return (char*)(((uintptr_t)address) & ~(unit - 1));
 }
 
 static size_t
-round_up(size_t size)
+round_up(size_t size, size_t unit)
 {
     assert(page_size != 0 && page_mask != 0);
+    assert(unit != 0);
 
-    if ((size & page_mask) == size) {
+    if ((size & ~(unit - 1)) == size) {
         return size;
     }
     else {
-        return (size & page_mask) + page_size;
+        return (size & ~(unit - 1)) + unit;
     }
 }
 
+static char*
+region_base(char* mem, size_t size)
+{
+    return page_boundary(mem, unit_of(size));
+}
+
 static size_t
 total_size(char* mem, size_t size)
 {
-    return round_up(size + in_page_offset(mem));
+    return round_up(size + in_page_offset(mem, unit_of(size)), unit_of(size));
+}
+
+static void
+advise_region(char* base, size_t size, size_t unit)
+{
+    if (huge_pages == EDS_MEMMAP_HUGE_ADVISE && unit != page_size) {
+        (void)madvise(base, size, MADV_HUGEPAGE);
+    }
 }
 
 static char*
-mmap_wrapper(size_t size)
+mmap_plain(size_t size, int flags)
 {
     char *new_address;
 
-    new_address = mmap(NULL, round_up(size),
+    COUNT(mmap_calls, 1);
+    new_address = mmap(NULL, size,
                        PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                       MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
     if (new_address == MAP_FAILED) {
-        new_address = NULL;
+        return NULL;
     }
+    COUNT_MAPPED(size, 0);
     return new_address;
 }
 
+static void munmap_wrapper(char* mem, size_t size);
+static void dirty_replaced(char* mem, size_t size);
+static void dirty_remapped(char* from, size_t size,
+                           char* to, size_t new_size);
+
+/* Maps a new range aligned to unit, of size rounded up to unit.
+   With hugetlb enabled, but no huge pages available,
+   this falls back to normal pages.
+*/
+static char*
+mmap_wrapper(size_t size, size_t unit)
+{
+    char *new_address;
+    char *aligned;
+    size_t padding;
+
+    size = round_up(size, unit);
+    if (unit == page_size) {
+        new_address = mmap_plain(size, 0);
+        if (new_address != NULL) {
+            bind_new_mapping(new_address, size);
+        }
+        return new_address;
+    }
+
+    if (huge_pages == EDS_MEMMAP_HUGE_TLB) {
+        new_address = mmap_plain(size, MAP_HUGETLB);
+        if (new_address != NULL) {
+            bind_new_mapping(new_address, size);
+            return new_address;
+        }
+    }
+
+    padding = unit - page_size;
+    new_address = mmap_plain(size + padding, 0);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    aligned = page_boundary(new_address + padding, unit);
+    munmap_wrapper(new_address, aligned - new_address);
+    munmap_wrapper(aligned + size, (new_address + size + padding)
+                                   - (aligned + size));
+    advise_region(aligned, size, unit);
+    bind_new_mapping(aligned, size);
+    return aligned;
+}
+
 static void
 munmap_wrapper(char* mem, size_t size)
 {
@@ -110,406 +657,3777 @@ munmap_wrapper(char* mem, size_t size)
         return;
     }
     assert(mem != NULL);
-    munmap_result = munmap(page_boundary(mem), size);
+    dirty_replaced(mem, size);
+    COUNT(munmap_calls, 1);
+    munmap_result = munmap(page_boundary(mem, page_size), size);
     assert(munmap_result == 0);
     if (munmap_result != 0) {
         abort();
     }
     (void)munmap_result;
+    COUNT_MAPPED(0, size);
 }
 
-char* eds_memmap_create(size_t size)
+static bool
+map_fixed(char* address, size_t size, int flags)
 {
-    if (size == 0 || size > RSIZE_MAX) {
-        return NULL;
-    }
-    else if (size < mmap_treshold) {
-        return malloc(size);
+    void* result;
+
+    COUNT(mmap_calls, 1);
+    result = mmap(address, size,
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | flags,
+                  -1, 0);
+    if (result == MAP_FAILED) {
+        return false;
     }
-    else {
-        return mmap_wrapper(size);
+    COUNT_MAPPED(size, 0);
+    if (result != address) {
+        /* Kernels before 4.17 treat the address as a hint only */
+        munmap_wrapper(result, size);
+        return false;
     }
+    bind_new_mapping(address, size);
+    return true;
 }
 
-void eds_memmap_destroy(char* mem, size_t size)
+/* Calibration times growing a buffer of size bytes to 2 * size bytes,
+   once with realloc, and once with mremap.
+   Only the growth itself is timed, on a buffer with all pages touched.
+   A second malloc'd block keeps realloc from growing the buffer
+   in place, as in a heap holding other data.
+   The treshold is the smallest size from which mremap is never slower,
+   allowing for 10% of noise.
+   The system calls made here are not counted in the statistics.
+*/
+#define CALIBRATION_MIN_SIZE 0x4000
+#define CALIBRATION_MAX_SIZE 0x800000
+#define CALIBRATION_RUNS 7
+
+static uint64_t
+now_ns(void)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    struct timespec now;
 
-    if (mem == NULL || size == 0) {
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void
+touch_pages(char* mem, size_t size)
+{
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += page_size) {
+        ((volatile char*)mem)[offset] = 1;
     }
-    else if (size < mmap_treshold) {
+}
+
+static uint64_t
+time_realloc_growth(size_t size)
+{
+    uint64_t start;
+    uint64_t elapsed;
+    char *mem;
+    char *guard;
+    char *grown;
+
+    mem = malloc(size);
+    guard = malloc(size);
+    if (mem == NULL || guard == NULL) {
         free(mem);
+        free(guard);
+        return UINT64_MAX;
     }
-    else {
-        munmap_wrapper(mem, total_size(mem, size));
+    touch_pages(mem, size);
+    start = now_ns();
+    grown = realloc(mem, size * 2);
+    elapsed = now_ns() - start;
+    if (grown == NULL) {
+        free(mem);
+        free(guard);
+        return UINT64_MAX;
     }
+    free(grown);
+    free(guard);
+    return elapsed;
 }
 
-static size_t
-capacity_high(char* mem, size_t size)
+static uint64_t
+time_mremap_growth(size_t size)
 {
-    size_t page_mod = (size + in_page_offset(mem)) % page_size;
+    uint64_t start;
+    uint64_t elapsed;
+    char *mem;
+    char *grown;
 
-    return (page_size - page_mod) % page_size;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return UINT64_MAX;
+    }
+    touch_pages(mem, size);
+    start = now_ns();
+    grown = mremap(mem, size, size * 2, MREMAP_MAYMOVE);
+    elapsed = now_ns() - start;
+    if (grown == MAP_FAILED) {
+        (void)munmap(mem, size);
+        return UINT64_MAX;
+    }
+    (void)munmap(grown, size * 2);
+    return elapsed;
 }
 
-static size_t
-capacity_low(char* mem)
+static uint64_t
+median(uint64_t* samples, size_t count)
 {
-    return in_page_offset(mem);
+    size_t i, j;
+    uint64_t sample;
+
+    for (i = 1; i < count; ++i) {
+        sample = samples[i];
+        for (j = i; j > 0 && samples[j - 1] > sample; --j) {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = sample;
+    }
+    return samples[count / 2];
 }
 
-static char*
-expand_small_high_address(char* mem, size_t size, size_t delta)
+static size_t
+calibrate_mmap_treshold(void)
 {
-    assert(mem != NULL);
-    assert(size > 0 && size < mmap_treshold);
-    assert(delta > 0);
+    uint64_t realloc_ns[CALIBRATION_RUNS];
+    uint64_t mremap_ns[CALIBRATION_RUNS];
+    size_t treshold = CALIBRATION_MAX_SIZE;
+    size_t size;
+    size_t run;
 
-    if (size + delta < mmap_treshold) {
-        return realloc(mem, size + delta);
-    }
-    else {
-        char *new_address;
+    (void)time_realloc_growth(CALIBRATION_MIN_SIZE);
+    (void)time_mremap_growth(CALIBRATION_MIN_SIZE);
 
-        new_address = mmap_wrapper(size + delta);
-        if (new_address == NULL) {
-            return NULL;
+    for (size = CALIBRATION_MAX_SIZE; size >= CALIBRATION_MIN_SIZE; size /= 2) {
+        for (run = 0; run < CALIBRATION_RUNS; ++run) {
+            realloc_ns[run] = time_realloc_growth(size);
+            mremap_ns[run] = time_mremap_growth(size);
         }
-        memcpy(new_address, mem, size);
-        free(mem);
-        return new_address;
+        if (median(mremap_ns, CALIBRATION_RUNS) / 11
+            > median(realloc_ns, CALIBRATION_RUNS) / 10)
+        {
+            break;
+        }
+        treshold = size;
     }
+    return treshold;
 }
 
-static char*
-expand_large_high_address(char* mem, size_t size, size_t delta)
+/* Maps fresh pages at exactly the given address,
+   without replacing any existing mapping.
+*/
+static bool
+map_at(char* address, size_t size, size_t unit)
 {
-    assert(mem != NULL);
-    assert(size >= mmap_treshold);
-    assert(delta > 0);
-
-    if (capacity_high(mem, size) >= delta) {
-        return mem;
+    if (size == 0) {
+        return true;
+    }
+    if (huge_pages == EDS_MEMMAP_HUGE_TLB && unit != page_size
+        && map_fixed(address, size, MAP_HUGETLB))
+    {
+        return true;
+    }
+    if (!map_fixed(address, size, 0)) {
+        return false;
+    }
+    advise_region(address, size, unit);
+    return true;
+}
+
+static bool
+move_pages(char* from, size_t size, char* to)
+{
+    void* remap_result;
+
+    dirty_replaced(from, size);
+    dirty_replaced(to, size);
+    remap_result = mremap(from, size, size,
+                          MREMAP_MAYMOVE | MREMAP_FIXED, to);
+    if (remap_result == MAP_FAILED) {
+        return false;
+    }
+    /* The pages at the destination were replaced */
+    COUNT(mremap_moved, 1);
+    COUNT_MAPPED(0, size);
+    return true;
+}
+
+static unsigned
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
     }
     else {
-        char *new_address;
+        return 0;
+    }
+}
 
-        new_address = mremap(page_boundary(mem),
-                total_size(mem, size),
-                total_size(mem, size + delta),
-                MREMAP_MAYMOVE);
-        if (new_address != MAP_FAILED) {
-            return new_address;
+/* Returns the number of bytes from address to the end of the
+   mapping (VMA) containing it, or zero if it is not mapped.
+   Parsed from /proc/self/maps without using malloc.
+*/
+static size_t
+mapping_size_at(char* address)
+{
+    char buffer[0x1000];
+    uintptr_t bounds[2] = {0, 0};
+    unsigned field = 0;
+    ssize_t count;
+    size_t result = 0;
+    int fd;
+
+    fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    while (result == 0 && (count = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < count; ++i) {
+            if (buffer[i] == '\n') {
+                if ((uintptr_t)address >= bounds[0]
+                    && (uintptr_t)address < bounds[1])
+                {
+                    result = bounds[1] - (uintptr_t)address;
+                    break;
+                }
+                bounds[0] = bounds[1] = 0;
+                field = 0;
+            }
+            else if (field == 0 && buffer[i] == '-') {
+                field = 1;
+            }
+            else if (buffer[i] == ' ') {
+                field = 2;
+            }
+            else if (field < 2) {
+                bounds[field] = bounds[field] * 16 + hex_digit(buffer[i]);
+            }
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/* Moving pages around with mremap leaves a region made up of several
+   mappings, which the kernel does not merge, as the page offsets
+   of anonymous mappings do not line up after a move.
+   A single mremap call can not operate on a range spanning more than one
+   mapping (it fails with EFAULT), in that case the mappings are moved
+   one by one.
+*/
+static bool
+move_region(char* from, size_t size, char* to)
+{
+    size_t done;
+    size_t piece;
+
+    if (move_pages(from, size, to)) {
+        return true;
+    }
+    else if (errno != EFAULT) {
+        return false;
+    }
+
+    for (done = 0; done < size; done += piece) {
+        piece = mapping_size_at(from + done);
+        if (piece > size - done) {
+            piece = size - done;
+        }
+        if (piece == 0 || !move_pages(from + done, piece, to + done)) {
+            /* put back what was already moved, and map fresh pages
+               in place of them at the destination
+            */
+            if (done != 0) {
+                if (!move_region(to, done, from)) {
+                    abort();
+                }
+                COUNT_MAPPED(done, 0);
+                if (!map_fixed(to, done, 0)) {
+                    abort();
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Set whenever memory which may hold old bytes is handed out:
+   any memory from malloc, and mappings taken from the cache.
+   Fresh pages from the kernel read as zero, the zeroed variants
+   of expand rely on this, to only clear what may not be zero.
+*/
+static __thread bool reused_memory;
+
+/* Regions below mmap_treshold */
+
+static char*
+malloc_wrapper(size_t size)
+{
+    COUNT(malloc_calls, 1);
+    reused_memory = true;
+    return malloc(size);
+}
+
+static char*
+realloc_wrapper(char* mem, size_t size)
+{
+    COUNT(realloc_calls, 1);
+    reused_memory = true;
+    return realloc(mem, size);
+}
+
+static void
+free_wrapper(char* mem)
+{
+    COUNT(free_calls, 1);
+    free(mem);
+}
+
+/* Copies size bytes from a region of from_size bytes, to a region of
+   to_size bytes, counting the bytes copied, instead of remapped,
+   where a large region is involved.
+*/
+static void
+copy_bytes(char* to, const char* from, size_t size,
+           size_t from_size, size_t to_size)
+{
+    if (from_size < mmap_treshold && to_size >= mmap_treshold) {
+        COUNT(copied_small_to_large, size);
+    }
+    else if (from_size >= mmap_treshold && to_size < mmap_treshold) {
+        COUNT(copied_large_to_small, size);
+    }
+    else if (from_size >= mmap_treshold) {
+        COUNT(copied_large_to_large, size);
+    }
+    memcpy(to, from, size);
+}
+
+/* The cache of released mappings.
+   Destroyed regions are parked instead of unmapped, and new regions are
+   carved out of parked ranges. This saves the mmap / munmap calls,
+   and the page faults on the fresh pages of a new mapping.
+   A thread parks ranges in its own cache first, moving the oldest ones
+   to the pool shared by all threads when it is full, the shared pool
+   releases its oldest ranges when it is full.
+   Ranges parked for longer than cache_max_age_ns are released by
+   the next cache operation of the thread holding them.
+   Adjacent ranges are coalesced, so a region grown and destroyed
+   in a loop can grow into the range it left behind, without any
+   system call at all.
+   hugetlb ranges are never parked, to keep them out of ranges
+   used for normal pages.
+*/
+#define CACHE_ENTRIES 32
+
+struct cache_entry
+{
+    char* base;
+    size_t size;
+    uint64_t parked_ns;
+};
+
+struct mapping_cache
+{
+    struct cache_entry entries[CACHE_ENTRIES];
+    size_t count;
+    size_t bytes;
+};
+
+static struct mapping_cache shared_cache;
+static pthread_mutex_t shared_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct mapping_cache thread_cache;
+
+static bool
+can_cache(size_t unit)
+{
+    return cache_bytes != 0
+           && (huge_pages != EDS_MEMMAP_HUGE_TLB || unit == page_size);
+}
+
+static void
+cache_remove(struct mapping_cache* cache, size_t index)
+{
+    assert(index < cache->count);
+
+    cache->bytes -= cache->entries[index].size;
+    COUNT_CACHED(0, cache->entries[index].size);
+    cache->entries[index] = cache->entries[--cache->count];
+}
+
+static size_t
+cache_oldest(const struct mapping_cache* cache)
+{
+    size_t index;
+    size_t oldest = 0;
+
+    assert(cache->count > 0);
+
+    for (index = 1; index < cache->count; ++index) {
+        if (cache->entries[index].parked_ns
+            < cache->entries[oldest].parked_ns)
+        {
+            oldest = index;
+        }
+    }
+    return oldest;
+}
+
+/* The caller makes room for one more entry */
+static void
+cache_insert(struct mapping_cache* cache, struct cache_entry entry)
+{
+    size_t index = 0;
+
+    assert(cache->count < CACHE_ENTRIES);
+
+    while (index < cache->count) {
+        struct cache_entry* other = cache->entries + index;
+
+        if (other->base + other->size == entry.base) {
+            entry.base = other->base;
+            entry.size += other->size;
+            cache_remove(cache, index);
+        }
+        else if (entry.base + entry.size == other->base) {
+            entry.size += other->size;
+            cache_remove(cache, index);
         }
         else {
-            return NULL;
+            ++index;
         }
     }
+    cache->entries[cache->count++] = entry;
+    cache->bytes += entry.size;
+    COUNT_CACHED(entry.size, 0);
 }
 
-char* eds_memmap_expand_high(char* mem, size_t size, size_t delta)
+static char*
+cache_carve(struct mapping_cache* cache, size_t index, size_t size)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
+    struct cache_entry* entry = cache->entries + index;
+    char *mem = entry->base;
 
-    if (delta == 0) {
+    assert(entry->size >= size);
+
+    if (entry->size == size) {
+        cache_remove(cache, index);
+    }
+    else {
+        entry->base += size;
+        entry->size -= size;
+        cache->bytes -= size;
+        COUNT_CACHED(0, size);
+    }
+    return mem;
+}
+
+/* Best fit, only ranges starting at a unit boundary qualify */
+static char*
+cache_take(struct mapping_cache* cache, size_t size, size_t unit)
+{
+    size_t index;
+    size_t best = CACHE_ENTRIES;
+
+    for (index = 0; index < cache->count; ++index) {
+        struct cache_entry* entry = cache->entries + index;
+
+        if (entry->size >= size
+            && in_page_offset(entry->base, unit) == 0
+            && (best == CACHE_ENTRIES
+                || entry->size < cache->entries[best].size))
+        {
+            best = index;
+        }
+    }
+    if (best == CACHE_ENTRIES) {
+        return NULL;
+    }
+    return cache_carve(cache, best, size);
+}
+
+static bool
+cache_take_at(struct mapping_cache* cache, char* address, size_t size)
+{
+    size_t index;
+
+    for (index = 0; index < cache->count; ++index) {
+        if (cache->entries[index].base == address
+            && cache->entries[index].size >= size)
+        {
+            (void)cache_carve(cache, index, size);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Moves the expired entries of cache to released, returns their count */
+static size_t
+cache_expire(struct mapping_cache* cache, uint64_t now,
+             struct cache_entry* released)
+{
+    size_t index = 0;
+    size_t count = 0;
+
+    while (index < cache->count) {
+        if (now - cache->entries[index].parked_ns > cache_max_age_ns) {
+            released[count++] = cache->entries[index];
+            cache_remove(cache, index);
+        }
+        else {
+            ++index;
+        }
+    }
+    return count;
+}
+
+static void
+release_entries(const struct cache_entry* entries, size_t count)
+{
+    size_t index;
+
+    for (index = 0; index < count; ++index) {
+        munmap_wrapper(entries[index].base, entries[index].size);
+    }
+}
+
+/* The munmap calls are made after unlocking */
+static void
+park_shared(struct cache_entry entry, uint64_t now)
+{
+    struct cache_entry released[CACHE_ENTRIES + 1];
+    size_t count;
+
+    if (entry.size > cache_bytes) {
+        munmap_wrapper(entry.base, entry.size);
+        return;
+    }
+    pthread_mutex_lock(&shared_cache_lock);
+    count = cache_expire(&shared_cache, now, released);
+    while (shared_cache.count == CACHE_ENTRIES
+           || shared_cache.bytes + entry.size > cache_bytes)
+    {
+        size_t oldest = cache_oldest(&shared_cache);
+
+        released[count++] = shared_cache.entries[oldest];
+        cache_remove(&shared_cache, oldest);
+    }
+    cache_insert(&shared_cache, entry);
+    pthread_mutex_unlock(&shared_cache_lock);
+    release_entries(released, count);
+}
+
+/* Passes the ranges of an exiting thread to the shared pool */
+static void
+flush_thread_cache(void)
+{
+    uint64_t now = now_ns();
+
+    while (thread_cache.count > 0) {
+        struct cache_entry entry = thread_cache.entries[0];
+
+        cache_remove(&thread_cache, 0);
+        park_shared(entry, now);
+    }
+}
+
+static void
+expire_thread_cache(uint64_t now)
+{
+    struct cache_entry released[CACHE_ENTRIES];
+
+    release_entries(released, cache_expire(&thread_cache, now, released));
+}
+
+static void
+park_range(char* base, size_t size)
+{
+    struct cache_entry entry;
+    uint64_t now = now_ns();
+
+    dirty_replaced(base, size);
+    entry.base = base;
+    entry.size = size;
+    entry.parked_ns = now;
+
+    register_thread();
+    expire_thread_cache(now);
+    if (size > thread_cache_bytes) {
+        park_shared(entry, now);
+        return;
+    }
+    while (thread_cache.count == CACHE_ENTRIES
+           || thread_cache.bytes + size > thread_cache_bytes)
+    {
+        size_t oldest = cache_oldest(&thread_cache);
+        struct cache_entry evicted = thread_cache.entries[oldest];
+
+        cache_remove(&thread_cache, oldest);
+        park_shared(evicted, now);
+    }
+    cache_insert(&thread_cache, entry);
+}
+
+/* A parked range of size bytes, aligned to unit */
+static char*
+cached_mapping(size_t size, size_t unit)
+{
+    char *mem;
+
+    if (!can_cache(unit)) {
+        return NULL;
+    }
+    expire_thread_cache(now_ns());
+    mem = cache_take(&thread_cache, size, unit);
+    if (mem == NULL) {
+        pthread_mutex_lock(&shared_cache_lock);
+        mem = cache_take(&shared_cache, size, unit);
+        pthread_mutex_unlock(&shared_cache_lock);
+    }
+    if (mem != NULL) {
+        COUNT(cache_hits, 1);
+        reused_memory = true;
+        advise_region(mem, size, unit);
+    }
+    else {
+        COUNT(cache_misses, 1);
+    }
+    return mem;
+}
+
+/* Takes the parked range [address, address + size), if there is one */
+static bool
+cached_mapping_at(char* address, size_t size, size_t unit)
+{
+    bool found;
+
+    if (!can_cache(unit)) {
+        return false;
+    }
+    if (cache_take_at(&thread_cache, address, size)) {
+        COUNT(cache_hits, 1);
+        reused_memory = true;
+        return true;
+    }
+    pthread_mutex_lock(&shared_cache_lock);
+    found = cache_take_at(&shared_cache, address, size);
+    pthread_mutex_unlock(&shared_cache_lock);
+    if (found) {
+        COUNT(cache_hits, 1);
+        reused_memory = true;
+    }
+    return found;
+}
+
+/* mmap_wrapper, trying the cache first */
+static char*
+map_region(size_t size, size_t unit)
+{
+    char *mem;
+
+    mem = cached_mapping(round_up(size, unit), unit);
+    if (mem != NULL) {
         return mem;
     }
-    else if ((size + delta) < size || (size + delta) > RSIZE_MAX) {
+    return mmap_wrapper(size, unit);
+}
+
+static void
+release_region(char* base, size_t size, size_t unit)
+{
+    if (can_cache(unit)) {
+        park_range(base, size);
+    }
+    else {
+        munmap_wrapper(base, size);
+    }
+}
+
+void eds_memmap_trim_cache(void)
+{
+    struct cache_entry released[CACHE_ENTRIES];
+    size_t count;
+
+    release_entries(thread_cache.entries, thread_cache.count);
+    COUNT_CACHED(0, thread_cache.bytes);
+    thread_cache.count = 0;
+    thread_cache.bytes = 0;
+
+    pthread_mutex_lock(&shared_cache_lock);
+    count = shared_cache.count;
+    memcpy(released, shared_cache.entries, count * sizeof(*released));
+    COUNT_CACHED(0, shared_cache.bytes);
+    shared_cache.count = 0;
+    shared_cache.bytes = 0;
+    pthread_mutex_unlock(&shared_cache_lock);
+    release_entries(released, count);
+}
+
+char* eds_memmap_create(size_t size)
+{
+    if (size == 0 || size > RSIZE_MAX) {
         return NULL;
     }
-    else if (mem == NULL) {
-        return eds_memmap_create(delta);
+    else if (size < mmap_treshold) {
+        return malloc_wrapper(size);
+    }
+    else {
+        return map_region(size, unit_of(size));
+    }
+}
+
+void eds_memmap_destroy(char* mem, size_t size)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+
+    if (mem == NULL || size == 0) {
+        return;
     }
     else if (size < mmap_treshold) {
-        return expand_small_high_address(mem, size, delta);
+        free_wrapper(mem);
     }
     else {
-        return expand_large_high_address(mem, size, delta);
+        release_region(region_base(mem, size), total_size(mem, size),
+                       unit_of(size));
+    }
+}
+
+static size_t
+capacity_high(char* mem, size_t size)
+{
+    return total_size(mem, size) - (mem - region_base(mem, size)) - size;
+}
+
+static size_t
+capacity_low(char* mem, size_t size)
+{
+    return mem - region_base(mem, size);
+}
+
+static char*
+expand_small_high_address(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(size > 0 && size < mmap_treshold);
+    assert(delta > 0);
+
+    if (size + delta < mmap_treshold) {
+        return realloc_wrapper(mem, size + delta);
+    }
+    else {
+        char *new_address;
+
+        new_address = map_region(size + delta, unit_of(size + delta));
+        if (new_address == NULL) {
+            return NULL;
+        }
+        copy_bytes(new_address, mem, size, size, size + delta);
+        free_wrapper(mem);
+        return new_address;
+    }
+}
+
+/* Moves a large region to a new mapping, with room for delta_low bytes
+   before, and delta_high bytes after its contents.
+   The pages are moved when possible, and copied otherwise, e.g.:
+   hugetlb pages can't be moved into a differently aligned range.
+*/
+static char*
+relocate_large(char* mem, size_t size, size_t delta_high, size_t delta_low)
+{
+    char* old_base;
+    char* new_address;
+    size_t old_size;
+    size_t offset;
+    size_t unit;
+    size_t new_unit;
+    size_t low_pages;
+    size_t new_size;
+
+    old_base = region_base(mem, size);
+    old_size = total_size(mem, size);
+    offset = mem - old_base;
+    unit = unit_of(size);
+    new_unit = unit_of(size + delta_high + delta_low);
+    low_pages = 0;
+    if (delta_low > offset) {
+        low_pages = round_up(delta_low - offset, unit);
+    }
+    new_size = round_up(low_pages + offset + size + delta_high, new_unit);
+
+    new_address = map_region(new_size, new_unit);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    if (move_region(old_base, old_size, new_address + low_pages)) {
+        advise_region(new_address, new_size, new_unit);
+    }
+    else {
+        copy_bytes(new_address + low_pages + offset, mem, size,
+                   size, size + delta_high + delta_low);
+        munmap_wrapper(old_base, old_size);
+    }
+    return new_address + low_pages + offset - delta_low;
+}
+
+static char*
+expand_large_high_address(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(size >= mmap_treshold);
+    assert(delta > 0);
+
+    size_t unit = unit_of(size);
+
+    if (unit != unit_of(size + delta)) {
+        /* Crossing huge_treshold, the region must be realigned */
+        return relocate_large(mem, size, delta, 0);
+    }
+    else if (capacity_high(mem, size) >= delta) {
+        return mem;
+    }
+    else {
+        char *base;
+        char *new_address;
+        size_t old_size;
+        size_t new_size;
+
+        base = region_base(mem, size);
+        old_size = total_size(mem, size);
+        new_size = total_size(mem, size + delta);
+
+        if (cached_mapping_at(base + old_size, new_size - old_size, unit)) {
+            return mem;
+        }
+
+        /* A region moved by mremap would lose its huge page alignment,
+           and the kernel refuses to expand hugetlb mappings.
+           A region consisting of several mappings can't be
+           remapped at all (EFAULT).
+        */
+        new_address = mremap(base, old_size, new_size,
+                             unit == page_size ? MREMAP_MAYMOVE : 0);
+        if (new_address != MAP_FAILED) {
+            if (new_address == base) {
+                COUNT(mremap_in_place, 1);
+            }
+            else {
+                COUNT(mremap_moved, 1);
+            }
+            dirty_remapped(base, old_size, new_address, new_size);
+            COUNT_MAPPED(new_size, old_size);
+            return new_address + (mem - base);
+        }
+        else if (map_at(base + old_size, new_size - old_size, unit)) {
+            return mem;
+        }
+        else {
+            return relocate_large(mem, size, delta, 0);
+        }
+    }
+}
+
+char* eds_memmap_expand_high(char* mem, size_t size, size_t delta)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (delta == 0) {
+        return mem;
+    }
+    else if ((size + delta) < size || (size + delta) > RSIZE_MAX) {
+        return NULL;
+    }
+    else if (mem == NULL) {
+        return eds_memmap_create(delta);
+    }
+    else if (size < mmap_treshold) {
+        return expand_small_high_address(mem, size, delta);
+    }
+    else {
+        return expand_large_high_address(mem, size, delta);
+    }
+}
+
+/* The delta bytes a region grew by at its end, from mem + size,
+   start with the stale bytes of its old spare capacity.
+   The rest were fresh pages, unless the memory was reused.
+*/
+static void
+clear_grown_high(char* mem, size_t size, size_t delta, size_t stale)
+{
+    if (reused_memory || stale > delta) {
+        stale = delta;
+    }
+    memset(mem + size, 0, stale);
+}
+
+char* eds_memmap_expand_high_zeroed(char* mem, size_t size, size_t delta)
+{
+    char* new_mem;
+    size_t stale;
+
+    stale = 0;
+    if (mem != NULL && size >= mmap_treshold) {
+        stale = capacity_high(mem, size);
+    }
+    reused_memory = false;
+    new_mem = eds_memmap_expand_high(mem, size, delta);
+    if (new_mem != NULL) {
+        clear_grown_high(new_mem, size, delta, stale);
+    }
+    return new_mem;
+}
+
+static char*
+expand_both_ends_small(char* mem, size_t size,
+                       size_t delta_high, size_t delta_low)
+{
+    assert(mem != NULL);
+    assert(size > 0 && size < mmap_treshold);
+    assert(delta_low > 0);
+
+    char* new_address;
+    size_t new_size = size + delta_low + delta_high;
+
+    if (new_size < mmap_treshold) {
+        new_address = malloc_wrapper(new_size);
+    }
+    else {
+        new_address = map_region(new_size, unit_of(new_size));
+    }
+    if (new_address == NULL) {
+        return NULL;
+    }
+    copy_bytes(new_address + delta_low, mem, size, size, new_size);
+    free_wrapper(mem);
+    return new_address;
+}
+
+static char*
+expand_both_ends_large(char* mem, size_t size,
+                       size_t delta_high, size_t delta_low)
+{
+    assert(mem != NULL);
+    assert(size >= mmap_treshold);
+    assert(delta_low > 0);
+
+    size_t unit = unit_of(size);
+
+    if (unit != unit_of(size + delta_high + delta_low)) {
+        return relocate_large(mem, size, delta_high, delta_low);
+    }
+    else if (capacity_low(mem, size) >= delta_low &&
+             capacity_high(mem, size) >= delta_high)
+    {
+        return mem - delta_low;
+    }
+    else {
+        char* base;
+        size_t new_low_pages;
+        size_t new_high_pages;
+        size_t old_size;
+
+        base = region_base(mem, size);
+        old_size = total_size(mem, size);
+        new_low_pages = 0;
+        if (delta_low > capacity_low(mem, size)) {
+            new_low_pages = round_up(delta_low - capacity_low(mem, size), unit);
+        }
+        new_high_pages = 0;
+        if (delta_high > capacity_high(mem, size)) {
+            new_high_pages = round_up(delta_high - capacity_high(mem, size),
+                                      unit);
+        }
+
+        /* Try to grow in place first */
+        if ((uintptr_t)base > new_low_pages
+            && map_at(base - new_low_pages, new_low_pages, unit))
+        {
+            if (map_at(base + old_size, new_high_pages, unit)) {
+                return mem - delta_low;
+            }
+            munmap_wrapper(base - new_low_pages, new_low_pages);
+        }
+
+        return relocate_large(mem, size, delta_high, delta_low);
+    }
+}
+
+char* eds_memmap_expand_low(char* mem, size_t size, size_t delta)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (delta == 0) {
+        return mem;
+    }
+    if (mem == NULL) {
+        return eds_memmap_create(delta);
+    }
+    else if ((size + delta) < size || (size + delta) > RSIZE_MAX) {
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        return expand_both_ends_small(mem, size, 0, delta);
+    }
+    else {
+        return expand_both_ends_large(mem, size, 0, delta);
+    }
+}
+
+char* eds_memmap_expand(char* mem, size_t size,
+                        size_t delta_high, size_t delta_low)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (mem == NULL) {
+        return eds_memmap_create(delta_high + delta_low);
+    }
+    else if (delta_high == 0) {
+        return eds_memmap_expand_low(mem, size, delta_low);
+    }
+    else if (delta_low == 0) {
+        return eds_memmap_expand_high(mem, size, delta_high);
+    }
+    else if ((delta_low + delta_high < delta_low) ||
+             (size + delta_low + delta_high < size) ||
+             (size + delta_low + delta_high > RSIZE_MAX))
+    {
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        return expand_both_ends_small(mem, size, delta_high, delta_low);
+    }
+    else {
+        return expand_both_ends_large(mem, size, delta_high, delta_low);
+    }
+}
+
+static char*
+shrink_high_small(char* mem, size_t size, size_t delta)
+{
+    if (delta == size) {
+        free_wrapper(mem);
+        return NULL;
+    }
+    else {
+        return realloc_wrapper(mem, size - delta);
+    }
+}
+
+static char*
+shrink_large_to_small(char* mem, size_t size,
+                      size_t delta_high, size_t delta_low)
+{
+    assert(size >= delta_high && size >= delta_low);
+    assert(delta_high + delta_low >= delta_high);
+    assert(size >= delta_high + delta_low);
+
+    char *new_address;
+    size_t new_size;
+
+    new_size = size - delta_high - delta_low;
+    new_address = malloc_wrapper(new_size);
+    if (new_address != NULL) {
+        copy_bytes(new_address, mem + delta_low, new_size, size, new_size);
+        munmap_wrapper(region_base(mem, size), total_size(mem, size));
+    }
+    return new_address;
+}
+
+static char*
+shrink_both_large(char* mem, size_t size,
+                  size_t delta_high, size_t delta_low);
+
+static char*
+shrink_high_large(char* mem, size_t size, size_t delta)
+{
+    return shrink_both_large(mem, size, delta, 0);
+}
+
+char* eds_memmap_shrink_high(char* mem, size_t size, size_t delta)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (mem == NULL || delta > size) {
+        return NULL;
+    }
+    else if (delta == 0) {
+        return mem;
+    }
+    else if (delta == size) {
+        eds_memmap_destroy(mem, size);
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        return shrink_high_small(mem, size, delta);
+    }
+    else if (size - delta < mmap_treshold) {
+        return shrink_large_to_small(mem, size, delta, 0);
+    }
+    else {
+        return shrink_high_large(mem, size, delta);
+    }
+}
+
+static char*
+shrink_both_small(char* mem, size_t size,
+                  size_t delta_high, size_t delta_low)
+{
+    assert(mem != NULL);
+    assert(size > delta_low && size < mmap_treshold);
+    assert(delta_low > 0);
+
+    char* new_address;
+
+    new_address = malloc_wrapper(size - delta_low - delta_high);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    memcpy(new_address, mem + delta_low, size - delta_high - delta_low);
+    free_wrapper(mem);
+    return new_address;
+}
+
+/* Unmaps the pages not needed anymore, after removing delta_low bytes from
+   the beginning, and delta_high bytes from the end of a region.
+*/
+static char*
+shrink_both_large(char* mem, size_t size,
+                  size_t delta_high, size_t delta_low)
+{
+    assert(mem != NULL);
+    assert(size >= mmap_treshold);
+    assert(size > delta_low);
+    assert(size > delta_high);
+    assert(size - delta_high - delta_low >= mmap_treshold);
+
+    char* old_base;
+    char* old_end;
+    char* new_mem;
+    char* new_base;
+    char* new_end;
+    size_t new_size;
+
+    new_mem = mem + delta_low;
+    new_size = size - delta_high - delta_low;
+    old_base = region_base(mem, size);
+    old_end = old_base + total_size(mem, size);
+
+    if (!can_move_pages(size) && unit_of(size) != unit_of(new_size)) {
+        /* hugetlb pages can only be unmapped as a whole */
+        char* new_address;
+
+        new_address = map_region(new_size, unit_of(new_size));
+        if (new_address == NULL) {
+            return NULL;
+        }
+        copy_bytes(new_address, new_mem, new_size, size, new_size);
+        munmap_wrapper(old_base, old_end - old_base);
+        return new_address;
+    }
+
+    new_base = region_base(new_mem, new_size);
+    new_end = new_base + total_size(new_mem, new_size);
+    munmap_wrapper(old_base, new_base - old_base);
+    munmap_wrapper(new_end, old_end - new_end);
+    return new_mem;
+}
+
+char *eds_memmap_shrink_low(char* mem, size_t size, size_t delta)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (delta == 0) {
+        return mem;
+    }
+    else if (size == delta) {
+        eds_memmap_destroy(mem, size);
+        return NULL;
+    }
+    else if (delta > size) {
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        memmove(mem, mem + delta, size - delta);
+        return realloc_wrapper(mem, size - delta);
+    }
+    else if (size - delta < mmap_treshold) {
+        return shrink_large_to_small(mem, size, 0, delta);
+    }
+    else {
+        return shrink_both_large(mem, size, 0, delta);
+    }
+}
+
+char* eds_memmap_shrink(char* mem, size_t size,
+                        size_t delta_high, size_t delta_low)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+
+    if (delta_low == 0) {
+        return eds_memmap_shrink_high(mem, size, delta_high);
+    }
+    else if (mem == NULL || delta_high > size || delta_low > size) {
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        return shrink_both_small(mem, size, delta_high, delta_low);
+    }
+    else if (size - delta_high - delta_low < mmap_treshold) {
+        return shrink_large_to_small(mem, size, delta_high, delta_low);
+    }
+    else {
+        return shrink_both_large(mem, size, delta_high, delta_low);
+    }
+}
+
+
+static char*
+merge_by_copy(char* mem_a, size_t size_a, char* mem_b, size_t size_b)
+{
+    char* new_address;
+
+    if (size_a >= size_b) {
+        new_address = eds_memmap_expand_high(mem_a, size_a, size_b);
+        if (new_address == NULL) {
+            return NULL;
+        }
+        copy_bytes(new_address + size_a, mem_b, size_b,
+                   size_b, size_a + size_b);
+        eds_memmap_destroy(mem_b, size_b);
+    }
+    else {
+        new_address = eds_memmap_expand_low(mem_b, size_b, size_a);
+        if (new_address == NULL) {
+            return NULL;
+        }
+        copy_bytes(new_address, mem_a, size_a, size_a, size_a + size_b);
+        eds_memmap_destroy(mem_a, size_a);
+    }
+    return new_address;
+}
+
+/* Both regions are large, and the first byte of mem_b has the same
+   in-page offset as the first byte following mem_a.
+   The pages of mem_b are moved behind the pages of mem_a, only the
+   bytes in the first page of mem_b are copied into the last page of mem_a.
+*/
+static char*
+merge_pages(char* mem_a, size_t size_a, char* mem_b, size_t size_b)
+{
+    assert(size_a >= mmap_treshold && size_b >= mmap_treshold);
+    assert(in_page_offset(mem_a + size_a, page_size)
+           == in_page_offset(mem_b, page_size));
+
+    char* base_a;
+    char* end_a;
+    char* pages_a;
+    char* base_b;
+    char* end_b;
+    char* moved;
+    char* new_base;
+    size_t unit;
+    size_t head_part;
+    size_t pages_a_size;
+    size_t moved_size;
+    size_t new_size;
+
+    unit = unit_of(size_a + size_b);
+    base_a = region_base(mem_a, size_a);
+    end_a = base_a + total_size(mem_a, size_a);
+    base_b = region_base(mem_b, size_b);
+    end_b = base_b + total_size(mem_b, size_b);
+
+    /* The pages holding the bytes of mem_a, and the ones to move from mem_b */
+    pages_a = page_boundary(mem_a, page_size);
+    pages_a_size = round_up((mem_a - pages_a) + size_a, page_size);
+    head_part = (page_size - in_page_offset(mem_b, page_size)) % page_size;
+    moved = page_boundary(mem_b, page_size);
+    if (head_part != 0) {
+        moved += page_size;
+    }
+    moved_size = round_up((mem_b + size_b) - moved, page_size);
+
+    if (unit == page_size && map_at(end_a, moved_size, unit)) {
+        assert(pages_a == base_a && pages_a + pages_a_size == end_a);
+
+        new_base = base_a;
+        if (!move_region(moved, moved_size, new_base + pages_a_size)) {
+            munmap_wrapper(end_a, moved_size);
+            return NULL;
+        }
+    }
+    else {
+        /* Can't grow in place, reserve a new range for both of them */
+        new_size = round_up((mem_a - pages_a) + size_a + size_b, unit);
+        new_base = map_region(new_size, unit);
+        if (new_base == NULL) {
+            return NULL;
+        }
+        if (!move_region(moved, moved_size, new_base + pages_a_size)) {
+            munmap_wrapper(new_base, new_size);
+            return NULL;
+        }
+        if (!move_region(pages_a, pages_a_size, new_base)) {
+            if (!move_region(new_base + pages_a_size, moved_size, moved)) {
+                abort();
+            }
+            munmap_wrapper(new_base, new_size);
+            return NULL;
+        }
+        advise_region(new_base, new_size, unit);
+        munmap_wrapper(base_a, pages_a - base_a);
+        munmap_wrapper(pages_a + pages_a_size,
+                       end_a - (pages_a + pages_a_size));
+    }
+
+    if (head_part != 0) {
+        copy_bytes(new_base + (mem_a - pages_a) + size_a, mem_b, head_part,
+                   size_b, size_a + size_b);
+    }
+    munmap_wrapper(base_b, moved - base_b);
+    munmap_wrapper(moved + moved_size, end_b - (moved + moved_size));
+    return new_base + (mem_a - pages_a);
+}
+
+char* eds_memmap_merge(char* restrict mem_a, size_t size_a,
+                       char* restrict mem_b, size_t size_b)
+{
+    assert((mem_a == NULL && size_a == 0) || (mem_a != NULL && size_a != 0));
+    assert((mem_b == NULL && size_b == 0) || (mem_b != NULL && size_b != 0));
+    assert(size_a <= RSIZE_MAX && size_b <= RSIZE_MAX);
+
+    if (mem_b == NULL) {
+        return mem_a;
+    }
+    else if (mem_a == NULL) {
+        return mem_b;
+    }
+    else if ((size_a + size_b) < size_a || (size_a + size_b) > RSIZE_MAX) {
+        return NULL;
+    }
+    else if (size_a >= mmap_treshold && size_b >= mmap_treshold &&
+             can_move_pages(size_a + size_b) &&
+             in_page_offset(mem_a + size_a, page_size)
+             == in_page_offset(mem_b, page_size))
+    {
+        return merge_pages(mem_a, size_a, mem_b, size_b);
+    }
+    else {
+        return merge_by_copy(mem_a, size_a, mem_b, size_b);
+    }
+}
+
+static char*
+split_small(char* mem, size_t size, size_t cut, char** tail)
+{
+    assert(size < mmap_treshold);
+
+    char* new_address;
+
+    *tail = malloc_wrapper(size - cut);
+    if (*tail == NULL) {
+        return NULL;
+    }
+    memcpy(*tail, mem + cut, size - cut);
+    new_address = realloc_wrapper(mem, cut);
+    if (new_address == NULL) {
+        /* A failed realloc leaves the original block intact */
+        return mem;
+    }
+    return new_address;
+}
+
+static char*
+split_small_head(char* mem, size_t size, size_t cut, char** tail)
+{
+    assert(size >= mmap_treshold);
+    assert(cut < mmap_treshold && size - cut >= mmap_treshold);
+
+    char* new_address;
+
+    new_address = malloc_wrapper(cut);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    copy_bytes(new_address, mem, cut, size, cut);
+    *tail = shrink_both_large(mem, size, 0, cut);
+    return new_address;
+}
+
+static char*
+split_by_copy(char* mem, size_t size, size_t cut, char** tail)
+{
+    assert(size >= mmap_treshold);
+
+    char* new_address;
+
+    *tail = eds_memmap_create(size - cut);
+    if (*tail == NULL) {
+        return NULL;
+    }
+    copy_bytes(*tail, mem + cut, size - cut, size, size - cut);
+    new_address = eds_memmap_shrink_high(mem, size, size - cut);
+    if (new_address == NULL) {
+        eds_memmap_destroy(*tail, size - cut);
+    }
+    return new_address;
+}
+
+/* Both halves are large, the pages following the cut are moved to
+   a new mapping. The page containing the cut is shared by the two halves,
+   the tail bytes from that page are copied into a fresh page.
+   When the first half is aligned to huge pages, it keeps the rest of
+   its last huge page as well, the tail bytes from there are copied.
+*/
+static char*
+split_pages(char* mem, size_t size, size_t cut, char** tail)
+{
+    assert(cut >= mmap_treshold && size - cut >= mmap_treshold);
+    assert(can_move_pages(size));
+
+    char* old_base;
+    char* old_end;
+    char* head_base;
+    char* head_end;
+    char* data_end;
+    char* new_address;
+    char* moved;
+    size_t unit;
+    size_t offset;
+    size_t new_size;
+    size_t moved_size;
+    size_t copied;
+
+    old_base = region_base(mem, size);
+    old_end = old_base + total_size(mem, size);
+    head_base = region_base(mem, cut);
+    head_end = head_base + total_size(mem, cut);
+    data_end = page_boundary(mem + size - 1, page_size) + page_size;
+
+    unit = unit_of(size - cut);
+    offset = in_page_offset(mem + cut, page_size);
+    new_size = round_up(offset + size - cut, unit);
+    new_address = map_region(new_size, unit);
+    if (new_address == NULL) {
+        return NULL;
+    }
+
+    copied = size - cut;
+    if (head_end < data_end) {
+        copied = head_end - (mem + cut);
+    }
+    copy_bytes(new_address + offset, mem + cut, copied, size, size - cut);
+
+    moved = head_end;
+    moved_size = 0;
+    if (copied < size - cut) {
+        moved_size = data_end - moved;
+        if (move_region(moved, moved_size,
+                        new_address + offset + copied))
+        {
+            munmap_wrapper(moved + moved_size, old_end - (moved + moved_size));
+        }
+        else {
+            copy_bytes(new_address + offset + copied, moved,
+                       size - cut - copied, size, size - cut);
+            munmap_wrapper(moved, old_end - moved);
+        }
+    }
+    else {
+        munmap_wrapper(head_end, old_end - head_end);
+    }
+    advise_region(new_address, new_size, unit);
+    *tail = new_address + offset;
+    munmap_wrapper(old_base, head_base - old_base);
+    return mem;
+}
+
+char* eds_memmap_split(char* mem, size_t size, size_t cut, char** tail)
+{
+    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
+    assert(size <= RSIZE_MAX);
+    assert(tail != NULL);
+
+    if (mem == NULL || cut == 0 || cut >= size) {
+        return NULL;
+    }
+    else if (size < mmap_treshold) {
+        return split_small(mem, size, cut, tail);
+    }
+    else if (size - cut < mmap_treshold || !can_move_pages(size)) {
+        return split_by_copy(mem, size, cut, tail);
+    }
+    else if (cut < mmap_treshold) {
+        return split_small_head(mem, size, cut, tail);
+    }
+    else {
+        return split_pages(mem, size, cut, tail);
+    }
+}
+
+/* Moving bytes by a smaller distance than this always copies them,
+   as each piece of the distance costs an mremap call, which only
+   beats copying from a few dozen pages on.
+*/
+#define MOVE_PAGES_MIN 0x40000
+
+/* Moves whole pages, leaving fresh pages in place of them, with
+   MREMAP_DONTUNMAP since Linux 5.7 (for any mapping since 5.13),
+   or by moving pages mapped beforehand into the hole a plain move
+   leaves. When those can't be mapped or moved, the pages go back,
+   and the caller copies them instead.
+*/
+static bool
+move_pages_keep(char* from, size_t size, char* to)
+{
+    void* remap_result;
+    char* fresh;
+
+    dirty_replaced(from, size);
+    dirty_replaced(to, size);
+    remap_result = mremap(from, size, size,
+                          MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP,
+                          to);
+    if (remap_result != MAP_FAILED) {
+        COUNT(mremap_moved, 1);
+        return true;
+    }
+    else if (errno != EINVAL) {
+        return false;
+    }
+    fresh = mmap_plain(size, 0);
+    if (fresh == NULL) {
+        return false;
+    }
+    if (!move_pages(from, size, to)) {
+        munmap_wrapper(fresh, size);
+        return false;
+    }
+    remap_result = mremap(fresh, size, size,
+                          MREMAP_MAYMOVE | MREMAP_FIXED, from);
+    if (remap_result == MAP_FAILED) {
+        /* Back into the hole they left, merging with their neighbours */
+        (void)move_pages(to, size, from);
+        munmap_wrapper(fresh, size);
+        errno = ENOMEM;
+        return false;
+    }
+    COUNT(mremap_moved, 1);
+    bind_new_mapping(from, size);
+    return true;
+}
+
+/* Moves a range of whole pages, which doesn't overlap its destination.
+   Pages moved around earlier may make up several mappings, a single
+   mremap can't span them, so they are moved one by one then.
+   Whatever can't be moved is copied.
+*/
+static void
+move_or_copy_pages(char* from, size_t size, char* to)
+{
+    size_t done;
+    size_t piece;
+
+    if (move_pages_keep(from, size, to)) {
+        return;
+    }
+    done = 0;
+    if (errno == EFAULT) {
+        for (; done < size; done += piece) {
+            piece = mapping_size_at(from + done);
+            if (piece > size - done) {
+                piece = size - done;
+            }
+            if (piece == 0
+                || !move_pages_keep(from + done, piece, to + done))
+            {
+                break;
+            }
+        }
+    }
+    if (done < size) {
+        memcpy(to + done, from + done, size - done);
+    }
+}
+
+/* Moves the pages [begin, end) up, or down by distance bytes,
+   in pieces of at most distance bytes, starting at the end they
+   move towards, so no piece overlaps its destination.
+*/
+static void
+shift_pages(char* begin, char* end, size_t distance, bool up)
+{
+    size_t piece;
+
+    while (begin < end) {
+        piece = (size_t)(end - begin) < distance ? (size_t)(end - begin)
+                                                 : distance;
+        if (up) {
+            move_or_copy_pages(end - piece, piece, end - piece + distance);
+            end -= piece;
+        }
+        else {
+            move_or_copy_pages(begin, piece, begin - distance);
+            begin += piece;
+        }
+    }
+}
+
+void eds_memmap_move(char* mem, size_t size,
+                     size_t to, size_t from, size_t count)
+{
+    char *pages_begin, *pages_end;
+    size_t head_part, tail_part;
+    size_t distance;
+    bool up = to > from;
+
+    assert(to <= size && count <= size - to);
+    assert(from <= size && count <= size - from);
+
+    distance = up ? to - from : from - to;
+    if (count == 0 || distance == 0) {
+        return;
+    }
+    pages_begin = page_boundary(mem + from + page_size - 1, page_size);
+    pages_end = page_boundary(mem + from + count, page_size);
+    if (size < mmap_treshold
+        || !can_move_pages(size)
+        || distance % page_size != 0
+        || distance < MOVE_PAGES_MIN
+        || pages_end - pages_begin < MOVE_PAGES_MIN)
+    {
+        memmove(mem + to, mem + from, count);
+        return;
+    }
+    head_part = pages_begin - (mem + from);
+    tail_part = (mem + from + count) - pages_end;
+
+    /* The partial pages at either end are copied, the one leading
+       the move before the pages move over it, the other one after
+       the pages it moves into were moved away.
+    */
+    if (up) {
+        memmove(pages_end + distance, pages_end, tail_part);
+        shift_pages(pages_begin, pages_end, distance, true);
+        memmove(mem + to, mem + from, head_part);
+    }
+    else {
+        memmove(mem + to, mem + from, head_part);
+        shift_pages(pages_begin, pages_end, distance, false);
+        memmove(pages_end - distance, pages_end, tail_part);
+    }
+}
+
+/* Reserved regions are never moved, so they can't use hugetlb pages,
+   which would have to be taken from the pool up front.
+   With transparent huge pages the reserved range is aligned to,
+   and committed in multiples of the huge page size.
+*/
+static size_t
+reserve_unit(size_t size)
+{
+    if (huge_pages == EDS_MEMMAP_HUGE_ADVISE) {
+        return unit_of(size);
+    }
+    else {
+        return page_size;
+    }
+}
+
+/* The accessible pages backing the window [mem, mem + size)
+   of a reserved range.
+*/
+static void
+committed_pages(char* mem, size_t size, char** begin, char** end)
+{
+    size_t unit = reserve_unit(size);
+
+    if (size == 0) {
+        *begin = page_boundary(mem, page_size);
+        *end = *begin;
+    }
+    else {
+        *begin = page_boundary(mem, unit);
+        *end = page_boundary(mem + size + (unit - 1), unit);
+    }
+}
+
+static bool
+commit_pages(char* begin, char* end)
+{
+    if (begin >= end) {
+        return true;
+    }
+    COUNT(mprotect_calls, 1);
+    return mprotect(begin, end - begin, PROT_READ | PROT_WRITE) == 0;
+}
+
+/* Protection is removed first, so no thread can fault the
+   pages back in after madvise released them.
+   Neither call should fail on a range inside the reservation.
+*/
+static void
+decommit_pages(char* begin, char* end)
+{
+    if (begin >= end) {
+        return;
+    }
+    dirty_replaced(begin, end - begin);
+    COUNT(mprotect_calls, 1);
+    if (mprotect(begin, end - begin, PROT_NONE) != 0
+        || madvise(begin, end - begin, MADV_DONTNEED) != 0)
+    {
+        abort();
+    }
+}
+
+/* Moves the window [mem, mem + size) of a reserved range
+   to [new_mem, new_mem + new_size), only touching the pages
+   entering or leaving the window.
+*/
+static bool
+recommit(char* mem, size_t size, char* new_mem, size_t new_size)
+{
+    char *old_begin, *old_end;
+    char *new_begin, *new_end;
+
+    committed_pages(mem, size, &old_begin, &old_end);
+    committed_pages(new_mem, new_size, &new_begin, &new_end);
+
+    if (!commit_pages(new_begin, old_begin < new_end ? old_begin : new_end)) {
+        return false;
+    }
+    if (!commit_pages(old_end > new_begin ? old_end : new_begin, new_end)) {
+        decommit_pages(new_begin, old_begin < new_end ? old_begin : new_end);
+        return false;
+    }
+    decommit_pages(old_begin, new_begin < old_end ? new_begin : old_end);
+    decommit_pages(new_end > old_begin ? new_end : old_begin, old_end);
+    return true;
+}
+
+/* Unmaps reserved address space, committed pages included */
+static void
+unmap_reserved(char* base, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    COUNT(munmap_calls, 1);
+    if (munmap(base, size) != 0) {
+        abort();
+    }
+    COUNT_RESERVED(0, size);
+}
+
+char* eds_memmap_reserve(size_t size)
+{
+    size_t unit;
+    size_t padding;
+    char *new_address;
+    char *aligned;
+
+    assert(page_size != 0);
+    assert(size <= RSIZE_MAX);
+
+    if (size == 0) {
+        return NULL;
+    }
+    unit = reserve_unit(size);
+    size = round_up(size, unit);
+    padding = unit - page_size;
+    COUNT(mmap_calls, 1);
+    new_address = mmap(NULL, size + padding, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (new_address == MAP_FAILED) {
+        return NULL;
+    }
+    COUNT_RESERVED(size + padding, 0);
+    aligned = page_boundary(new_address + padding, unit);
+    unmap_reserved(new_address, aligned - new_address);
+    unmap_reserved(aligned + size, (new_address + size + padding)
+                                   - (aligned + size));
+    advise_region(aligned, size, unit);
+    bind_new_mapping(aligned, size);
+    return aligned;
+}
+
+void eds_memmap_release(char* base, size_t size)
+{
+    assert(base == page_boundary(base, reserve_unit(size)));
+
+    if (base != NULL) {
+        unmap_reserved(base, round_up(size, reserve_unit(size)));
+    }
+}
+
+char* eds_memmap_commit_high(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(size <= RSIZE_MAX && delta <= RSIZE_MAX - size);
+
+    if (!recommit(mem, size, mem, size + delta)) {
+        return NULL;
+    }
+    return mem;
+}
+
+/* Committed pages are zero, except for the ones already
+   backing the window, past its end.
+*/
+char* eds_memmap_commit_high_zeroed(char* mem, size_t size, size_t delta)
+{
+    char *begin, *end;
+    size_t stale;
+
+    stale = 0;
+    if (size != 0) {
+        committed_pages(mem, size, &begin, &end);
+        stale = end - (mem + size);
+    }
+    if (eds_memmap_commit_high(mem, size, delta) == NULL) {
+        return NULL;
+    }
+    memset(mem + size, 0, stale < delta ? stale : delta);
+    return mem;
+}
+
+char* eds_memmap_commit_low(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(size <= RSIZE_MAX && delta <= RSIZE_MAX - size);
+
+    if (!recommit(mem, size, mem - delta, size + delta)) {
+        return NULL;
+    }
+    return mem - delta;
+}
+
+char* eds_memmap_decommit_high(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(delta <= size);
+
+    (void)recommit(mem, size, mem, size - delta);
+    return mem;
+}
+
+char* eds_memmap_decommit_low(char* mem, size_t size, size_t delta)
+{
+    assert(mem != NULL);
+    assert(delta <= size);
+
+    (void)recommit(mem, size, mem + delta, size - delta);
+    return mem + delta;
+}
+
+
+/* File backed reserved ranges.
+   The bytes of the range are stored in a memfd, at file offsets equal
+   to their distance from the start of the range.
+   While the file has a single view, it is mapped shared, and the pages
+   leaving the window are punched out of the file, like decommitted
+   anonymous pages. A copy maps the same file offsets privately, and
+   switches the original to private mappings too: from then on the file
+   is never written again, and each view gets private copies of the
+   pages it writes to.
+*/
+
+/* The pages backing the window [mem, mem + size) */
+static void
+file_pages(char* mem, size_t size, char** begin, char** end)
+{
+    *begin = page_boundary(mem, page_size);
+    *end = *begin;
+    if (size != 0) {
+        *end = page_boundary(mem + size + (page_size - 1), page_size);
+    }
+}
+
+/* Pages behind the file are private anonymous pages */
+static bool
+map_file_pages(const struct eds_memmap_file* file, char* begin, char* end)
+{
+    char* file_end = file->base + file->file_size;
+
+    if (begin >= end) {
+        return true;
+    }
+    dirty_replaced(begin, end - begin);
+    if (begin < file_end) {
+        COUNT(mmap_calls, 1);
+        if (mmap(begin, (end < file_end ? end : file_end) - begin,
+                 PROT_READ | PROT_WRITE,
+                 (file->shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED,
+                 file->fd, begin - file->base) == MAP_FAILED)
+        {
+            return false;
+        }
+    }
+    if (end > file_end) {
+        begin = begin > file_end ? begin : file_end;
+        COUNT(mmap_calls, 1);
+        if (mmap(begin, end - begin, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+            == MAP_FAILED)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Puts inaccessible, reserved pages back in place of the file.
+   Failing to punch a hole only leaves memory in use,
+   so its result is ignored.
+*/
+static void
+unmap_file_pages(const struct eds_memmap_file* file, char* begin, char* end)
+{
+    if (begin >= end) {
+        return;
+    }
+    dirty_replaced(begin, end - begin);
+    COUNT(mmap_calls, 1);
+    if (mmap(begin, end - begin, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+             -1, 0) == MAP_FAILED)
+    {
+        abort();
+    }
+    if (file->shared) {
+        (void)fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        begin - file->base, end - begin);
+    }
+}
+
+int eds_memmap_file_create(struct eds_memmap_file* file, size_t size)
+{
+    assert(page_size != 0);
+
+    file->base = eds_memmap_reserve(size);
+    if (file->base == NULL) {
+        return -1;
+    }
+    file->fd = memfd_create("eds_memmap", MFD_CLOEXEC);
+    if (file->fd < 0) {
+        eds_memmap_release(file->base, size);
+        return -1;
+    }
+    if (ftruncate(file->fd, round_up(size, page_size)) != 0) {
+        eds_memmap_file_release(file, size);
+        return -1;
+    }
+    file->shared = 1;
+    file->file_size = round_up(size, page_size);
+    return 0;
+}
+
+int eds_memmap_file_open_private(struct eds_memmap_file* file, int fd,
+                                 size_t file_size, size_t size)
+{
+    assert(page_size != 0);
+    assert(file_size <= size);
+
+    file->base = eds_memmap_reserve(size);
+    if (file->base == NULL) {
+        return -1;
+    }
+    file->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (file->fd < 0) {
+        eds_memmap_release(file->base, size);
+        file->base = NULL;
+        return -1;
+    }
+    file->shared = 0;
+    /* The page holding the end of the file reads as zero behind it */
+    file->file_size = round_up(file_size, page_size);
+    return 0;
+}
+
+void eds_memmap_file_release(struct eds_memmap_file* file, size_t size)
+{
+    if (file->base != NULL) {
+        eds_memmap_release(file->base, size);
+        close(file->fd);
+        file->base = NULL;
+        file->fd = -1;
+    }
+}
+
+int eds_memmap_file_move_window(const struct eds_memmap_file* file,
+                                char* mem, size_t size,
+                                char* new_mem, size_t new_size)
+{
+    char *old_begin, *old_end;
+    char *new_begin, *new_end;
+
+    file_pages(mem, size, &old_begin, &old_end);
+    file_pages(new_mem, new_size, &new_begin, &new_end);
+
+    if (!map_file_pages(file, new_begin,
+                        old_begin < new_end ? old_begin : new_end))
+    {
+        return -1;
+    }
+    if (!map_file_pages(file, old_end > new_begin ? old_end : new_begin,
+                        new_end))
+    {
+        unmap_file_pages(file, new_begin,
+                         old_begin < new_end ? old_begin : new_end);
+        return -1;
+    }
+    unmap_file_pages(file, old_begin, new_begin < old_end ? new_begin : old_end);
+    unmap_file_pages(file, new_end > old_begin ? new_end : old_begin, old_end);
+    return 0;
+}
+
+/* Copies the pages of [begin, end) which a private file mapping
+   holds copies of, instead of the file's pages, to the same offsets
+   from to. These are the anonymous pages in /proc/self/pagemap:
+   present or swapped, but not file pages.
+   Returns false when pagemap can't be read.
+*/
+#define PAGEMAP_PRESENT ((uint64_t)1 << 63)
+#define PAGEMAP_SWAPPED ((uint64_t)1 << 62)
+#define PAGEMAP_FILE ((uint64_t)1 << 61)
+#define PAGEMAP_BATCH 512
+
+static bool
+copy_private_pages(char* begin, char* end, char* to)
+{
+    uint64_t entries[PAGEMAP_BATCH];
+    size_t pages;
+    size_t index;
+    size_t count;
+    char* page;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    page = begin;
+    while (page < end) {
+        pages = (end - page) / page_size;
+        if (pages > PAGEMAP_BATCH) {
+            pages = PAGEMAP_BATCH;
+        }
+        count = pages * sizeof(*entries);
+        if (pread(fd, entries, count,
+                  (off_t)((uintptr_t)page / page_size * sizeof(*entries)))
+            != (ssize_t)count)
+        {
+            close(fd);
+            return false;
+        }
+        for (index = 0; index < pages; ++index, page += page_size) {
+            if ((entries[index] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED))
+                && !(entries[index] & PAGEMAP_FILE))
+            {
+                memcpy(to + (page - begin), page, page_size);
+            }
+        }
+    }
+    close(fd);
+    return true;
+}
+
+int eds_memmap_file_copy(struct eds_memmap_file* from, size_t reserved_size,
+                         char* mem, size_t size, struct eds_memmap_file* to)
+{
+    char *begin, *end;
+    char *to_begin;
+    bool had_copies;
+
+    to->base = eds_memmap_reserve(reserved_size);
+    if (to->base == NULL) {
+        return -1;
+    }
+    to->fd = fcntl(from->fd, F_DUPFD_CLOEXEC, 0);
+    if (to->fd < 0) {
+        eds_memmap_release(to->base, reserved_size);
+        to->base = NULL;
+        return -1;
+    }
+    to->shared = 0;
+    to->file_size = from->file_size;
+
+    file_pages(mem, size, &begin, &end);
+    to_begin = to->base + (begin - from->base);
+    if (!map_file_pages(to, to_begin, to_begin + (end - begin))) {
+        eds_memmap_file_release(to, reserved_size);
+        return -1;
+    }
+
+    /* A shared view has no private pages,
+       the file holds all of its contents
+    */
+    had_copies = !from->shared;
+    if (from->shared) {
+        from->shared = 0;
+        if (!map_file_pages(from, begin, end)) {
+            from->shared = 1;
+            if (!map_file_pages(from, begin, end)) {
+                abort();
+            }
+            eds_memmap_file_release(to, reserved_size);
+            return -1;
+        }
+    }
+    if (had_copies && !copy_private_pages(begin, end, to_begin)) {
+        memcpy(to_begin, begin, end - begin);
+    }
+    return 0;
+}
+
+/* Maps the size bytes of a ring file twice, from base on */
+static bool
+map_ring(int fd, char* base, size_t size)
+{
+    int copy;
+
+    for (copy = 0; copy < 2; ++copy) {
+        COUNT(mmap_calls, 1);
+        if (mmap(base + copy * size, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int eds_memmap_ring_create(struct eds_memmap_ring* ring, size_t size)
+{
+    assert(page_size != 0 && size % page_size == 0);
+
+    if (size == 0 || size > RSIZE_MAX / 2) {
+        return -1;
+    }
+    ring->base = eds_memmap_reserve(2 * size);
+    if (ring->base == NULL) {
+        return -1;
+    }
+    ring->fd = memfd_create("eds_memmap_ring", MFD_CLOEXEC);
+    if (ring->fd < 0) {
+        eds_memmap_release(ring->base, 2 * size);
+        ring->base = NULL;
+        return -1;
+    }
+    if (ftruncate(ring->fd, size) != 0
+        || !map_ring(ring->fd, ring->base, size))
+    {
+        eds_memmap_ring_release(ring, size);
+        return -1;
+    }
+    return 0;
+}
+
+void eds_memmap_ring_release(struct eds_memmap_ring* ring, size_t size)
+{
+    if (ring->base != NULL) {
+        eds_memmap_release(ring->base, 2 * size);
+        close(ring->fd);
+        ring->base = NULL;
+        ring->fd = -1;
+    }
+}
+
+/* The bytes which had wrapped around to the start of the file move
+   behind the old end, as far as the larger ring allows, the rest of
+   them wrap around the larger ring to the start of the file again.
+*/
+int eds_memmap_ring_grow(struct eds_memmap_ring* ring, size_t size,
+                         size_t offset, size_t count, size_t new_size)
+{
+    char* new_base;
+    size_t wrapped;
+    size_t behind;
+
+    assert(new_size % page_size == 0 && new_size >= size);
+    assert(offset < size && count <= size);
+
+    if (new_size > RSIZE_MAX / 2) {
+        return -1;
+    }
+    new_base = eds_memmap_reserve(2 * new_size);
+    if (new_base == NULL) {
+        return -1;
+    }
+    /* Growing the file leaves the old mappings intact */
+    if (ftruncate(ring->fd, new_size) != 0
+        || !map_ring(ring->fd, new_base, new_size))
+    {
+        eds_memmap_release(new_base, 2 * new_size);
+        return -1;
+    }
+    wrapped = offset + count > size ? offset + count - size : 0;
+    behind = wrapped < new_size - size ? wrapped : new_size - size;
+    memcpy(new_base + size, new_base, behind);
+    memmove(new_base, new_base + behind, wrapped - behind);
+    eds_memmap_release(ring->base, 2 * size);
+    ring->base = new_base;
+    return 0;
+}
+
+/* Bulk fill and copy.
+   Large operations are split into parts, run by a small pool of worker
+   threads, and by the calling thread. Each thread is the first to write
+   the pages of its parts, so with the default first touch NUMA policy,
+   the pages of a fresh region are allocated on the nodes of the threads
+   filling them, spreading the memory bandwidth over the nodes.
+   Only one operation at a time uses the pool, others run in their
+   calling thread.
+*/
+#define MAX_WORKERS 64
+#define PARTS_PER_THREAD 4
+#define MIN_PART_SIZE 0x100000
+#define FILL_BLOCK 4096
+#define STREAM_ALIGNMENT 64
+
+struct bulk_job
+{
+    void (*run)(const struct bulk_job* job, size_t offset, size_t size);
+    char* to;
+    const char* from;
+    size_t unit;
+    size_t size;
+    size_t part_size;
+    bool stream;
+
+    /* populate: the madvise advice, and the flag set on failure */
+    int advice;
+    int* failed;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    const struct bulk_job* job;
+    unsigned long generation;
+    size_t parts;
+    size_t next_part;
+    size_t finished_parts;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL, 0, 0, 0, 0
+};
+
+static pthread_mutex_t pool_owner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+static unsigned started_workers;
+
+static void
+configure_workers(const struct eds_memmap_config* config)
+{
+    long cpus;
+    long cache_size;
+
+    parallel_treshold = DEFAULT_PARALLEL_TRESHOLD;
+    if (config != NULL && config->parallel_treshold != 0) {
+        parallel_treshold = config->parallel_treshold;
+    }
+    if (config != NULL && config->worker_threads != 0) {
+        worker_count = config->worker_threads;
+    }
+    else {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 1 ? (unsigned)cpus - 1 : 0;
+        if (worker_count > DEFAULT_MAX_WORKERS) {
+            worker_count = DEFAULT_MAX_WORKERS;
+        }
+    }
+    if (worker_count > MAX_WORKERS) {
+        worker_count = MAX_WORKERS;
+    }
+
+    cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (cache_size > 0) {
+        stream_treshold = (size_t)cache_size;
+    }
+    else {
+        stream_treshold = DEFAULT_STREAM_TRESHOLD;
+    }
+}
+
+/* Runs parts of the current job until none are left to take.
+   Called, and returns with pool.lock held.
+*/
+static void
+run_parts(void)
+{
+    while (pool.next_part < pool.parts) {
+        const struct bulk_job* job = pool.job;
+        size_t offset = pool.next_part * job->part_size;
+        size_t size = job->size - offset;
+
+        if (size > job->part_size) {
+            size = job->part_size;
+        }
+        ++pool.next_part;
+        pthread_mutex_unlock(&pool.lock);
+        job->run(job, offset, size);
+        pthread_mutex_lock(&pool.lock);
+        if (++pool.finished_parts == pool.parts) {
+            pthread_cond_broadcast(&pool.done);
+        }
+    }
+}
+
+static void*
+bulk_worker(void* unused)
+{
+    unsigned long seen = 0;
+
+    (void)unused;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        run_parts();
+    }
+    return NULL;
+}
+
+/* The workers block all signals, leaving them to the threads
+   of the application.
+*/
+static void
+start_workers(void)
+{
+    pthread_t thread;
+    sigset_t all_signals;
+    sigset_t old_signals;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    while (started_workers < worker_count) {
+        if (pthread_create(&thread, NULL, bulk_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        ++started_workers;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+static void
+run_job(struct bulk_job* job)
+{
+    size_t threads;
+    size_t parts;
+    size_t step;
+
+    if (job->size >= parallel_treshold && worker_count != 0) {
+        pthread_once(&workers_once, start_workers);
+    }
+    threads = started_workers + 1;
+    parts = threads * PARTS_PER_THREAD;
+    if (job->size < parallel_treshold || started_workers == 0
+        || pthread_mutex_trylock(&pool_owner_lock) != 0)
+    {
+        job->run(job, 0, job->size);
+        return;
+    }
+
+    /* Parts start at multiples of the element size, and of the page size */
+    job->part_size = (job->size + parts - 1) / parts;
+    if (job->part_size < MIN_PART_SIZE) {
+        job->part_size = MIN_PART_SIZE;
+    }
+    step = page_size * job->unit;
+    job->part_size = (job->part_size + step - 1) / step * step;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.parts = (job->size + job->part_size - 1) / job->part_size;
+    pool.next_part = 0;
+    pool.finished_parts = 0;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.start);
+    run_parts();
+    while (pool.finished_parts < pool.parts) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.job = NULL;
+    pool.parts = 0;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool_owner_lock);
+}
+
+/* Copies size bytes, a multiple of STREAM_ALIGNMENT, to an aligned
+   destination, with stores bypassing the cache.
+*/
+static void
+stream_bytes(char* to, const char* from, size_t size)
+{
+    size_t offset;
+
+    assert((uintptr_t)to % STREAM_ALIGNMENT == 0);
+    assert(size % STREAM_ALIGNMENT == 0);
+
+#if defined(__AVX__)
+    for (offset = 0; offset < size; offset += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(from + offset));
+        __m256i high = _mm256_loadu_si256((const __m256i*)(from + offset + 32));
+
+        _mm256_stream_si256((__m256i*)(to + offset), low);
+        _mm256_stream_si256((__m256i*)(to + offset + 32), high);
+    }
+#elif defined(__SSE2__)
+    for (offset = 0; offset < size; offset += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(from + offset));
+        __m128i b = _mm_loadu_si128((const __m128i*)(from + offset + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(from + offset + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(from + offset + 48));
+
+        _mm_stream_si128((__m128i*)(to + offset), a);
+        _mm_stream_si128((__m128i*)(to + offset + 16), b);
+        _mm_stream_si128((__m128i*)(to + offset + 32), c);
+        _mm_stream_si128((__m128i*)(to + offset + 48), d);
+    }
+#else
+    (void)offset;
+    memcpy(to, from, size);
+#endif
+}
+
+static void
+stream_fence(void)
+{
+#if defined(__AVX__) || defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+/* The bytes to write before to is aligned for streaming */
+static size_t
+unaligned_head(const char* to, size_t size)
+{
+    size_t head = (STREAM_ALIGNMENT - (uintptr_t)to % STREAM_ALIGNMENT)
+                  % STREAM_ALIGNMENT;
+
+    return head < size ? head : size;
+}
+
+static void
+copy_part(const struct bulk_job* job, size_t offset, size_t size)
+{
+    char* to = job->to + offset;
+    const char* from = job->from + offset;
+    size_t head;
+    size_t body;
+
+    if (!job->stream) {
+        memcpy(to, from, size);
+        return;
+    }
+    head = unaligned_head(to, size);
+    body = (size - head) & ~(size_t)(STREAM_ALIGNMENT - 1);
+    memcpy(to, from, head);
+    stream_bytes(to + head, from + head, body);
+    memcpy(to + head + body, from + head + body, size - head - body);
+    stream_fence();
+}
+
+/* Fills size bytes with copies of the first unit bytes already there,
+   by doubling the filled range.
+*/
+static void
+replicate(char* to, size_t unit, size_t size)
+{
+    size_t filled = unit;
+
+    while (filled < size) {
+        size_t count = filled < size - filled ? filled : size - filled;
+
+        memcpy(to + filled, to, count);
+        filled += count;
+    }
+}
+
+static size_t
+greatest_common_divisor(size_t a, size_t b)
+{
+    while (b != 0) {
+        size_t rest = a % b;
+
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+/* Writes whole blocks holding copies of the pattern, from a buffer
+   in the cache, which is cheaper than doubling the filled range,
+   since nothing is read back from memory.
+*/
+static void
+fill_part(const struct bulk_job* job, size_t offset, size_t size)
+{
+    char block[FILL_BLOCK];
+    char* to = job->to + offset;
+    size_t unit = job->unit;
+    size_t period;
+    size_t block_size;
+    size_t head;
+    size_t phase;
+
+    period = unit / greatest_common_divisor(unit, STREAM_ALIGNMENT)
+             * STREAM_ALIGNMENT;
+    if (size < 2 * FILL_BLOCK || period > FILL_BLOCK) {
+        memcpy(to, job->from, unit);
+        replicate(to, unit, size);
+        return;
+    }
+
+    /* The block starts where the pattern is, at the first aligned byte */
+    head = unaligned_head(to, size);
+    phase = head % unit;
+    memcpy(block, job->from + phase, unit - phase);
+    memcpy(block + unit - phase, job->from, phase);
+    block_size = FILL_BLOCK / period * period;
+    replicate(block, unit, block_size);
+
+    memcpy(to, block + block_size - head, head);
+    to += head;
+    size -= head;
+    while (size >= block_size) {
+        if (job->stream) {
+            stream_bytes(to, block, block_size);
+        }
+        else {
+            memcpy(to, block, block_size);
+        }
+        to += block_size;
+        size -= block_size;
+    }
+    memcpy(to, block, size);
+    if (job->stream) {
+        stream_fence();
+    }
+}
+
+void eds_memmap_fill(char* mem, size_t size,
+                     const char* pattern, size_t pattern_size)
+{
+    struct bulk_job job;
+
+    assert(pattern_size != 0 && size % pattern_size == 0);
+
+    if (size == 0) {
+        return;
+    }
+    job.run = fill_part;
+    job.to = mem;
+    job.from = pattern;
+    job.unit = pattern_size;
+    job.size = size;
+    job.stream = size >= stream_treshold;
+    run_job(&job);
+}
+
+void eds_memmap_copy(char* to, const char* from, size_t size)
+{
+    struct bulk_job job;
+
+    if (size == 0) {
+        return;
+    }
+    job.run = copy_part;
+    job.to = to;
+    job.from = from;
+    job.unit = 1;
+    job.size = size;
+    job.stream = size >= stream_treshold;
+    run_job(&job);
+}
+
+/* Faults the pages in one at a time, for kernels without
+   MADV_POPULATE_READ / MADV_POPULATE_WRITE. Adding zero writes to
+   a page without changing it, even while other threads write to it.
+*/
+static void
+touch_each_page(char* begin, char* end, bool write)
+{
+    char* page;
+
+    for (page = begin; page < end; page += page_size) {
+        if (write) {
+            (void)__atomic_fetch_add(page, 0, __ATOMIC_RELAXED);
+        }
+        else {
+            (void)*(volatile char*)page;
+        }
+    }
+}
+
+static void
+populate_part(const struct bulk_job* job, size_t offset, size_t size)
+{
+    char* begin = job->to + offset;
+
+    COUNT(madvise_calls, 1);
+    if (madvise(begin, size, job->advice) == 0) {
+        return;
+    }
+    if (errno == EINVAL) {
+        touch_each_page(begin, begin + size,
+                        job->advice == MADV_POPULATE_WRITE);
+    }
+    else {
+        __atomic_store_n(job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int
+lock_pages(char* begin, char* end)
+{
+    if (mlock2(begin, end - begin, MLOCK_ONFAULT) == 0) {
+        return 0;
+    }
+    if (errno == ENOSYS || errno == EINVAL) {
+        return mlock(begin, end - begin);
+    }
+    return -1;
+}
+
+int eds_memmap_populate(char* mem, size_t size, unsigned flags)
+{
+    struct bulk_job job;
+    char *begin, *end;
+    int failed = 0;
+
+    assert(page_size != 0);
+
+    if (size == 0) {
+        return 0;
+    }
+    begin = page_boundary(mem, page_size);
+    end = page_boundary(mem + size + (page_size - 1), page_size);
+
+    /* Locked first, so the pages faulted in below are locked too */
+    if ((flags & EDS_MEMMAP_LOCK_ON_FAULT) && lock_pages(begin, end) != 0) {
+        return -1;
+    }
+    if (flags & EDS_MEMMAP_POPULATE_WILLNEED) {
+        COUNT(madvise_calls, 1);
+        (void)madvise(begin, end - begin, MADV_WILLNEED);
+    }
+    if (!(flags & (EDS_MEMMAP_POPULATE_WRITE | EDS_MEMMAP_POPULATE_READ))) {
+        return 0;
+    }
+    job.run = populate_part;
+    job.to = begin;
+    job.from = NULL;
+    job.unit = 1;
+    job.size = end - begin;
+    job.stream = false;
+    job.advice = (flags & EDS_MEMMAP_POPULATE_WRITE) ? MADV_POPULATE_WRITE
+                                                      : MADV_POPULATE_READ;
+    job.failed = &failed;
+    if (flags & EDS_MEMMAP_POPULATE_PARALLEL) {
+        run_job(&job);
+    }
+    else {
+        populate_part(&job, 0, job.size);
+    }
+    return failed ? -1 : 0;
+}
+
+void eds_memmap_unlock(char* mem, size_t size)
+{
+    char *begin, *end;
+
+    if (size == 0) {
+        return;
+    }
+    begin = page_boundary(mem, page_size);
+    end = page_boundary(mem + size + (page_size - 1), page_size);
+    (void)munlock(begin, end - begin);
+}
+
+/* Locked pages fail with EINVAL, and stay as they are */
+void eds_memmap_discard(char* mem, size_t size, enum eds_memmap_retain how)
+{
+    char *begin, *end;
+
+    assert(page_size != 0);
+
+    begin = page_boundary(mem + (page_size - 1), page_size);
+    end = page_boundary(mem + size, page_size);
+    if (how == EDS_MEMMAP_RETAIN_OFF || begin >= end) {
+        return;
+    }
+    dirty_replaced(begin, end - begin);
+    COUNT(madvise_calls, 1);
+    if (how == EDS_MEMMAP_RETAIN_FREE) {
+        if (madvise(begin, end - begin, MADV_FREE) == 0) {
+            return;
+        }
+        /* Kernels before 4.5 */
+        COUNT(madvise_calls, 1);
+    }
+    (void)madvise(begin, end - begin, MADV_DONTNEED);
+}
+
+/* The pages of a region share one policy, so the whole pages
+   it spans are bound, in its allocation unit.
+*/
+int eds_memmap_numa_bind(char* mem, size_t size,
+                         enum eds_memmap_numa_policy policy, int node)
+{
+    char* begin;
+
+    assert(page_size != 0);
+
+    if (size == 0) {
+        return 0;
+    }
+    begin = region_base(mem, size);
+    return bind_pages(begin, begin + total_size(mem, size), policy, node);
+}
+
+#define NUMA_QUERY_BATCH 512
+
+/* Without NUMA support in the kernel, the pages present are
+   all on node 0.
+*/
+static int
+count_present_pages(char* begin, char* end, size_t* pages_per_node)
+{
+    unsigned char present[NUMA_QUERY_BATCH];
+    size_t pages;
+    size_t index;
+
+    for (; begin < end; begin += pages * page_size) {
+        pages = (end - begin) / page_size;
+        if (pages > NUMA_QUERY_BATCH) {
+            pages = NUMA_QUERY_BATCH;
+        }
+        if (mincore(begin, pages * page_size, present) != 0) {
+            return -1;
+        }
+        for (index = 0; index < pages; ++index) {
+            pages_per_node[0] += present[index] & 1;
+        }
+    }
+    return 0;
+}
+
+int eds_memmap_numa_pages(const char* mem, size_t size,
+                          size_t* pages_per_node, int nodes)
+{
+    void* pages[NUMA_QUERY_BATCH];
+    int status[NUMA_QUERY_BATCH];
+    char *begin, *end;
+    size_t count;
+    size_t index;
+
+    assert(page_size != 0);
+
+    memset(pages_per_node, 0, nodes * sizeof(*pages_per_node));
+    if (size == 0 || nodes <= 0) {
+        return 0;
+    }
+    begin = page_boundary((char*)mem, page_size);
+    end = page_boundary((char*)mem + size + (page_size - 1), page_size);
+    while (begin < end) {
+        count = (end - begin) / page_size;
+        if (count > NUMA_QUERY_BATCH) {
+            count = NUMA_QUERY_BATCH;
+        }
+        for (index = 0; index < count; ++index) {
+            pages[index] = begin + index * page_size;
+        }
+        /* With no nodes given, move_pages only reports where they are */
+        if (syscall(SYS_move_pages, 0, (unsigned long)count, pages, NULL,
+                    status, 0) != 0)
+        {
+            return errno == ENOSYS
+                   ? count_present_pages(begin, end, pages_per_node) : -1;
+        }
+        for (index = 0; index < count; ++index) {
+            if (status[index] >= 0 && status[index] < nodes) {
+                ++pages_per_node[status[index]];
+            }
+        }
+        begin += count * page_size;
+    }
+    return 0;
+}
+
+
+/* Persistent files.
+   The header takes the first page, so that the data is page aligned,
+   and a mapping of the whole file is the header page followed by the
+   data capacity. Growing extends the file, whose new pages are holes
+   reading as zero, and the mapping with mremap, which moves it when
+   the address space behind it is taken.
+   An exclusive flock keeps other processes from mapping the file
+   at the same time, it goes away with the file descriptor.
+*/
+
+static void
+close_keeping_errno(int fd)
+{
+    int error = errno;
+
+    close(fd);
+    errno = error;
+}
+
+int eds_memmap_persistent_open(struct eds_memmap_persistent* file,
+                               const char* path, size_t element_size)
+{
+    struct eds_memmap_persistent_header* header;
+    struct stat status;
+    size_t size;
+    int fd;
+
+    assert(page_size != 0);
+    assert(element_size != 0);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &status) != 0) {
+        close_keeping_errno(fd);
+        return -1;
+    }
+    size = (size_t)status.st_size;
+    if (size == 0 && ftruncate(fd, page_size) == 0) {
+        size = page_size;
+    }
+    else if (size == 0) {
+        close_keeping_errno(fd);
+        return -1;
+    }
+    else if (size % page_size != 0 || size > RSIZE_MAX) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    COUNT(mmap_calls, 1);
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close_keeping_errno(fd);
+        return -1;
+    }
+    if (header->magic == 0 && header->element_size == 0) {
+        header->magic = EDS_MEMMAP_PERSISTENT_MAGIC;
+        header->element_size = element_size;
+        header->count = 0;
+    }
+    if (header->magic != EDS_MEMMAP_PERSISTENT_MAGIC
+        || header->element_size != element_size
+        || header->count > (size - page_size) / element_size)
+    {
+        COUNT(munmap_calls, 1);
+        munmap(header, size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    file->header = header;
+    file->data = (char*)header + page_size;
+    file->capacity = size - page_size;
+    file->fd = fd;
+    return 0;
+}
+
+void eds_memmap_persistent_close(struct eds_memmap_persistent* file)
+{
+    if (file->header != NULL) {
+        COUNT(munmap_calls, 1);
+        munmap(file->header, page_size + file->capacity);
+        close(file->fd);
+        file->header = NULL;
+        file->data = NULL;
+        file->capacity = 0;
+        file->fd = -1;
+    }
+}
+
+/* A file shrinks after its mapping, and grows before it, so the
+   mapping never reaches beyond the end of the file.
+*/
+int eds_memmap_persistent_resize(struct eds_memmap_persistent* file,
+                                 size_t capacity)
+{
+    size_t old_size = page_size + file->capacity;
+    size_t new_size;
+    char* new_mapping;
+
+    if (capacity > RSIZE_MAX - page_size) {
+        return -1;
+    }
+    new_size = page_size + round_up(capacity, page_size);
+    if (new_size == old_size) {
+        return 0;
+    }
+    if (new_size > old_size && ftruncate(file->fd, new_size) != 0) {
+        return -1;
+    }
+    new_mapping = mremap(file->header, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_mapping == MAP_FAILED) {
+        if (new_size > old_size) {
+            (void)ftruncate(file->fd, old_size);
+        }
+        return -1;
+    }
+    if (new_mapping == (char*)file->header) {
+        COUNT(mremap_in_place, 1);
+    }
+    else {
+        COUNT(mremap_moved, 1);
+    }
+    if (new_size < old_size) {
+        /* Failing only leaves the file longer than needed */
+        (void)ftruncate(file->fd, new_size);
+    }
+    file->header = (struct eds_memmap_persistent_header*)new_mapping;
+    file->data = new_mapping + page_size;
+    file->capacity = new_size - page_size;
+    return 0;
+}
+
+int eds_memmap_persistent_flush(const struct eds_memmap_persistent* file,
+                                size_t size, int wait)
+{
+    if (size > file->capacity) {
+        size = file->capacity;
+    }
+    return msync(file->header, page_size + round_up(size, page_size),
+                 wait ? MS_SYNC : MS_ASYNC);
+}
+
+
+/* Shared memory.
+   Readers map the file read only, and never beyond the capacity in the
+   header, which the owner only stores once the file has grown, so no
+   page of a mapping ever lies beyond the end of the file.
+*/
+
+#define SHARED_MAGIC 0x3148534d4d534445ull /* "EDSMMSH1" */
+
+static int
+map_shared_header(struct eds_memmap_shared* shared, int fd, int protection)
+{
+    shared->fd = fd;
+    COUNT(mmap_calls, 1);
+    shared->header = mmap(NULL, page_size, protection, MAP_SHARED, fd, 0);
+    if (shared->header == MAP_FAILED) {
+        shared->header = NULL;
+        close_keeping_errno(fd);
+        return -1;
+    }
+    shared->data = (char*)shared->header + page_size;
+    shared->capacity = 0;
+    shared->generation = 0;
+    return 0;
+}
+
+int eds_memmap_shared_create(struct eds_memmap_shared* shared,
+                             const char* name, size_t element_size)
+{
+    int fd;
+
+    assert(page_size != 0);
+    assert(element_size != 0);
+
+    if (name != NULL) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    else {
+        fd = memfd_create("eds_memmap_shared", MFD_CLOEXEC);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, page_size) != 0) {
+        close_keeping_errno(fd);
+        if (name != NULL) {
+            (void)shm_unlink(name);
+        }
+        return -1;
+    }
+    if (map_shared_header(shared, fd, PROT_READ | PROT_WRITE) != 0) {
+        if (name != NULL) {
+            (void)shm_unlink(name);
+        }
+        return -1;
+    }
+    shared->header->element_size = element_size;
+    __atomic_store_n(&shared->header->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int eds_memmap_shared_attach(struct eds_memmap_shared* shared,
+                             int fd, size_t element_size)
+{
+    int own_fd;
+
+    assert(page_size != 0);
+
+    own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own_fd < 0) {
+        return -1;
+    }
+    if (map_shared_header(shared, own_fd, PROT_READ) != 0) {
+        return -1;
+    }
+    if (__atomic_load_n(&shared->header->magic, __ATOMIC_ACQUIRE)
+            != SHARED_MAGIC
+        || shared->header->element_size != element_size)
+    {
+        eds_memmap_shared_release(shared);
+        errno = EINVAL;
+        return -1;
+    }
+    shared->generation = (uint64_t)-1;
+    if (eds_memmap_shared_refresh(shared) < 0) {
+        int error = errno;
+
+        eds_memmap_shared_release(shared);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int eds_memmap_shared_open(struct eds_memmap_shared* shared,
+                           const char* name, size_t element_size)
+{
+    int result;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    result = eds_memmap_shared_attach(shared, fd, element_size);
+    close_keeping_errno(fd);
+    return result;
+}
+
+void eds_memmap_shared_release(struct eds_memmap_shared* shared)
+{
+    if (shared->header != NULL) {
+        COUNT(munmap_calls, 1);
+        munmap(shared->header, page_size + shared->capacity);
+        close(shared->fd);
+        shared->header = NULL;
+        shared->data = NULL;
+        shared->capacity = 0;
+        shared->fd = -1;
+    }
+}
+
+int eds_memmap_shared_unlink(const char* name)
+{
+    return shm_unlink(name);
+}
+
+/* Moves the mapping to size bytes, which the file has already */
+static int
+remap_shared(struct eds_memmap_shared* shared, size_t capacity)
+{
+    char* new_mapping;
+
+    new_mapping = mremap(shared->header, page_size + shared->capacity,
+                         page_size + capacity, MREMAP_MAYMOVE);
+    if (new_mapping == MAP_FAILED) {
+        return -1;
+    }
+    if (new_mapping == (char*)shared->header) {
+        COUNT(mremap_in_place, 1);
+    }
+    else {
+        COUNT(mremap_moved, 1);
+    }
+    shared->header = (struct eds_memmap_shared_header*)new_mapping;
+    shared->data = new_mapping + page_size;
+    shared->capacity = capacity;
+    return 0;
+}
+
+int eds_memmap_shared_grow(struct eds_memmap_shared* shared,
+                           size_t capacity)
+{
+    if (capacity <= shared->capacity) {
+        return 0;
+    }
+    else if (capacity > RSIZE_MAX - page_size) {
+        return -1;
+    }
+    capacity = round_up(capacity, page_size);
+    if (ftruncate(shared->fd, page_size + capacity) != 0
+        || remap_shared(shared, capacity) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(&shared->header->capacity, capacity, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shared->header->generation, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int eds_memmap_shared_refresh(struct eds_memmap_shared* shared)
+{
+    uint64_t generation;
+    uint64_t capacity;
+
+    generation = __atomic_load_n(&shared->header->generation,
+                                 __ATOMIC_ACQUIRE);
+    if (generation == shared->generation) {
+        return 0;
+    }
+    capacity = __atomic_load_n(&shared->header->capacity, __ATOMIC_ACQUIRE);
+    if (capacity != shared->capacity
+        && remap_shared(shared, (size_t)capacity) != 0)
+    {
+        return -1;
+    }
+    shared->generation = generation;
+    return 1;
+}
+
+
+/* Read only file views */
+
+int eds_memmap_view_open(struct eds_memmap_view* view, const char* path)
+{
+    struct stat status;
+    void* base;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &status) != 0) {
+        close_keeping_errno(fd);
+        return -1;
+    }
+    base = NULL;
+    if (status.st_size != 0) {
+        COUNT(mmap_calls, 1);
+        base = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED,
+                    fd, 0);
+        if (base == MAP_FAILED) {
+            close_keeping_errno(fd);
+            return -1;
+        }
     }
+    view->base = base;
+    view->size = (size_t)status.st_size;
+    view->fd = fd;
+    return 0;
 }
 
-static char*
-expand_both_ends_small(char* mem, size_t size,
-                       size_t delta_high, size_t delta_low)
+void eds_memmap_view_close(struct eds_memmap_view* view)
 {
-    assert(mem != NULL);
-    assert(size > 0 && size < mmap_treshold);
-    assert(delta_low > 0);
-
-    char* new_address;
-    if (size + delta_low + delta_high < mmap_treshold) {
-        new_address = malloc(size + delta_low + delta_high);
+    if (view->fd >= 0) {
+        if (view->base != NULL) {
+            COUNT(munmap_calls, 1);
+            munmap((void*)view->base, view->size);
+        }
+        close(view->fd);
+        view->base = NULL;
+        view->size = 0;
+        view->fd = -1;
     }
-    else {
-        new_address = mmap_wrapper(size + delta_low + delta_high);
+}
+
+int eds_memmap_advise(const char* mem, size_t size,
+                      enum eds_memmap_access access)
+{
+    static const int advice[] = {
+        MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED,
+        MADV_DONTNEED
+    };
+    char *begin, *end;
+
+    assert(page_size != 0);
+
+    if (size == 0) {
+        return 0;
     }
-    if (new_address == NULL) {
-        return NULL;
+    begin = page_boundary((char*)mem, page_size);
+    end = page_boundary((char*)mem + size + (page_size - 1), page_size);
+    if (access == EDS_MEMMAP_ACCESS_DONTNEED) {
+        dirty_replaced(begin, end - begin);
     }
-    memcpy(new_address + delta_low, mem, size);
-    free(mem);
-    return new_address;
+    COUNT(madvise_calls, 1);
+    return madvise(begin, end - begin, advice[access]);
 }
 
-static char*
-expand_both_ends_large(char* mem, size_t size,
-                       size_t delta_high, size_t delta_low)
+
+/* Dirty page tracking and checkpoints */
+
+#define MAX_DIRTY_TRACKERS 64
+#define PAGEMAP_SOFT_DIRTY ((uint64_t)1 << 55)
+
+struct eds_memmap_dirty
 {
-    assert(mem != NULL);
-    assert(size >= mmap_treshold);
-    assert(delta_low > 0);
+    /* The range of the last checkpoint, and the pages it spans */
+    const char* mem;
+    char* begin;
+    char* end;
 
-    if (capacity_low(mem) >= delta_low &&
-        capacity_high(mem, size) >= delta_high)
-    {
-        return mem - delta_low;
+    /* A byte for each page from begin, set once it was written to, or
+       replaced. With write protection, the others are the pages
+       protected.
+    */
+    unsigned char* written;
+};
+
+/* The SIGSEGV handler reads the slots without taking the lock, a
+   tracker is taken out of its slot while it changes
+*/
+static struct eds_memmap_dirty* dirty_trackers[MAX_DIRTY_TRACKERS];
+static int dirty_tracker_count;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum eds_memmap_dirty_tracking dirty_tracking;
+static bool dirty_tracking_found;
+static struct sigaction previous_segv_action;
+
+static bool
+clear_soft_dirty(void)
+{
+    bool cleared;
+    int fd;
+
+    fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
     }
-    else {
-        char* new_address;
-        void* remap_result;
-        size_t new_low_pages;
-        size_t old_size;
-        size_t new_size;
+    cleared = write(fd, "4", 1) == 1;
+    close(fd);
+    return cleared;
+}
 
-        old_size = total_size(mem, size);
-        new_low_pages = round_up(delta_low - in_page_offset(mem));
-        new_size = old_size + new_low_pages;
-        if (delta_high > capacity_high(mem, size)) {
-            new_size += round_up(delta_high - capacity_high(mem, size));
+/* Sets the bytes of written for the pages of [begin, end) with their
+   soft-dirty bit set. Returns false when pagemap can't be read.
+*/
+static bool
+read_soft_dirty(char* begin, char* end, unsigned char* written)
+{
+    uint64_t entries[PAGEMAP_BATCH];
+    size_t pages;
+    size_t index;
+    size_t count;
+    char* page;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    page = begin;
+    while (page < end) {
+        pages = (end - page) / page_size;
+        if (pages > PAGEMAP_BATCH) {
+            pages = PAGEMAP_BATCH;
         }
-        new_address = mmap_wrapper(new_size);
-        if (new_address == NULL) {
-            return NULL;
+        count = pages * sizeof(*entries);
+        if (pread(fd, entries, count,
+                  (off_t)((uintptr_t)page / page_size * sizeof(*entries)))
+            != (ssize_t)count)
+        {
+            close(fd);
+            return false;
         }
-        remap_result = mremap(page_boundary(mem),
-                              old_size,
-                              old_size,
-                              MREMAP_MAYMOVE | MREMAP_FIXED,
-                              new_address + new_low_pages);
-        if (remap_result == MAP_FAILED) {
-            munmap_wrapper(new_address, new_size);
-            return NULL;
+        for (index = 0; index < pages; ++index, page += page_size) {
+            if (entries[index] & PAGEMAP_SOFT_DIRTY) {
+                written[(page - begin) / page_size] = 1;
+            }
         }
-        return new_address +
-               + (new_low_pages + in_page_offset(mem))
-               - delta_low;
     }
+    close(fd);
+    return true;
 }
 
-char* eds_memmap_expand_low(char* mem, size_t size, size_t delta)
+/* Kernels without soft-dirty bits report none, so a page written after
+   clearing them shows whether they exist. Clearing them is harmless
+   before the first tracker.
+*/
+static bool
+has_soft_dirty(void)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
+    unsigned char written = 0;
+    volatile char* page;
 
-    if (delta == 0) {
-        return mem;
+    page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        return false;
     }
-    if (mem == NULL) {
-        return eds_memmap_create(delta);
+    page[0] = 1;
+    if (clear_soft_dirty()) {
+        page[0] = 2;
+        if (!read_soft_dirty((char*)page, (char*)page + page_size,
+                             &written))
+        {
+            written = 0;
+        }
     }
-    else if ((size + delta) < size || (size + delta) > RSIZE_MAX) {
-        return NULL;
+    munmap((void*)page, page_size);
+    return written != 0;
+}
+
+static void
+unprotect_pages(char* begin, char* end)
+{
+    COUNT(mprotect_calls, 1);
+    (void)mprotect(begin, end - begin, PROT_READ | PROT_WRITE);
+}
+
+/* A write to a protected page of a tracker records the page, and makes
+   it writable, every other fault goes to the handler from before.
+   A page may be part of the stale range of a tracker, marked written
+   there, and of the range of another one.
+*/
+static void
+dirty_fault(int signal, siginfo_t* info, void* context)
+{
+    char* address = info->si_addr;
+    int slot;
+
+    if (info->si_code == SEGV_ACCERR) {
+        for (slot = 0; slot < MAX_DIRTY_TRACKERS; ++slot) {
+            struct eds_memmap_dirty* dirty;
+            size_t index;
+
+            dirty = __atomic_load_n(&dirty_trackers[slot], __ATOMIC_ACQUIRE);
+            if (dirty == NULL
+                || address < dirty->begin || address >= dirty->end)
+            {
+                continue;
+            }
+            index = (address - dirty->begin) / page_size;
+            if (dirty->written[index]) {
+                continue;
+            }
+            dirty->written[index] = 1;
+            if (mprotect(dirty->begin + index * page_size, page_size,
+                         PROT_READ | PROT_WRITE) == 0)
+            {
+                return;
+            }
+        }
     }
-    else if (size < mmap_treshold) {
-        return expand_both_ends_small(mem, size, 0, delta);
+    if (previous_segv_action.sa_flags & SA_SIGINFO) {
+        previous_segv_action.sa_sigaction(signal, info, context);
+    }
+    else if (previous_segv_action.sa_handler != SIG_DFL
+             && previous_segv_action.sa_handler != SIG_IGN)
+    {
+        previous_segv_action.sa_handler(signal);
     }
     else {
-        return expand_both_ends_large(mem, size, 0, delta);
+        /* The fault repeats, and takes the default action */
+        (void)sigaction(SIGSEGV, &previous_segv_action, NULL);
     }
 }
 
-char* eds_memmap_expand(char* mem, size_t size,
-                        size_t delta_high, size_t delta_low)
+/* With dirty_lock held, installs dirty_fault once */
+static bool
+install_dirty_fault(void)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
+    static bool installed;
+    struct sigaction action;
 
-    if (mem == NULL) {
-        return eds_memmap_create(delta_high + delta_low);
+    if (installed) {
+        return true;
     }
-    else if (delta_high == 0) {
-        return eds_memmap_expand_low(mem, size, delta_low);
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = dirty_fault;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    installed = sigaction(SIGSEGV, &action, &previous_segv_action) == 0;
+    return installed;
+}
+
+/* With dirty_lock held */
+static enum eds_memmap_dirty_tracking
+find_dirty_tracking(void)
+{
+    assert(page_size != 0);
+
+    if (dirty_tracking_found) {
+        return dirty_tracking;
     }
-    else if (delta_low == 0) {
-        return eds_memmap_expand_high(mem, size, delta_high);
+    dirty_tracking_found = true;
+    /* Soft-dirty bits are cleared for the whole process, which other
+       users of them wouldn't expect, so they are only used on request
+    */
+    if (install_dirty_fault()) {
+        dirty_tracking = EDS_MEMMAP_DIRTY_PROTECT;
     }
-    else if ((delta_low + delta_high < delta_low) ||
-             (size + delta_low + delta_high < size) ||
-             (size + delta_low + delta_high > RSIZE_MAX))
-    {
-        return NULL;
+    return dirty_tracking;
+}
+
+enum eds_memmap_dirty_tracking eds_memmap_dirty_tracking(void)
+{
+    enum eds_memmap_dirty_tracking tracking;
+
+    pthread_mutex_lock(&dirty_lock);
+    tracking = find_dirty_tracking();
+    pthread_mutex_unlock(&dirty_lock);
+    return tracking;
+}
+
+int eds_memmap_set_dirty_tracking(enum eds_memmap_dirty_tracking tracking)
+{
+    int result = 0;
+
+    assert(page_size != 0);
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty_tracker_count != 0) {
+        errno = EBUSY;
+        result = -1;
     }
-    else if (size < mmap_treshold) {
-        return expand_both_ends_small(mem, size, delta_high, delta_low);
+    else if ((tracking == EDS_MEMMAP_DIRTY_SOFT && !has_soft_dirty())
+             || (tracking == EDS_MEMMAP_DIRTY_PROTECT
+                 && !install_dirty_fault()))
+    {
+        errno = ENOTSUP;
+        result = -1;
     }
     else {
-        return expand_both_ends_large(mem, size, delta_high, delta_low);
+        dirty_tracking = tracking;
+        dirty_tracking_found = true;
     }
+    pthread_mutex_unlock(&dirty_lock);
+    return result;
 }
 
-static char*
-shrink_high_small(char* mem, size_t size, size_t delta)
+/* Marks the pages of dirty in [begin, end) written, the protected ones
+   become writable, at their address moved by shift.
+*/
+static void
+release_tracked_pages(struct eds_memmap_dirty* dirty, char* begin, char* end,
+                      ptrdiff_t shift)
 {
-    if (delta == size) {
-        free(mem);
-        return NULL;
+    char* run = NULL;
+    char* page;
+
+    begin = begin > dirty->begin ? begin : dirty->begin;
+    end = end < dirty->end ? end : dirty->end;
+    for (page = begin; page < end; page += page_size) {
+        unsigned char* written = dirty->written
+                                 + (page - dirty->begin) / page_size;
+
+        if (!*written && dirty_tracking == EDS_MEMMAP_DIRTY_PROTECT) {
+            run = run == NULL ? page : run;
+        }
+        else if (run != NULL) {
+            unprotect_pages(run + shift, page + shift);
+            run = NULL;
+        }
+        *written = 1;
     }
-    else {
-        return realloc(mem, size - delta);
+    if (run != NULL) {
+        unprotect_pages(run + shift, end + shift);
     }
 }
 
-static char*
-shrink_large_to_small(char* mem, size_t size,
-                      size_t delta_high, size_t delta_low)
+static void
+release_tracked(char* mem, size_t size, ptrdiff_t shift)
 {
-    assert(size >= delta_high && size >= delta_low);
-    assert(delta_high + delta_low >= delta_high);
-    assert(size >= delta_high + delta_low);
-
-    char *new_address;
-    size_t new_size;
+    char *begin, *end;
+    int slot;
 
-    new_size = size - delta_high - delta_low;
-    new_address = malloc(new_size);
-    if (new_address != NULL) {
-        memcpy(new_address, mem + delta_low, new_size);
-        munmap_wrapper(mem, total_size(mem, size));
+    if (__atomic_load_n(&dirty_tracker_count, __ATOMIC_ACQUIRE) == 0
+        || size == 0)
+    {
+        return;
     }
-    return new_address;
+    begin = page_boundary(mem, page_size);
+    end = page_boundary(mem + size + (page_size - 1), page_size);
+    pthread_mutex_lock(&dirty_lock);
+    for (slot = 0; slot < MAX_DIRTY_TRACKERS; ++slot) {
+        if (dirty_trackers[slot] != NULL) {
+            release_tracked_pages(dirty_trackers[slot], begin, end, shift);
+        }
+    }
+    pthread_mutex_unlock(&dirty_lock);
 }
 
-static char*
-shrink_high_large(char* mem, size_t size, size_t delta)
+/* Before the pages are unmapped, replaced, or given back */
+static void
+dirty_replaced(char* mem, size_t size)
 {
-    assert(size >= delta);
+    release_tracked(mem, size, 0);
+}
 
-    size_t scrap_pages;
-    char *head;
+void eds_memmap_dirty_write(const char* mem, size_t size)
+{
+    release_tracked((char*)mem, size, 0);
+}
 
-    scrap_pages = total_size(mem, size) - total_size(mem, size - delta);
-    if (scrap_pages != 0) {
-        head = mem + total_size(mem, size) - scrap_pages;
-        munmap_wrapper(head, scrap_pages);
+/* After mremap, which keeps the protection of the pages it moves,
+   and gives the pages it adds the protection of the last one
+*/
+static void
+dirty_remapped(char* from, size_t size, char* to, size_t new_size)
+{
+    if (__atomic_load_n(&dirty_tracker_count, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    if (to != from) {
+        release_tracked(from, size, to - from);
+    }
+    if (new_size > size && dirty_tracking == EDS_MEMMAP_DIRTY_PROTECT) {
+        unprotect_pages(to + size, to + new_size);
     }
-    return mem;
 }
 
-char* eds_memmap_shrink_high(char* mem, size_t size, size_t delta)
+struct eds_memmap_dirty* eds_memmap_dirty_create(void)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
+    struct eds_memmap_dirty* dirty;
+    int slot;
 
-    if (mem == NULL || delta > size) {
+    dirty = calloc(1, sizeof(*dirty));
+    if (dirty == NULL) {
         return NULL;
     }
-    else if (delta == 0) {
-        return mem;
-    }
-    else if (delta == size) {
-        eds_memmap_destroy(mem, size);
+    pthread_mutex_lock(&dirty_lock);
+    if (find_dirty_tracking() == EDS_MEMMAP_DIRTY_NONE) {
+        pthread_mutex_unlock(&dirty_lock);
+        free(dirty);
+        errno = ENOTSUP;
         return NULL;
     }
-    else if (size < mmap_treshold) {
-        return shrink_high_small(mem, size, delta);
-    }
-    else if (size - delta < mmap_treshold) {
-        return shrink_large_to_small(mem, size, delta, 0);
-    }
-    else {
-        return shrink_high_large(mem, size, delta);
+    for (slot = 0; slot < MAX_DIRTY_TRACKERS; ++slot) {
+        if (dirty_trackers[slot] == NULL) {
+            __atomic_store_n(&dirty_trackers[slot], dirty, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&dirty_tracker_count, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&dirty_lock);
+            return dirty;
+        }
     }
+    pthread_mutex_unlock(&dirty_lock);
+    free(dirty);
+    errno = ENOSPC;
+    return NULL;
 }
 
-static char*
-shrink_both_small(char* mem, size_t size,
-                  size_t delta_high, size_t delta_low)
+/* With dirty_lock held, returns the slot of dirty, emptied */
+static int
+take_tracker(struct eds_memmap_dirty* dirty)
 {
-    assert(mem != NULL);
-    assert(size > delta_low && size < mmap_treshold);
-    assert(delta_low > 0);
+    int slot;
 
-    char* new_address;
+    for (slot = 0; dirty_trackers[slot] != dirty; ++slot) {
+        assert(slot + 1 < MAX_DIRTY_TRACKERS);
+    }
+    __atomic_store_n(&dirty_trackers[slot], NULL, __ATOMIC_RELEASE);
+    return slot;
+}
 
-    new_address = malloc(size - delta_low - delta_high);
-    if (new_address == NULL) {
-        return NULL;
+void eds_memmap_dirty_destroy(struct eds_memmap_dirty* dirty)
+{
+    if (dirty == NULL) {
+        return;
     }
-    memcpy(new_address, mem + delta_low, size - delta_high - delta_low);
-    return new_address;
+    pthread_mutex_lock(&dirty_lock);
+    (void)take_tracker(dirty);
+    __atomic_sub_fetch(&dirty_tracker_count, 1, __ATOMIC_RELEASE);
+    release_tracked_pages(dirty, dirty->begin, dirty->end, 0);
+    pthread_mutex_unlock(&dirty_lock);
+    free(dirty->written);
+    free(dirty);
 }
 
-static char*
-shrink_both_large(char* mem, size_t size,
-                  size_t delta_high, size_t delta_low)
+/* Writes the bytes of [mem, mem + size) within [begin, end), at their
+   offsets from mem
+*/
+static bool
+write_range(int fd, const char* mem, size_t size,
+            const char* begin, const char* end, size_t* total)
 {
-    assert(mem != NULL);
-    assert(size >= mmap_treshold);
-    assert(size > delta_low);
-    assert(size > delta_high);
-    assert(delta_low > 0);
+    const char* from = begin > mem ? begin : mem;
+    const char* to = end < mem + size ? end : mem + size;
+    ssize_t written;
 
-    size_t scrap_low_pages;
+    while (from < to) {
+        written = pwrite(fd, from, to - from, from - mem);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (written <= 0) {
+            return false;
+        }
+        from += written;
+        *total += written;
+    }
+    return true;
+}
 
-    scrap_low_pages = page_boundary(mem + delta_low)
-                      - page_boundary(mem);
-    if (scrap_low_pages > 0) {
-        munmap_wrapper(mem, scrap_low_pages);
+/* With dirty_lock held. The pages start out written, and are cleared
+   as they are protected.
+*/
+static void
+protect_range(char* begin, char* end, unsigned char* written, char* base)
+{
+    if (dirty_tracking == EDS_MEMMAP_DIRTY_PROTECT) {
+        COUNT(mprotect_calls, 1);
+        if (mprotect(begin, end - begin, PROT_READ) != 0) {
+            /* E.g. hugetlb pages, which stay written */
+            return;
+        }
     }
-    mem += delta_low;
-    size -= delta_low;
-    return shrink_high_large(mem, size, delta_high);
+    memset(written + (begin - base) / page_size, 0,
+           (end - begin) / page_size);
 }
 
-char *eds_memmap_shrink_low(char* mem, size_t size, size_t delta)
+/* Checkpoints [mem, mem + size) to fd, or only tracks it from scratch
+   when fd is -1. Pages are written when they are outside the range
+   tracked, or written to, and the whole range when it starts
+   elsewhere.
+*/
+static ssize_t
+checkpoint_range(struct eds_memmap_dirty* dirty, int fd,
+                 const char* mem, size_t size, int wait)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
+    unsigned char* written = NULL;
+    unsigned char* old_written;
+    char *begin = NULL, *end = NULL;
+    char *run = NULL, *page;
+    size_t total = 0;
+    bool same_range;
+    bool failed = false;
+    int slot;
 
-    if (delta == 0) {
-        return mem;
+    assert(page_size != 0);
+
+    /* Allocated outside the lock, malloc may end up unmapping pages */
+    if (size >= mmap_treshold) {
+        begin = page_boundary((char*)mem, page_size);
+        end = page_boundary((char*)mem + size + (page_size - 1), page_size);
+        written = malloc((end - begin) / page_size);
+        if (written == NULL) {
+            return -1;
+        }
+        memset(written, 1, (end - begin) / page_size);
     }
-    else if (size == delta) {
-        eds_memmap_destroy(mem, size);
-        return NULL;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty_tracking == EDS_MEMMAP_DIRTY_SOFT) {
+        for (slot = 0; slot < MAX_DIRTY_TRACKERS; ++slot) {
+            struct eds_memmap_dirty* other = dirty_trackers[slot];
+
+            if (other != NULL && other->written != NULL
+                && !read_soft_dirty(other->begin, other->end,
+                                    other->written))
+            {
+                failed = true;
+            }
+        }
+        failed = failed || !clear_soft_dirty();
     }
-    else if (delta > size) {
-        return NULL;
+    slot = take_tracker(dirty);
+    same_range = dirty->written != NULL && dirty->mem == mem && !failed;
+
+    if (written == NULL && fd >= 0) {
+        failed = failed || !write_range(fd, mem, size, mem, mem + size,
+                                        &total);
     }
-    else if (size < mmap_treshold) {
-        return realloc(mem, size - delta);
+    for (page = begin; written != NULL && page <= end; page += page_size) {
+        bool changed = page < end
+                       && (fd < 0 || !same_range
+                           || page < dirty->begin || page >= dirty->end
+                           || dirty->written[(page - dirty->begin)
+                                             / page_size]);
+
+        if (changed && run == NULL) {
+            run = page;
+        }
+        else if (!changed && run != NULL) {
+            if (fd >= 0 && !write_range(fd, mem, size, run, page, &total)) {
+                failed = true;
+            }
+            protect_range(run, page, written, begin);
+            run = NULL;
+        }
+        if (!changed && page < end) {
+            /* Still protected, still clean */
+            written[(page - begin) / page_size] = 0;
+        }
     }
-    else if (size - delta < mmap_treshold) {
-        return shrink_large_to_small(mem, size, 0, delta);
+
+    /* The pages left behind become writable */
+    if (dirty->written != NULL) {
+        release_tracked_pages(dirty, dirty->begin,
+                              begin > dirty->begin ? begin : dirty->begin,
+                              0);
+        release_tracked_pages(dirty, end < dirty->end ? end : dirty->end,
+                              dirty->end, 0);
     }
-    else {
-        return shrink_both_large(mem, size, 0, delta);
+    if (fd >= 0 && !failed) {
+        failed = ftruncate(fd, (off_t)size) != 0
+                 || (wait && fdatasync(fd) != 0);
     }
+    old_written = dirty->written;
+    dirty->mem = mem;
+    dirty->begin = begin;
+    dirty->end = end;
+    dirty->written = written;
+    if (failed && written != NULL) {
+        /* The next checkpoint writes all pages */
+        dirty->mem = NULL;
+        release_tracked_pages(dirty, begin, end, 0);
+    }
+    __atomic_store_n(&dirty_trackers[slot], dirty, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dirty_lock);
+    free(old_written);
+    return failed ? -1 : (ssize_t)total;
 }
 
-char* eds_memmap_shrink(char* mem, size_t size,
-                        size_t delta_high, size_t delta_low)
+ssize_t eds_memmap_checkpoint(struct eds_memmap_dirty* dirty, int fd,
+                              const char* mem, size_t size, int wait)
 {
-    assert((mem == NULL && size == 0) || (mem != NULL && size != 0));
-    assert(size <= RSIZE_MAX);
-
-    if (delta_low == 0) {
-        return eds_memmap_shrink_high(mem, size, delta_high);
-    }
-    else if (mem == NULL || delta_high > size || delta_low > size) {
-        return NULL;
-    }
-    else if (size < mmap_treshold) {
-        return shrink_both_small(mem, size, delta_high, delta_low);
-    }
-    else if (size - delta_high - delta_low < mmap_treshold) {
-        return shrink_large_to_small(mem, size, delta_high, delta_low);
-    }
-    else {
-        return shrink_both_large(mem, size, delta_high, delta_low);
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
     }
+    return checkpoint_range(dirty, fd, mem, size, wait);
 }
 
+int eds_memmap_dirty_reset(struct eds_memmap_dirty* dirty,
+                           const char* mem, size_t size)
+{
+    return checkpoint_range(dirty, -1, mem, size, 0) < 0 ? -1 : 0;
+}
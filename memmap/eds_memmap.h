@@ -3,14 +3,165 @@
 #define EDS_MEMMAP_BASE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-void eds_memmap_initialize(void);
+enum eds_memmap_huge_pages
+{
+    EDS_MEMMAP_HUGE_OFF,
+    EDS_MEMMAP_HUGE_ADVISE, /* madvise(MADV_HUGEPAGE), transparent huge pages */
+    EDS_MEMMAP_HUGE_TLB     /* MAP_HUGETLB, falling back to normal pages
+                               when the hugetlb pool is exhausted */
+};
+
+/* Where the pages of a region are allocated, on hosts with several
+   NUMA nodes. On a single node, all of them do nothing.
+*/
+enum eds_memmap_numa_policy
+{
+    EDS_MEMMAP_NUMA_DEFAULT,    /* the node of the thread first writing
+                                   to a page, the process policy */
+    EDS_MEMMAP_NUMA_BIND,       /* only the node given (MPOL_BIND) */
+    EDS_MEMMAP_NUMA_PREFERRED,  /* the node given, others when it is
+                                   full (MPOL_PREFERRED) */
+    EDS_MEMMAP_NUMA_INTERLEAVE, /* page by page across all nodes,
+                                   for memory scanned by all of them
+                                   (MPOL_INTERLEAVE) */
+    EDS_MEMMAP_NUMA_LOCAL       /* the node of the thread first writing
+                                   to a page, whatever the process
+                                   policy (MPOL_LOCAL) */
+};
+
+/* A zero initialized config selects the defaults */
+struct eds_memmap_config
+{
+    /* Regions smaller than this are allocated with malloc, the rest
+       are mmap'd. Zero selects EDS_MMAP_TRESHOLD (128 KiB by default).
+    */
+    size_t mmap_treshold;
+
+    /* When non-zero, mmap_treshold is ignored, and the treshold is found
+       by timing realloc against mremap growth at sizes from 16 KiB
+       to 8 MiB. This takes a few tens of milliseconds.
+    */
+    int calibrate;
+
+    /* See eds_memmap_set_huge_pages */
+    enum eds_memmap_huge_pages huge_pages;
+    size_t huge_treshold;
+
+    /* Destroyed mmap'd regions are kept mapped, and reused for new
+       regions, up to cache_bytes in a pool shared by all threads,
+       plus up to thread_cache_bytes (zero: cache_bytes) in each thread.
+       Regions kept for longer than cache_max_age_ms (zero: one second)
+       are unmapped. Zero cache_bytes disables the cache.
+    */
+    size_t cache_bytes;
+    size_t thread_cache_bytes;
+    unsigned cache_max_age_ms;
+
+    /* eds_memmap_fill and eds_memmap_copy split operations of at least
+       parallel_treshold bytes (zero: 16 MiB) across worker_threads
+       threads (zero: one less than the number of CPUs, at most 7),
+       and the calling thread.
+    */
+    size_t parallel_treshold;
+    unsigned worker_threads;
+
+    /* See eds_memmap_set_numa_policy */
+    enum eds_memmap_numa_policy numa_policy;
+    int numa_node;
+};
+
+/* Must be called once, before any other eds_memmap function.
+   config may be NULL, to use the defaults.
+*/
+void eds_memmap_initialize(const struct eds_memmap_config* config);
+
+/* The treshold chosen by eds_memmap_initialize */
+size_t eds_memmap_get_mmap_treshold(void);
+
+size_t eds_memmap_get_page_size(void);
+
+/* Regions of at least treshold bytes are aligned to, and grown in
+   multiples of the huge page size (usually 2 MiB), using the policy given.
+   The treshold is raised to at least the huge page size.
+   Applies to all regions, it must be set right after
+   eds_memmap_initialize, before any region is created.
+*/
+void eds_memmap_set_huge_pages(enum eds_memmap_huge_pages policy,
+                               size_t treshold);
+
+/* One more than the highest NUMA node of the host, 1 when it
+   has a single node, or the kernel has no NUMA support
+*/
+int eds_memmap_numa_nodes(void);
+
+/* The policy of the regions and reserved ranges mapped from now on,
+   node is the node of EDS_MEMMAP_NUMA_BIND and _PREFERRED.
+   The pages keep it when they move or grow with mremap.
+*/
+void eds_memmap_set_numa_policy(enum eds_memmap_numa_policy policy,
+                                int node);
+
+/* Counters of all threads, summed. Building with EDS_MEMMAP_NO_STATS
+   removes the counting, and leaves all of them at zero.
+*/
+struct eds_memmap_stats
+{
+    /* system calls, mremap calls are counted when successful */
+    size_t mmap_calls;
+    size_t mremap_in_place;
+    size_t mremap_moved;
+    size_t munmap_calls;
+    size_t mprotect_calls;
+    size_t madvise_calls;
+    size_t mbind_calls;
+
+    /* regions below the mmap treshold */
+    size_t malloc_calls;
+    size_t realloc_calls;
+    size_t free_calls;
+
+    /* bytes copied instead of moving pages: when a region crosses the
+       mmap treshold, and when pages of a large region can't be moved
+    */
+    size_t copied_small_to_large;
+    size_t copied_large_to_small;
+    size_t copied_large_to_large;
+
+    /* mappings taken from the cache, or not found there */
+    size_t cache_hits;
+    size_t cache_misses;
+
+    /* bytes mapped for regions, cached mappings included */
+    size_t mapped_bytes;
+    size_t peak_mapped_bytes;
+    size_t cached_bytes;
+
+    /* address space set aside by eds_memmap_reserve */
+    size_t reserved_bytes;
+};
 
+void eds_memmap_get_stats(struct eds_memmap_stats* stats);
+
+/* Unmaps the regions kept in the cache of the calling thread,
+   and in the shared pool. The caches of other threads are left
+   alone: a thread hands its cache to the shared pool only when
+   it exits, and expires its entries only when it creates or
+   releases storage itself, so an idle thread keeps its cache
+   mapped until then. Call it from each thread to trim them all.
+*/
+void eds_memmap_trim_cache(void);
+
+/* The contents of a new region are unspecified,
+   as with malloc, since it may come from the cache.
+*/
 char *eds_memmap_create(size_t);
 
 char *eds_memmap_expand_high(char* mem, size_t size, size_t delta);
@@ -18,11 +169,22 @@ char *eds_memmap_expand_low(char* mem, size_t size, size_t delta);
 char *eds_memmap_expand(char* mem, size_t size,
                         size_t delta_high, size_t delta_low);
 
+/* Expands, and the delta new bytes read as zero.
+   Only the bytes which may hold old data are cleared, the fresh
+   pages the region grows into are left untouched, so they are
+   not even faulted in until used.
+*/
+char *eds_memmap_expand_high_zeroed(char* mem, size_t size, size_t delta);
+
 char *eds_memmap_shrink_high(char* mem, size_t size, size_t delta);
 char *eds_memmap_shrink_low(char* mem, size_t size, size_t delta);
 char *eds_memmap_shrink(char* mem, size_t size,
                         size_t delta_high, size_t delta_low);
 
+/* Concatenates two regions, the bytes of mem_b follow the bytes of mem_a
+   in the returned region. Both arguments are consumed on success.
+   Returns NULL (leaving both regions intact) on failure.
+*/
 #ifdef __cplusplus
 char *eds_memmap_merge(char* mem_a, size_t size_a,
                        char* mem_b, size_t size_b);
@@ -31,10 +193,438 @@ char *eds_memmap_merge(char* restrict mem_a, size_t size_a,
                        char* restrict mem_b, size_t size_b);
 #endif
 
-char *eds_memmap_split(char* mem, size_t size, size_t cut);
+/* Cuts a region in two: the first cut bytes stay in the returned region,
+   the rest are moved to a new region stored in *tail.
+   Both halves must later be destroyed separately.
+   Returns NULL (leaving the original region intact) on failure,
+   or if cut is not in the range (0, size).
+*/
+char *eds_memmap_split(char* mem, size_t size, size_t cut, char** tail);
 
 void eds_memmap_destroy(char* mem, size_t size);
 
+/* Moves count bytes of the region from offset from to offset to,
+   like memmove. When the distance is a multiple of the page size,
+   the whole pages in between are moved with mremap, which only
+   changes page tables, and only the partial pages at either end
+   are copied. The bytes at from which are not overwritten are
+   unspecified afterwards.
+   Not for windows of an eds_memmap_file, see below.
+*/
+void eds_memmap_move(char* mem, size_t size,
+                     size_t to, size_t from, size_t count);
+
+/* Bulk operations for large arrays of trivially copyable elements,
+   with non-temporal stores once the array wouldn't fit in the
+   last level cache, and split across threads, see
+   eds_memmap_config.parallel_treshold.
+   fill writes size bytes, a multiple of pattern_size, with copies
+   of the pattern_size bytes at pattern.
+*/
+void eds_memmap_fill(char* mem, size_t size,
+                     const char* pattern, size_t pattern_size);
+void eds_memmap_copy(char* to, const char* from, size_t size);
+
+/* Flags of eds_memmap_populate, which can be combined */
+enum eds_memmap_populate_flags
+{
+    /* Faults the pages in writable (MADV_POPULATE_WRITE, Linux 5.14),
+       as MAP_POPULATE does for a new mapping. Older kernels fall back
+       to touching each page. On a private file mapping, this copies
+       every page.
+    */
+    EDS_MEMMAP_POPULATE_WRITE = 1,
+
+    /* Faults the pages in for reading only (MADV_POPULATE_READ),
+       fresh anonymous pages then map the shared zero page
+    */
+    EDS_MEMMAP_POPULATE_READ = 2,
+
+    /* Starts reading file or swapped pages in, without waiting
+       (MADV_WILLNEED)
+    */
+    EDS_MEMMAP_POPULATE_WILLNEED = 4,
+
+    /* Locks the pages in memory as they are faulted in
+       (mlock2 MLOCK_ONFAULT, Linux 4.4, or mlock before that),
+       up to RLIMIT_MEMLOCK. Unmapping the pages unlocks them.
+    */
+    EDS_MEMMAP_LOCK_ON_FAULT = 8,
+
+    /* Splits populating at least parallel_treshold bytes across
+       the worker threads of eds_memmap_fill
+    */
+    EDS_MEMMAP_POPULATE_PARALLEL = 16
+};
+
+/* Moves the page faults of [mem, mem + size) out of the way, to the time
+   of the call, and optionally locks the pages, see
+   eds_memmap_populate_flags. It can run on any thread, e.g. to populate
+   a reserved range in the background, as long as the pages stay mapped.
+   Regions below the mmap treshold share their pages with other
+   malloc'd memory. Returns 0, or -1 when the pages couldn't be
+   faulted in or locked.
+*/
+int eds_memmap_populate(char* mem, size_t size, unsigned flags);
+
+/* Unlocks the pages locked by eds_memmap_populate */
+void eds_memmap_unlock(char* mem, size_t size);
+
+/* Sets the policy of the region [mem, mem + size), or of a reserved
+   range, and migrates the pages already allocated to match it.
+   All pages of a region should share one policy, growing it with
+   mremap fails across policies. Returns 0, or -1 on failure, e.g.
+   for a node without memory.
+*/
+int eds_memmap_numa_bind(char* mem, size_t size,
+                         enum eds_memmap_numa_policy policy, int node);
+
+/* Counts the pages of [mem, mem + size) allocated on each of the
+   first nodes nodes, into pages_per_node. Pages not allocated yet
+   are not counted. Returns 0, or -1 on failure.
+*/
+int eds_memmap_numa_pages(const char* mem, size_t size,
+                          size_t* pages_per_node, int nodes);
+
+/* How eds_memmap_discard gives pages back to the kernel */
+enum eds_memmap_retain
+{
+    EDS_MEMMAP_RETAIN_OFF,
+
+    /* MADV_FREE (Linux 4.5, MADV_DONTNEED before that): the kernel
+       takes the pages only under memory pressure, until then
+       writing to them again takes no page fault. The bytes are
+       unspecified until written.
+    */
+    EDS_MEMMAP_RETAIN_FREE,
+
+    /* MADV_DONTNEED: the pages are released right away,
+       and read as zero afterwards
+    */
+    EDS_MEMMAP_RETAIN_DONTNEED
+};
+
+/* Releases the memory of the whole pages inside [mem, mem + size),
+   of an mmap'd region, and keeps them mapped, so the region can
+   grow back into them without a system call. Locked pages are kept.
+*/
+void eds_memmap_discard(char* mem, size_t size, enum eds_memmap_retain how);
+
+/* Reserves size bytes of inaccessible address space (PROT_NONE,
+   MAP_NORESERVE), without using any memory yet.
+   Returns NULL on failure.
+*/
+char *eds_memmap_reserve(size_t size);
+void eds_memmap_release(char* base, size_t size);
+
+/* A window [mem, mem + size) inside a reserved range is accessible.
+   These grow or shrink the window at either end, by changing the
+   protection of the pages entering or leaving it, the bytes inside
+   the window never move.
+   The caller must keep the window inside the reserved range.
+   The commit functions return the new start of the window,
+   or NULL (leaving the window intact) on failure.
+   Decommitted pages are released, they read as zero when
+   committed again.
+   commit_high_zeroed also clears the bytes of the pages already
+   committed, like eds_memmap_expand_high_zeroed.
+*/
+char *eds_memmap_commit_high(char* mem, size_t size, size_t delta);
+char *eds_memmap_commit_low(char* mem, size_t size, size_t delta);
+char *eds_memmap_commit_high_zeroed(char* mem, size_t size, size_t delta);
+char *eds_memmap_decommit_high(char* mem, size_t size, size_t delta);
+char *eds_memmap_decommit_low(char* mem, size_t size, size_t delta);
+
+/* A reserved range backed by a memfd, which can be copied in constant
+   time: the copy maps the same file pages privately, and the pages are
+   only duplicated when either side writes to them.
+   Each byte is stored at its distance from base in the file.
+*/
+struct eds_memmap_file
+{
+    char* base;
+    int fd;
+
+    /* Non-zero until the first copy, writes go to the file */
+    int shared;
+
+    /* The bytes from base backed by the file, a multiple of the page
+       size, the pages behind them are anonymous
+    */
+    size_t file_size;
+};
+
+/* Reserves size bytes, and creates the file.
+   Returns 0, or -1 on failure.
+*/
+int eds_memmap_file_create(struct eds_memmap_file* file, size_t size);
+void eds_memmap_file_release(struct eds_memmap_file* file, size_t size);
+
+/* Like the commit and decommit functions: moves the accessible window
+   [mem, mem + size) to [new_mem, new_mem + new_size), mapping the pages
+   entering it from the file. Pages entering the window of a copy may
+   hold old data. Returns 0, or -1 (leaving the window intact) on failure.
+*/
+int eds_memmap_file_move_window(const struct eds_memmap_file* file,
+                                char* mem, size_t size,
+                                char* new_mem, size_t new_size);
+
+/* Reserves size bytes, with the file_size bytes of the file fd at the
+   start, mapped privately: their pages are read from the file when
+   accessed, and copied on the first write, the file never changes.
+   fd is duplicated. Returns 0, or -1 on failure.
+*/
+int eds_memmap_file_open_private(struct eds_memmap_file* file, int fd,
+                                 size_t file_size, size_t size);
+
+/* Creates a copy of the window [mem, mem + size) of the reserved_size
+   bytes at from->base, with its own reservation and file descriptor,
+   where the window is at the same distance from to->base.
+   The pages from wrote to since its first copy are copied,
+   the rest are shared. Returns 0, or -1 on failure.
+*/
+int eds_memmap_file_copy(struct eds_memmap_file* from, size_t reserved_size,
+                         char* mem, size_t size, struct eds_memmap_file* to);
+
+/* A read only, shared mapping of a whole file */
+struct eds_memmap_view
+{
+    const char* base;
+    size_t size;
+    int fd;
+};
+
+/* Returns 0, or -1 setting errno */
+int eds_memmap_view_open(struct eds_memmap_view* view, const char* path);
+void eds_memmap_view_close(struct eds_memmap_view* view);
+
+/* How a range is going to be accessed, see madvise(2) */
+enum eds_memmap_access
+{
+    EDS_MEMMAP_ACCESS_NORMAL,
+    EDS_MEMMAP_ACCESS_SEQUENTIAL, /* reads ahead aggressively, and drops
+                                     the pages behind soon */
+    EDS_MEMMAP_ACCESS_RANDOM,     /* reads only the pages accessed */
+    EDS_MEMMAP_ACCESS_WILLNEED,   /* starts reading the pages now */
+    EDS_MEMMAP_ACCESS_DONTNEED    /* the pages can go, file pages are
+                                     read again when accessed */
+};
+
+/* Advises the kernel on the pages [mem, mem + size) overlaps.
+   Returns 0, or -1 on failure.
+*/
+int eds_memmap_advise(const char* mem, size_t size,
+                      enum eds_memmap_access access);
+
+/* A ring of size bytes, a multiple of the page size, in a memfd which
+   is mapped twice, back to back: the byte at base + size + i is the
+   byte at base + i. The size bytes from any offset below size are
+   contiguous in memory, whether or not they wrap around.
+*/
+struct eds_memmap_ring
+{
+    char* base;
+    int fd;
+};
+
+/* Returns 0, or -1 on failure */
+int eds_memmap_ring_create(struct eds_memmap_ring* ring, size_t size);
+void eds_memmap_ring_release(struct eds_memmap_ring* ring, size_t size);
+
+/* Grows the ring to new_size bytes, also a multiple of the page size,
+   keeping the count bytes from offset at the same offset. The file
+   only grows, the bytes which had wrapped around are the only ones
+   copied. Returns 0, or -1 (leaving the ring intact) on failure.
+*/
+int eds_memmap_ring_grow(struct eds_memmap_ring* ring, size_t size,
+                         size_t offset, size_t count, size_t new_size);
+
+/* A file on disk mapped shared, which outlives the process: a header
+   page, followed by capacity bytes of data. The header records the
+   number of elements stored, and their size, and is updated in place,
+   through the mapping. Opening the file again maps it in one call,
+   its pages are only read in when accessed.
+   The file can only be open once at a time, see flock(2).
+*/
+#define EDS_MEMMAP_PERSISTENT_MAGIC 0x3150414d4d534445ull /* "EDSMMAP1" */
+
+struct eds_memmap_persistent_header
+{
+    uint64_t magic;
+    uint64_t element_size;
+    uint64_t count;
+};
+
+struct eds_memmap_persistent
+{
+    struct eds_memmap_persistent_header* header;
+    char* data;
+    size_t capacity;
+    int fd;
+};
+
+/* Opens the file at path, creating it when missing, with room for no
+   elements. Returns 0, or -1 setting errno: EINVAL for a file which
+   is not an eds_memmap file of elements of element_size bytes,
+   EWOULDBLOCK when it is open already.
+*/
+int eds_memmap_persistent_open(struct eds_memmap_persistent* file,
+                               const char* path, size_t element_size);
+void eds_memmap_persistent_close(struct eds_memmap_persistent* file);
+
+/* Changes the data capacity to at least capacity bytes, a multiple of
+   the page size, with ftruncate and mremap, the bytes below both
+   capacities stay. Data may move. Returns 0, or -1 on failure.
+*/
+int eds_memmap_persistent_resize(struct eds_memmap_persistent* file,
+                                 size_t capacity);
+
+/* Writes the header, and the first size bytes of data, to the file,
+   waiting for the writes to complete, unless wait is zero.
+   Returns 0, or -1 on failure.
+*/
+int eds_memmap_persistent_flush(const struct eds_memmap_persistent* file,
+                                size_t size, int wait);
+
+/* Shared memory, written by the process creating it, the owner, and
+   read by others, attached to it by name, or by a file descriptor
+   passed to them. Like a persistent file, a header page is followed
+   by capacity bytes of data.
+   The owner grows the file with ftruncate, and its own mapping with
+   mremap, then stores the new capacity, and increments generation.
+   Readers which see generation change remap their view to the new
+   capacity, see eds_memmap_shared_refresh. The file never shrinks,
+   the pages of readers would be cut off.
+   The owner publishes count, with a release store, after writing the
+   elements, readers load it with an acquire load.
+*/
+struct eds_memmap_shared_header
+{
+    uint64_t magic;
+    uint64_t element_size;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t generation;
+};
+
+struct eds_memmap_shared
+{
+    struct eds_memmap_shared_header* header;
+    char* data;
+    size_t capacity;
+    int fd;
+
+    /* The generation the mapping has the capacity of */
+    uint64_t generation;
+};
+
+/* Creates shared memory for elements of element_size bytes, named
+   name in /dev/shm (see shm_open), or anonymous, a memfd, when name
+   is NULL, for passing the file descriptor to other processes.
+   Returns 0, or -1 setting errno, EEXIST when the name exists.
+*/
+int eds_memmap_shared_create(struct eds_memmap_shared* shared,
+                             const char* name, size_t element_size);
+
+/* Maps the shared memory named name, or the file descriptor fd, which
+   is duplicated, for reading. Returns 0, or -1 setting errno,
+   EINVAL when it holds no elements of element_size bytes.
+*/
+int eds_memmap_shared_open(struct eds_memmap_shared* shared,
+                           const char* name, size_t element_size);
+int eds_memmap_shared_attach(struct eds_memmap_shared* shared,
+                             int fd, size_t element_size);
+
+void eds_memmap_shared_release(struct eds_memmap_shared* shared);
+
+/* Removes the name, the memory goes away with the last mapping */
+int eds_memmap_shared_unlink(const char* name);
+
+/* The owner grows the capacity to at least capacity bytes, a multiple
+   of the page size. Data may move. Returns 0, or -1 on failure.
+*/
+int eds_memmap_shared_grow(struct eds_memmap_shared* shared,
+                           size_t capacity);
+
+/* A reader maps the capacity of the latest generation. Returns 1 when
+   it remapped, which may move the data, 0 when it was up to date,
+   or -1 on failure.
+*/
+int eds_memmap_shared_refresh(struct eds_memmap_shared* shared);
+
+/* How the pages written since a checkpoint are found */
+enum eds_memmap_dirty_tracking
+{
+    EDS_MEMMAP_DIRTY_NONE,    /* not at all, checkpoints fail */
+    EDS_MEMMAP_DIRTY_SOFT,    /* from the soft-dirty bits of
+                                 /proc/self/pagemap. Each checkpoint
+                                 clears them with /proc/self/clear_refs
+                                 for the whole process, which breaks
+                                 other users of the bits, e.g. CRIU */
+    EDS_MEMMAP_DIRTY_PROTECT  /* the pages are write protected, the
+                                 first write to each one faults, and a
+                                 SIGSEGV handler records it. System
+                                 calls writing to tracked pages, e.g.
+                                 read(2) or recv(2), fail with EFAULT
+                                 instead, see eds_memmap_dirty_write */
+};
+
+/* The tracking in use, write protection unless chosen otherwise,
+   found on first use
+*/
+enum eds_memmap_dirty_tracking eds_memmap_dirty_tracking(void);
+
+/* Chooses the tracking instead, e.g. EDS_MEMMAP_DIRTY_SOFT where the
+   kernel has soft-dirty bits (CONFIG_MEM_SOFT_DIRTY), and nothing
+   else in the process uses them. Returns 0, or -1 setting errno,
+   EBUSY while there are trackers, ENOTSUP when the kernel lacks it.
+*/
+int eds_memmap_set_dirty_tracking(enum eds_memmap_dirty_tracking tracking);
+
+/* The pages written, in a range of a region, since the last checkpoint
+   of it. A process has up to 64 of them at once.
+   With write protection, the SIGSEGV handler passes faults outside the
+   pages tracked on to the handler installed before. Pages moving,
+   being unmapped or given back by the functions here are counted as
+   written, moving a range always takes a full checkpoint.
+   Ranges below the mmap treshold, in malloc'd memory, are not tracked,
+   their checkpoints write them in full.
+*/
+struct eds_memmap_dirty;
+
+/* Returns NULL setting errno, ENOTSUP without dirty page tracking */
+struct eds_memmap_dirty* eds_memmap_dirty_create(void);
+
+/* Write protected pages become writable again */
+void eds_memmap_dirty_destroy(struct eds_memmap_dirty* dirty);
+
+/* Counts the pages [mem, mem + size) overlaps as written in every
+   tracker, making the write protected ones writable, before a system
+   call writes to them, which would fail with EFAULT otherwise.
+*/
+void eds_memmap_dirty_write(const char* mem, size_t size);
+
+/* Writes the size bytes at mem to the file fd, and truncates it to
+   size bytes, or only the pages written since the previous checkpoint
+   of the same range, at the same offsets, the first one writes all of
+   them. Then tracks the range from scratch, waiting for the writes to
+   reach the disk first, unless wait is zero.
+   No thread may write to the range meanwhile. With write protection,
+   system calls writing into the range afterwards, e.g. read(2) or
+   recv(2), fail with EFAULT, unless eds_memmap_dirty_write is called
+   on their buffer first.
+   Returns the number of bytes written, or -1 setting errno, the next
+   checkpoint writes all bytes then.
+*/
+ssize_t eds_memmap_checkpoint(struct eds_memmap_dirty* dirty, int fd,
+                              const char* mem, size_t size, int wait);
+
+/* Tracks the range from scratch, as if it had just been written to a
+   checkpoint, e.g. after mapping it from one. Returns 0, or -1.
+*/
+int eds_memmap_dirty_reset(struct eds_memmap_dirty* dirty,
+                           const char* mem, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,564 @@
+#include "benchmark.h"
+#include "eds_memmap.h"
+#include "mapped_view.h"
+#include "memmap.h"
+#include "persistent_memmap.h"
+#include "shared_memmap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace benchmark
+{
+
+namespace
+{
+
+/* A fresh empty file in /tmp, removed again on destruction */
+struct temp_file
+{
+  std::string path;
+
+  temp_file():
+    path("/tmp/eds_benchmark_XXXXXX")
+  {
+    int fd = mkstemp(&path[0]);
+
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    close(fd);
+  }
+
+  ~temp_file()
+  {
+    unlink(path.c_str());
+  }
+
+  size_t size() const
+  {
+    struct stat status;
+
+    return stat(path.c_str(), &status) == 0 ? size_t(status.st_size) : 0;
+  }
+};
+
+/* Appends count elements to a file, and opens it again, which takes a
+   single mmap whatever its size.
+*/
+double persistent_workload(size_t count, latency_recorder& latency)
+{
+  temp_file file;
+  eds::persistent_memmap<int> vector(file.path.c_str());
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    vector.push_back(static_cast<int>(n));
+  }
+  clock::time_point step = clock::now();
+  vector.close();
+  vector.open(file.path.c_str());
+  latency.add(step, clock::now());
+  return elapsed_ns(start, clock::now());
+}
+
+/* A persistent_memmap opened again finds its elements, and while it is
+   open, opening it a second time fails. Shrinking it and growing it
+   back adds zero elements, and shrink_to_fit truncates the file to the
+   elements left.
+*/
+void check_persistent_memmap()
+{
+  static constexpr size_t count = 100000;
+
+  temp_file file;
+  eds::persistent_memmap<int> vector(file.path.c_str());
+  bool valid = true;
+
+  for (size_t n = 0; n < count; ++n) {
+    vector.push_back(static_cast<int>(n));
+  }
+  vector.close();
+  vector.open(file.path.c_str());
+  for (size_t index = 0; index < count; ++index) {
+    valid = valid and vector[index] == static_cast<int>(index);
+  }
+  check(valid and vector.size() == count,
+        "persistent_memmap finds its elements when opened again");
+
+  try {
+    eds::persistent_memmap<int> second(file.path.c_str());
+
+    valid = false;
+  }
+  catch (const std::system_error& error) {
+    valid = error.code() == std::errc::operation_would_block;
+  }
+  check(valid, "persistent_memmap is opened by one owner at a time");
+
+  vector.resize(count / 2);
+  vector.resize(count);
+  for (size_t index = count / 2; index < count; ++index) {
+    valid = valid and vector[index] == 0;
+  }
+  check(valid, "persistent_memmap::resize adds zero elements");
+
+  size_t page_size = eds_memmap_get_page_size();
+  size_t bytes = count / 4 * sizeof(int);
+
+  vector.resize(count / 4);
+  vector.shrink_to_fit();
+  check(vector.capacity() * sizeof(int)
+          == (bytes + page_size - 1) / page_size * page_size
+        and file.size() == page_size + vector.capacity() * sizeof(int),
+        "persistent_memmap::shrink_to_fit truncates the file");
+  vector.close();
+  vector.open(file.path.c_str());
+  for (size_t index = 0; index < count / 4; ++index) {
+    valid = valid and vector[index] == static_cast<int>(index);
+  }
+  check(valid and vector.size() == count / 4,
+        "persistent_memmap keeps its elements when truncated");
+}
+
+/* Writes count elements to the file, and a trailing partial one */
+void write_view_file(const temp_file& file, size_t count)
+{
+  std::vector<int> elements(count);
+  int fd = open(file.path.c_str(), O_WRONLY | O_CLOEXEC);
+
+  for (size_t index = 0; index < count; ++index) {
+    elements[index] = static_cast<int>(index);
+  }
+  check(fd >= 0
+        and write(fd, elements.data(), count * sizeof(int))
+              == ssize_t(count * sizeof(int))
+        and write(fd, "..", 2) == 2
+        and close(fd) == 0,
+        "mapped_view test file");
+}
+
+/* Scans the view, advising the window in front of the scan */
+long long scan_view(eds::mapped_view<int>& view)
+{
+  long long sum = 0;
+
+  view.access(EDS_MEMMAP_ACCESS_SEQUENTIAL);
+  for (size_t index = 0; index < view.size(); ++index) {
+    view.read_ahead(index);
+    sum += view[index];
+  }
+  return sum;
+}
+
+/* Maps a file of count elements, and a trailing partial one, scans
+   it, and makes a copy on write with room for twice as many, which
+   it grows to that size, and writes to.
+*/
+double view_workload(size_t count, latency_recorder& latency)
+{
+  temp_file file;
+
+  write_view_file(file, count);
+
+  clock::time_point start = clock::now();
+  eds::mapped_view<int> view(file.path.c_str());
+  long long sum = scan_view(view);
+
+  clock::time_point step = clock::now();
+  eds::memmap<int> copy = view.copy_on_write(2 * count);
+
+  copy.resize(2 * count);
+  latency.add(step, clock::now());
+  copy[0] = static_cast<int>(sum);
+  return elapsed_ns(start, clock::now());
+}
+
+/* A mapped_view reads the whole elements of a file, leaving out the
+   trailing partial one. Growing its copy on write into the pages
+   behind the end of the file, which are anonymous, reads zeros, and
+   writing to the copy leaves the file as it is.
+*/
+void check_mapped_view()
+{
+  static constexpr size_t count = 100000;
+
+  temp_file file;
+  bool valid = true;
+  int first = -1;
+
+  write_view_file(file, count);
+
+  eds::mapped_view<int> view(file.path.c_str());
+  long long sum = scan_view(view);
+
+  for (size_t index = 0; index < view.size(); ++index) {
+    valid = valid and view[index] == static_cast<int>(index);
+  }
+  check(valid and view.size() == count
+        and sum == (long long)count * (count - 1) / 2,
+        "mapped_view reads the whole elements of the file");
+
+  eds::memmap<int> copy = view.copy_on_write(2 * count);
+
+  copy.resize(2 * count);
+  for (size_t index = 0; index < 2 * count; ++index) {
+    valid = valid and copy[index] == (index < count ? int(index) : 0);
+  }
+  check(valid, "mapped_view::copy_on_write reads zeros behind the file");
+
+  copy[0] = -1;
+  copy[2 * count - 1] = -1;
+
+  int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  check(fd >= 0 and pread(fd, &first, sizeof(int), 0) == sizeof(int)
+        and close(fd) == 0 and first == 0 and view[0] == 0,
+        "mapped_view::copy_on_write leaves the file unchanged");
+  check(copy[1] == 1 and copy[count] == 0,
+        "mapped_view::copy_on_write copies the pages written alone");
+}
+
+/* Checkpoints count bytes with write protected pages, then appends
+   from a pipe into them, and writes a page in between, which the next
+   checkpoint writes. Returns the time spent, and the bytes written by
+   the second checkpoint in written.
+*/
+double checkpoint_append(eds::memmap<char>& vector, int fd, size_t count,
+                         latency_recorder& latency, size_t& written)
+{
+  static constexpr size_t appended = 5000;
+
+  std::vector<char> bytes(appended, 'b');
+  int pipe_fds[2];
+
+  check(pipe(pipe_fds) == 0, "pipe");
+  vector.reserve(2 * count + appended);
+  vector.resize(count + 100, 'a');
+
+  clock::time_point start = clock::now();
+
+  vector.checkpoint(fd);
+  check(write(pipe_fds[1], bytes.data(), appended) == ssize_t(appended)
+        and vector.append_from_fd(pipe_fds[0], appended)
+              == ssize_t(appended),
+        "memmap::append_from_fd into tracked pages");
+  vector[count / 2] = 'c';
+
+  clock::time_point step = clock::now();
+
+  written = vector.checkpoint(fd);
+  latency.add(step, clock::now());
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  return elapsed_ns(start, clock::now());
+}
+
+double checkpoint_workload(size_t count, latency_recorder& latency)
+{
+  temp_file file;
+  eds::memmap<char> vector;
+  int fd = open(file.path.c_str(), O_RDWR | O_CLOEXEC);
+  size_t written;
+
+  check(fd >= 0, "checkpoint test file");
+
+  double elapsed = checkpoint_append(vector, fd, count, latency, written);
+
+  close(fd);
+  return elapsed;
+}
+
+/* Whether the file fd holds the elements of vector, and nothing else */
+bool holds(int fd, const eds::memmap<char>& vector)
+{
+  std::vector<char> saved(vector.size() + 1);
+
+  return pread(fd, saved.data(), saved.size(), 0) == ssize_t(vector.size())
+         and std::equal(vector.cbegin(), vector.cend(), saved.begin());
+}
+
+/* The second checkpoint of checkpoint_append writes the pages appended
+   to from the pipe, into the tracked page behind the last byte and
+   the pages after it, which read(2) can't fault in with write
+   protection, and the page written in between. A memmap restored from
+   the checkpoint reads its bytes, grows beyond them, and checkpoints
+   to the same file again.
+*/
+void check_checkpoint(enum eds_memmap_dirty_tracking tracking, const char* what)
+{
+  static constexpr size_t count = 1 << 20;
+
+  temp_file file;
+  eds::memmap<char> vector;
+  latency_recorder latency;
+  int fd = open(file.path.c_str(), O_RDWR | O_CLOEXEC);
+  size_t written;
+
+  check(fd >= 0, "checkpoint test file");
+  check(eds_memmap_set_dirty_tracking(tracking) == 0, what);
+  checkpoint_append(vector, fd, count, latency, written);
+  check(written < vector.size() and holds(fd, vector),
+        "memmap::checkpoint writes the pages written to since the last one");
+
+  eds::memmap<char> restored;
+
+  restored.restore(fd);
+  check(restored.size() == vector.size()
+        and std::equal(vector.begin(), vector.end(), restored.begin()),
+        "memmap::restore reads the checkpoint");
+  restored.resize(3 * count, 'd');
+  restored.reserve(4 * count);
+  restored.push_back('e');
+  restored[0] = 'f';
+  restored.checkpoint(fd);
+  check(restored[1] == 'a' and restored[3 * count - 1] == 'd'
+        and holds(fd, restored),
+        "memmap::restore leaves room to grow, and checkpoints again");
+  close(fd);
+}
+
+void check_checkpoints()
+{
+  if (eds_memmap_set_dirty_tracking(EDS_MEMMAP_DIRTY_SOFT) == 0) {
+    check_checkpoint(EDS_MEMMAP_DIRTY_SOFT,
+                     "eds_memmap_set_dirty_tracking(EDS_MEMMAP_DIRTY_SOFT)");
+  }
+  check_checkpoint(EDS_MEMMAP_DIRTY_PROTECT,
+                   "eds_memmap_set_dirty_tracking(EDS_MEMMAP_DIRTY_PROTECT)");
+}
+
+/* Reads up to size bytes from fd, until it has no more for now */
+size_t read_available(int fd, char* bytes, size_t size)
+{
+  size_t read_count = 0;
+  ssize_t result;
+
+  while (read_count < size
+         and (result = read(fd, bytes + read_count, size - read_count)) > 0)
+  {
+    read_count += size_t(result);
+  }
+  return read_count;
+}
+
+/* write_to_fd writes the elements asked for to a file, and as many as
+   a full non-blocking pipe takes, returning how many. splice_to_pipe
+   hands the pipe the pages of the elements, also partially, and the
+   reader of the pipe reads them.
+*/
+void check_fd_io()
+{
+  temp_file file;
+  eds::memmap<char> vector;
+  size_t size = 4 * eds_memmap_get_mmap_treshold();
+  size_t pos = eds_memmap_get_page_size() + 7;
+  size_t count = size - 2 * pos;
+  std::vector<char> bytes(size);
+  int fd = open(file.path.c_str(), O_RDWR | O_CLOEXEC);
+  int pipe_fds[2];
+
+  for (size_t index = 0; index < size; ++index) {
+    vector.push_back(static_cast<char>(index * 7 + index / 251));
+  }
+  check(fd >= 0, "write_to_fd test file");
+  check(vector.write_to_fd(fd, pos, count) == ssize_t(count)
+        and pread(fd, bytes.data(), size, 0) == ssize_t(count)
+        and std::equal(bytes.begin(), bytes.begin() + count,
+                       vector.cbegin() + pos),
+        "memmap::write_to_fd writes the elements to a file");
+  close(fd);
+
+  check(pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0
+        and fcntl(pipe_fds[1], F_SETPIPE_SZ, 4096) >= 0,
+        "pipe");
+
+  ssize_t written = vector.write_to_fd(pipe_fds[1], pos, count);
+
+  check(written > 0 and size_t(written) < count
+        and read_available(pipe_fds[0], bytes.data(), size) == size_t(written)
+        and std::equal(bytes.begin(), bytes.begin() + written,
+                       vector.cbegin() + pos),
+        "memmap::write_to_fd returns the bytes a full pipe took");
+
+  ssize_t spliced = vector.splice_to_pipe(pipe_fds[1], pos, count,
+                                          SPLICE_F_NONBLOCK);
+
+  check(spliced > 0 and size_t(spliced) < count
+        and read_available(pipe_fds[0], bytes.data(), size) == size_t(spliced)
+        and std::equal(bytes.begin(), bytes.begin() + spliced,
+                       vector.cbegin() + pos),
+        "memmap::splice_to_pipe passes the bytes a full pipe took");
+
+  spliced = vector.splice_to_pipe(pipe_fds[1], pos, 100, SPLICE_F_NONBLOCK);
+  check(spliced == 100
+        and read_available(pipe_fds[0], bytes.data(), size) == 100
+        and std::equal(bytes.begin(), bytes.begin() + 100,
+                       vector.cbegin() + pos),
+        "memmap::splice_to_pipe passes the elements to the pipe");
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+/* Exit statuses of the forked reader of shared_workload */
+enum reader_status
+{
+  reader_done,
+  reader_wrong_element,
+  reader_not_remapped,
+  reader_stalled,
+  reader_failed
+};
+
+/* Attaches to the shared memory fd, tells the owner through ready,
+   and reads the elements as they are published, until count of them
+   were. The memory starts empty, the owner grows it as it appends,
+   so refresh has to remap the view at least once. Gives up when no
+   element came for a few seconds, instead of hanging the benchmark.
+*/
+int shared_reader(int fd, int ready, size_t count)
+{
+  try {
+    eds::shared_memmap_view<int> view(fd);
+    size_t read_count = 0;
+    bool remapped = false;
+    clock::time_point progress = clock::now();
+
+    if (write(ready, "", 1) != 1) {
+      return reader_failed;
+    }
+    while (read_count < count) {
+      size_t size;
+
+      remapped = view.refresh() or remapped;
+      size = view.size();
+      if (size > read_count) {
+        progress = clock::now();
+      }
+      else if (clock::now() - progress > std::chrono::seconds(5)) {
+        return remapped ? reader_stalled : reader_not_remapped;
+      }
+      for (; read_count < size; ++read_count) {
+        if (view[read_count] != static_cast<int>(read_count)) {
+          return reader_wrong_element;
+        }
+      }
+      sched_yield();
+    }
+    return remapped ? reader_done : reader_not_remapped;
+  }
+  catch (...) {
+    return reader_failed;
+  }
+}
+
+/* Appends count elements to shared memory, while a forked process
+   reads them, refreshing its view as the memory grows. Returns the
+   time spent, and the exit status of the reader in status.
+*/
+double shared_push_back(size_t count, latency_recorder& latency,
+                        int& status)
+{
+  eds::shared_memmap<int> vector;
+  int ready[2];
+  char byte;
+
+  check(pipe(ready) == 0, "pipe");
+
+  pid_t reader = fork();
+
+  if (reader == 0) {
+    _exit(shared_reader(vector.fd(), ready[1], count));
+  }
+  check(reader > 0 and read(ready[0], &byte, 1) == 1,
+        "shared_memmap_view attaches in the forked reader");
+  close(ready[0]);
+  close(ready[1]);
+
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    if (vector.size() == vector.capacity()) {
+      clock::time_point step = clock::now();
+      vector.push_back(static_cast<int>(n));
+      latency.add(step, clock::now());
+    }
+    else {
+      vector.push_back(static_cast<int>(n));
+    }
+  }
+  waitpid(reader, &status, 0);
+  return elapsed_ns(start, clock::now());
+}
+
+double shared_workload(size_t count, latency_recorder& latency)
+{
+  int status = 0;
+
+  return shared_push_back(count, latency, status);
+}
+
+/* The forked reader reads the elements as they are published, and
+   refresh maps the memory the owner grew.
+*/
+void check_shared_memmap()
+{
+  static constexpr size_t count = 1 << 20;
+
+  latency_recorder latency;
+  int status = 0;
+
+  shared_push_back(count, latency, status);
+  check(WIFEXITED(status) and WEXITSTATUS(status) != reader_wrong_element,
+        "shared_memmap_view reads the elements published");
+  check(WIFEXITED(status) and WEXITSTATUS(status) != reader_not_remapped,
+        "shared_memmap_view::refresh maps the memory the owner grew");
+  check(WIFEXITED(status) and WEXITSTATUS(status) == reader_done,
+        "shared_memmap_view reader");
+}
+
+}
+
+void run_file_benchmarks(const options& opts, std::ostream& out)
+{
+  result config;
+
+  check_persistent_memmap();
+  check_shared_memmap();
+  check_mapped_view();
+  check_checkpoints();
+  check_fd_io();
+
+  config.element = "int";
+  config.element_size = sizeof(int);
+
+  config.container = "persistent_memmap";
+  config.workload = "push_back_reopen";
+  run_workload(opts, out, config, persistent_workload);
+
+  config.container = "memmap";
+  config.element = "char";
+  config.element_size = sizeof(char);
+  config.workload = "checkpoint_append_protect";
+  run_workload(opts, out, config, checkpoint_workload);
+  config.element = "int";
+  config.element_size = sizeof(int);
+
+  config.container = "mapped_view";
+  config.workload = "scan_copy_on_write";
+  run_workload(opts, out, config, view_workload);
+
+  config.container = "shared_memmap";
+  config.workload = "push_back_forked_reader";
+  run_workload(opts, out, config, shared_workload);
+}
+
+}
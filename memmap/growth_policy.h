@@ -0,0 +1,119 @@
+
+#ifndef EDS_GROWTH_POLICY_H
+#define EDS_GROWTH_POLICY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "eds_memmap.h"
+
+namespace eds
+{
+
+/* How much capacity a container takes when it runs out of it,
+   e.g. in push_back, in bytes.
+
+   Below linear_treshold bytes, the capacity grows by factor, above it
+   by linear_step bytes at a time, so the capacity taken but not used
+   stays below linear_step, instead of up to the size of the container.
+   The result is rounded up to a multiple of rounding bytes, e.g. the
+   page size, or the huge page size.
+
+   Growing with mremap doesn't copy the elements, the factor only saves
+   system calls, which matters less as the container grows. The
+   default is the plain doubling of std::vector.
+*/
+struct growth_policy
+{
+    double factor;
+    size_t linear_treshold;
+    size_t linear_step;
+    size_t rounding;
+
+    growth_policy():
+        factor(2),
+        linear_treshold(SIZE_MAX),
+        linear_step(0),
+        rounding(0)
+    {
+    }
+
+    /* Growing by factor, e.g. 1.5 */
+    static growth_policy geometric(double factor)
+    {
+        growth_policy policy;
+
+        policy.factor = factor;
+        return policy;
+    }
+
+    /* Only growing by the pages needed, for containers which grow
+       without copying, by remapping, or in reserved address space.
+    */
+    static growth_policy next_page()
+    {
+        growth_policy policy;
+
+        policy.factor = 1;
+        policy.rounding = eds_memmap_get_page_size();
+        return policy;
+    }
+
+    /* The policy, growing by step bytes from treshold bytes on */
+    growth_policy linear_above(size_t treshold, size_t step) const
+    {
+        growth_policy policy = *this;
+
+        policy.linear_treshold = treshold;
+        policy.linear_step = step;
+        return policy;
+    }
+
+    /* The policy, rounding to a multiple of bytes, a power of two */
+    growth_policy rounded_to(size_t bytes) const
+    {
+        growth_policy policy = *this;
+
+        policy.rounding = bytes;
+        return policy;
+    }
+
+    /* The new capacity of a container holding size bytes, which
+       needs at least required bytes. offset bytes of the storage lie
+       beyond the end it grows at, and are rounded along with it.
+       It saturates at SIZE_MAX, for the container to cap.
+    */
+    size_t grow(size_t size, size_t required, size_t offset = 0) const noexcept
+    {
+        size_t target;
+
+        if (size >= linear_treshold) {
+            target = size > SIZE_MAX - linear_step ? SIZE_MAX
+                                                   : size + linear_step;
+        }
+        else if (factor <= 1) {
+            target = size;
+        }
+        else if (double(size) * factor >= double(SIZE_MAX)) {
+            target = SIZE_MAX;
+        }
+        else {
+            target = size_t(double(size) * factor);
+            if (target > linear_treshold) {
+                target = linear_treshold;
+            }
+        }
+        if (target < required) {
+            target = required;
+        }
+        if (rounding > 1 and target <= SIZE_MAX - offset - (rounding - 1)) {
+            target = ((offset + target + (rounding - 1)) & ~(rounding - 1))
+                     - offset;
+        }
+        return target;
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_GROWTH_POLICY_H */
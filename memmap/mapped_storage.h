@@ -2,16 +2,57 @@
 #ifndef EDS_MEMMAP_STORAGE_H
 #define EDS_MEMMAP_STORAGE_H
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
 #include <new>
 #include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include "eds_memmap.h"
+#include "growth_policy.h"
 
 namespace eds
 {
 
+/* Counts the changes of a storage, and the ones among them which moved
+   its bytes to a new address. EDS_MEMMAP_NO_STATS removes them,
+   along with the rest of the statistics.
+*/
+#ifndef EDS_MEMMAP_NO_STATS
+struct storage_counters
+{
+    size_t remaps;
+    size_t moves;
+
+    storage_counters():
+        remaps(0),
+        moves(0)
+    {}
+
+    void count(bool moved) noexcept
+    {
+        ++remaps;
+        if (moved) {
+            ++moves;
+        }
+    }
+};
+#else
+struct storage_counters
+{
+    static constexpr size_t remaps = 0;
+    static constexpr size_t moves = 0;
+
+    void count(bool) noexcept {}
+};
+#endif
+
 template<typename char_type>
 class mapped_storage
 {
@@ -19,12 +60,110 @@ private:
     char_type* head;
     size_t length;
 
-    void move_from(mapped_storage&& other)
+    /* Set when the storage lives in a reserved range of address space,
+       see reserve_address_space.
+    */
+    char_type* reservation_begin;
+    char_type* reservation_end;
+
+    /* Set when the reserved range is backed by a memfd, see
+       reserve_copy_on_write. Copying the storage switches the file
+       from shared to private mappings, which doesn't change the bytes.
+    */
+    mutable eds_memmap_file file;
+
+    /* eds_memmap_populate_flags applied to the pages, see populate */
+    unsigned populating;
+
+    /* With retention on, see retain, shrinking keeps the pages mapped:
+       the region is retained_low bytes in front of head, and
+       retained_high bytes behind the end, and growing takes those
+       back first.
+    */
+    eds_memmap_retain retaining;
+    size_t max_retained;
+    size_t retained_low;
+    size_t retained_high;
+
+    /* The NUMA policy of the pages, see numa_policy */
+    eds_memmap_numa_policy placement;
+    int placement_node;
+
+    /* How the owner grows the storage, kept here to move along with
+       the other settings
+    */
+    growth_policy growing;
+
+    /* The pages written since the last checkpoint, see checkpoint */
+    eds_memmap_dirty* tracking;
+
+    storage_counters counters;
+
+    static eds_memmap_file no_file() noexcept
+    {
+        eds_memmap_file none = {nullptr, -1, 0, 0};
+
+        return none;
+    }
+
+    void move_from(mapped_storage& other)
     {
         head = other.head;
         length = other.length;
+        reservation_begin = other.reservation_begin;
+        reservation_end = other.reservation_end;
+        file = other.file;
+        populating = other.populating;
+        retaining = other.retaining;
+        max_retained = other.max_retained;
+        retained_low = other.retained_low;
+        retained_high = other.retained_high;
+        placement = other.placement;
+        placement_node = other.placement_node;
+        growing = other.growing;
+        tracking = other.tracking;
+        counters = other.counters;
         other.head = nullptr;
         other.length = 0;
+        other.reservation_begin = nullptr;
+        other.reservation_end = nullptr;
+        other.file = no_file();
+        other.populating = 0;
+        other.retaining = EDS_MEMMAP_RETAIN_OFF;
+        other.max_retained = 0;
+        other.retained_low = 0;
+        other.retained_high = 0;
+        other.placement = EDS_MEMMAP_NUMA_DEFAULT;
+        other.placement_node = 0;
+        other.growing = growth_policy();
+        other.tracking = nullptr;
+        other.counters = storage_counters();
+    }
+
+    void release()
+    {
+        if (has_file()) {
+            eds_memmap_file_release(&file,
+                                    reservation_end - reservation_begin);
+        }
+        else if (has_reservation()) {
+            eds_memmap_release(reservation_begin,
+                               reservation_end - reservation_begin);
+        }
+        else if (head != nullptr) {
+            eds_memmap_destroy(region(), region_size());
+        }
+    }
+
+    /* The mapped region, retained bytes included */
+    char_type* region() const noexcept
+    {
+        return head - retained_low;
+    }
+
+    size_t region_size() const noexcept
+    {
+        return retained_low + length + retained_high;
     }
 
 public:
@@ -43,32 +182,52 @@ public:
 
     mapped_storage():
         head(nullptr),
-        length(0)
+        length(0),
+        reservation_begin(nullptr),
+        reservation_end(nullptr),
+        file(no_file()),
+        populating(0),
+        retaining(EDS_MEMMAP_RETAIN_OFF),
+        max_retained(0),
+        retained_low(0),
+        retained_high(0),
+        placement(EDS_MEMMAP_NUMA_DEFAULT),
+        placement_node(0),
+        tracking(nullptr)
     {}
 
     ~mapped_storage()
     {
-        if (head != nullptr) {
-            eds_memmap_destroy(head, length);
-        }
+        eds_memmap_dirty_destroy(tracking);
+        release();
     }
 
     explicit mapped_storage(size_type count):
         head(eds_memmap_create(count)),
-        length(count)
+        length(count),
+        reservation_begin(nullptr),
+        reservation_end(nullptr),
+        file(no_file()),
+        populating(0),
+        retaining(EDS_MEMMAP_RETAIN_OFF),
+        max_retained(0),
+        retained_low(0),
+        retained_high(0),
+        placement(EDS_MEMMAP_NUMA_DEFAULT),
+        placement_node(0),
+        tracking(nullptr)
     {
     }
 
     mapped_storage& operator=(mapped_storage&& other)
     {
-        if (head != nullptr) {
-            eds_memmap_destroy(head, length);
-        }
+        eds_memmap_dirty_destroy(tracking);
+        release();
         move_from(other);
         return *this;
     }
 
-    explicit mapped_storage(mapped_storage&& other)
+    mapped_storage(mapped_storage&& other)
     {
         move_from(other);
     }
@@ -123,43 +282,500 @@ public:
 
 private:
 
-    void eds_size_delta_wrapper(char* (*eds_fun)(char*, size_t, size_t),
-                                size_t count)
+    /* Resizes the whole region, shift is the change of its start,
+       when no bytes are moved. Returns whether they moved.
+    */
+    bool eds_size_delta_wrapper(char* (*eds_fun)(char*, size_t, size_t),
+                                size_t count, difference_type shift)
+    {
+        char* new_region;
+        bool moved;
+
+        new_region = eds_fun(region(), region_size(), count);
+        if (new_region == nullptr) {
+            throw std::bad_alloc();
+        }
+        moved = new_region != region() + shift;
+        counters.count(moved);
+        head = static_cast<char_type*>(new_region) + retained_low;
+        return moved;
+    }
+
+    /* Small storage shares its pages with other malloc'd memory,
+       and is never populated or locked.
+    */
+    bool owns_pages() const noexcept
+    {
+        return has_reservation()
+               or region_size() >= eds_memmap_get_mmap_treshold();
+    }
+
+    /* Reserved storage keeps its range anyway */
+    bool retains() const noexcept
+    {
+        return retaining != EDS_MEMMAP_RETAIN_OFF
+               and not has_reservation()
+               and owns_pages();
+    }
+
+    /* The count bytes at the end leave the storage, and stay mapped */
+    void retain_high(size_type count) noexcept
+    {
+        length -= count;
+        retained_high += count;
+        eds_memmap_discard(head + length, retained_high, retaining);
+        trim_retained(max_retained);
+    }
+
+    void retain_low(size_type count) noexcept
+    {
+        head += count;
+        length -= count;
+        retained_low += count;
+        eds_memmap_discard(region(), retained_low, retaining);
+        trim_retained(max_retained);
+    }
+
+    /* Unmaps the retained bytes beyond max_bytes, the ones behind the
+       end first. The bytes of the storage stay where they are: unless
+       it is empty, the region keeps at least mmap treshold bytes,
+       instead of moving to malloc'd memory.
+       Returns false, keeping them, when unmapping fails.
+    */
+    bool trim_retained(size_type max_bytes) noexcept
+    {
+        size_t treshold = eds_memmap_get_mmap_treshold();
+        size_t excess;
+        size_t drop_high;
+        size_t drop_low;
+        char* new_region;
+
+        if (retained_low + retained_high <= max_bytes) {
+            return true;
+        }
+        excess = retained_low + retained_high - max_bytes;
+        if (length != 0 and region_size() - excess < treshold) {
+            excess = region_size() - std::max(treshold, length);
+            if (excess == 0) {
+                return true;
+            }
+        }
+        drop_high = std::min(excess, retained_high);
+        drop_low = excess - drop_high;
+        if (excess == region_size()) {
+            eds_memmap_destroy(region(), region_size());
+            head = nullptr;
+            retained_low = 0;
+            retained_high = 0;
+            return true;
+        }
+        new_region = eds_memmap_shrink(region(), region_size(),
+                                       drop_high, drop_low);
+        if (new_region == nullptr) {
+            return false;
+        }
+        counters.count(new_region != region() + drop_low);
+        retained_low -= drop_low;
+        retained_high -= drop_high;
+        head = static_cast<char_type*>(new_region) + retained_low;
+        return true;
+    }
+
+    /* Before handing the region to merge or split, which may move it */
+    void drop_retained()
     {
         char* new_head;
 
-        new_head = eds_fun(head, length, count);
+        if (retained_low + retained_high == 0) {
+            return;
+        }
+        if (length == 0) {
+            eds_memmap_destroy(region(), region_size());
+            new_head = nullptr;
+        }
+        else {
+            new_head = eds_memmap_shrink(region(), region_size(),
+                                         retained_high, retained_low);
+            if (new_head == nullptr) {
+                throw std::bad_alloc();
+            }
+            counters.count(new_head != head);
+        }
+        head = static_cast<char_type*>(new_head);
+        retained_low = 0;
+        retained_high = 0;
+    }
+
+    /* The retained bytes become part of the storage again */
+    void take_retained() noexcept
+    {
+        head -= retained_low;
+        length += retained_low + retained_high;
+        retained_low = 0;
+        retained_high = 0;
+    }
+
+    /* A private file mapping is only populated for reading,
+       writing would copy every page.
+    */
+    void populate_bytes(char_type* begin, size_type count, unsigned flags)
+    {
+        if (flags == 0 or count == 0 or not owns_pages()) {
+            return;
+        }
+        if (has_file() and not file.shared
+                and (flags & EDS_MEMMAP_POPULATE_WRITE))
+        {
+            flags = (flags & ~unsigned(EDS_MEMMAP_POPULATE_WRITE))
+                    | EDS_MEMMAP_POPULATE_READ;
+        }
+        if (eds_memmap_populate(begin, count, flags) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /* Binds the pages of the storage, and the whole reserved range,
+       to the policy. Small storage is left where malloc put it.
+    */
+    void place_pages()
+    {
+        int result;
+
+        if (placement == EDS_MEMMAP_NUMA_DEFAULT or not owns_pages()) {
+            return;
+        }
+        if (has_reservation()) {
+            result = eds_memmap_numa_bind(reservation_begin,
+                                          reservation_end - reservation_begin,
+                                          placement, placement_node);
+        }
+        else {
+            result = eds_memmap_numa_bind(region(), region_size(),
+                                          placement, placement_node);
+        }
+        if (result != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /* Takes over the policy and populating of the storage the contents
+       moved into.
+    */
+    void settle_pages()
+    {
+        place_pages();
+        populate_bytes(head, length, populating);
+    }
+
+    /* After the count bytes from begin were added, or the bytes moved,
+       along with pages from malloc'd memory maybe. A mapping growing
+       in place, or moving with mremap, keeps its policy, one coming
+       from malloc'd memory, or the cache of released mappings, is
+       bound again.
+    */
+    void grown(bool moved, char_type* begin, size_type count)
+    {
+        if (moved) {
+            settle_pages();
+        }
+        else {
+            populate_bytes(begin, count, populating);
+        }
+    }
+
+    /* Moves the window of a file backed storage */
+    void move_file_window(char_type* new_head, size_type new_length)
+    {
+        if (eds_memmap_file_move_window(&file, head, length,
+                                        new_head, new_length) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        counters.count(false);
+        head = new_head;
+        length = new_length;
+    }
+
+public:
+
+    bool has_reservation() const noexcept
+    {
+        return reservation_begin != nullptr;
+    }
+
+    bool has_file() const noexcept
+    {
+        return file.base != nullptr;
+    }
+
+    /* The number of bytes the storage can grow by at either end,
+       without leaving the reserved range.
+    */
+    size_type headroom_high() const noexcept
+    {
+        return reservation_end - cend();
+    }
+
+    size_type headroom_low() const noexcept
+    {
+        return cbegin() - reservation_begin;
+    }
+
+    /* Moves the contents into a newly reserved range of address space,
+       with room for count_low bytes below, and count_high bytes
+       from the start of the storage.
+       Growing or shrinking the storage afterwards only changes
+       page protections, so the bytes never move again,
+       expanding beyond the reserved range throws std::bad_alloc.
+    */
+    void reserve_address_space(size_type count_high, size_type count_low)
+    {
+        char* base;
+        char* new_head;
+
+        if (count_high < length or count_low + count_high < count_low) {
+            throw std::bad_alloc();
+        }
+        base = eds_memmap_reserve(count_low + count_high);
+        if (base == nullptr) {
+            throw std::bad_alloc();
+        }
+        new_head = eds_memmap_commit_high(base + count_low, 0, length);
         if (new_head == nullptr) {
+            eds_memmap_release(base, count_low + count_high);
             throw std::bad_alloc();
         }
-        head = static_cast<char_type*>(new_head);
+        if (length != 0) {
+            std::memcpy(new_head, head, length);
+        }
+        release();
+        file = no_file();
+        counters.count(true);
+        head = new_head;
+        reservation_begin = base;
+        reservation_end = base + count_low + count_high;
+        retained_low = 0;
+        retained_high = 0;
+        settle_pages();
+    }
+
+    /* Like reserve_address_space, with the contents in a memfd,
+       so that copies take constant time, see copy_on_write.
+    */
+    void reserve_copy_on_write(size_type count_high, size_type count_low)
+    {
+        eds_memmap_file new_file;
+        char* new_head;
+
+        if (count_high < length or count_low + count_high < count_low) {
+            throw std::bad_alloc();
+        }
+        if (eds_memmap_file_create(&new_file, count_low + count_high) != 0) {
+            throw std::bad_alloc();
+        }
+        new_head = new_file.base + count_low;
+        if (eds_memmap_file_move_window(&new_file, new_head, 0,
+                                        new_head, length) != 0)
+        {
+            eds_memmap_file_release(&new_file, count_low + count_high);
+            throw std::bad_alloc();
+        }
+        if (length != 0) {
+            std::memcpy(new_head, head, length);
+        }
+        release();
+        file = new_file;
+        counters.count(true);
+        head = new_head;
+        reservation_begin = new_file.base;
+        reservation_end = new_file.base + count_low + count_high;
+        retained_low = 0;
+        retained_high = 0;
+        settle_pages();
+    }
+
+    /* Replaces the contents with the first count bytes of the file fd,
+       mapped privately, in a reserved range of count_high bytes, like
+       reserve_copy_on_write. The pages are read from the file as they
+       are accessed, and copied when first written to, the file never
+       changes.
+    */
+    void map_copy_on_write(int fd, size_type count, size_type count_high)
+    {
+        eds_memmap_file new_file;
+
+        if (count_high < count) {
+            throw std::bad_alloc();
+        }
+        if (eds_memmap_file_open_private(&new_file, fd, count, count_high)
+                != 0)
+        {
+            throw std::bad_alloc();
+        }
+        if (eds_memmap_file_move_window(&new_file, new_file.base, 0,
+                                        new_file.base, count) != 0)
+        {
+            eds_memmap_file_release(&new_file, count_high);
+            throw std::bad_alloc();
+        }
+        release();
+        file = new_file;
+        counters.count(true);
+        head = new_file.base;
+        length = count;
+        reservation_begin = new_file.base;
+        reservation_end = new_file.base + count_high;
+        retained_low = 0;
+        retained_high = 0;
+        settle_pages();
+    }
+
+    /* A copy sharing the pages of a file backed storage, until either
+       of them writes to a page. It is file backed too, with the same
+       reservation around it, and a file descriptor of its own.
+    */
+    mapped_storage copy_on_write() const
+    {
+        mapped_storage copy;
+
+        assert(has_file());
+
+        if (eds_memmap_file_copy(&file, reservation_end - reservation_begin,
+                                 head, length, &copy.file) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        copy.reservation_begin = copy.file.base;
+        copy.reservation_end = copy.file.base
+                               + (reservation_end - reservation_begin);
+        copy.head = copy.file.base + (head - reservation_begin);
+        copy.length = length;
+        return copy;
+    }
+
+private:
+
+    void expand_high(size_type count,
+                     char* (*commit_fun)(char*, size_t, size_t),
+                     char* (*expand_fun)(char*, size_t, size_t))
+    {
+        bool moved = false;
+
+        if (has_reservation() and count > headroom_high()) {
+            throw std::bad_alloc();
+        }
+        else if (has_file()) {
+            move_file_window(head, length + count);
+        }
+        else if (has_reservation()) {
+            moved = eds_size_delta_wrapper(commit_fun, count, 0);
+            length += count;
+        }
+        else {
+            size_type taken = std::min(count, retained_high);
+
+            retained_high -= taken;
+            length += taken;
+            if (count > taken) {
+                moved = eds_size_delta_wrapper(expand_fun, count - taken, 0);
+                length += count - taken;
+            }
+        }
+        grown(moved, head + length - count, count);
     }
 
 public:
 
     void expand_high(size_type count)
     {
-        eds_size_delta_wrapper(eds_memmap_expand_high, count);
-        length += count;
+        expand_high(count, eds_memmap_commit_high, eds_memmap_expand_high);
+    }
+
+    /* The count new bytes read as zero */
+    void expand_high_zeroed(size_type count)
+    {
+        size_type stale = std::min(count, retained_high);
+
+        expand_high(count, eds_memmap_commit_high_zeroed,
+                    eds_memmap_expand_high_zeroed);
+        if (has_file()) {
+            std::memset(head + length - count, 0, count);
+        }
+        else if (stale != 0) {
+            std::memset(head + length - count, 0, stale);
+        }
     }
 
     void expand_low(size_type count)
     {
-        eds_size_delta_wrapper(eds_memmap_expand_low, count);
-        length += count;
+        bool moved = false;
+
+        if (has_reservation() and count > headroom_low()) {
+            throw std::bad_alloc();
+        }
+        else if (has_file()) {
+            move_file_window(head - count, length + count);
+        }
+        else if (has_reservation()) {
+            moved = eds_size_delta_wrapper(eds_memmap_commit_low, count,
+                                           -difference_type(count));
+            length += count;
+        }
+        else {
+            size_type taken = std::min(count, retained_low);
+
+            head -= taken;
+            retained_low -= taken;
+            length += taken;
+            if (count > taken) {
+                moved = eds_size_delta_wrapper(eds_memmap_expand_low,
+                                               count - taken,
+                                               -difference_type(count - taken));
+                length += count - taken;
+            }
+        }
+        grown(moved, head, count);
     }
 
+    /* A reserved storage keeps its reservation and position,
+       so does a retaining one, up to its limit
+    */
     void clear() noexcept
     {
-        eds_memmap_destroy(head, length);
-        head = nullptr;
+        if (retains()) {
+            retain_high(length);
+            return;
+        }
+        else if (has_file()) {
+            /* Shrinking the window never fails */
+            (void)eds_memmap_file_move_window(&file, head, length, head, 0);
+        }
+        else if (has_reservation()) {
+            eds_memmap_decommit_high(head, length, length);
+        }
+        else {
+            eds_memmap_destroy(region(), region_size());
+            head = nullptr;
+            retained_low = 0;
+            retained_high = 0;
+        }
         length = 0;
     }
 
     void shrink_high(size_type count)
     {
-        if (length > count) {
-            eds_size_delta_wrapper(eds_memmap_shrink_high, count);
+        if (length > count and retains()) {
+            retain_high(count);
+        }
+        else if (length > count and has_file()) {
+            move_file_window(head, length - count);
+        }
+        else if (length > count and has_reservation()) {
+            eds_size_delta_wrapper(eds_memmap_decommit_high, count, 0);
+            length -= count;
+        }
+        else if (length > count) {
+            eds_size_delta_wrapper(eds_memmap_shrink_high, count, 0);
             length -= count;
         }
         else if (length < count) {
@@ -172,8 +788,18 @@ public:
 
     void shrink_low(size_type count)
     {
-        if (length > count) {
-            eds_size_delta_wrapper(eds_memmap_shrink_low, count);
+        if (length > count and retains()) {
+            retain_low(count);
+        }
+        else if (length > count and has_file()) {
+            move_file_window(head + count, length - count);
+        }
+        else if (length > count and has_reservation()) {
+            eds_size_delta_wrapper(eds_memmap_decommit_low, count, count);
+            length -= count;
+        }
+        else if (length > count) {
+            eds_size_delta_wrapper(eds_memmap_shrink_low, count, count);
             length -= count;
         }
         else if (length < count) {
@@ -192,7 +818,7 @@ public:
         else if (head == nullptr
                 or length < delta_high
                 or length < delta_low
-                or delta_high < delta_high + delta_low
+                or delta_high + delta_low < delta_high
                 or length < delta_high + delta_low)
         {
             throw std::bad_alloc();
@@ -200,13 +826,346 @@ public:
         else if (length == delta_high + delta_low) {
             clear();
         }
+        else if (has_reservation() or retains()) {
+            shrink_high(delta_high);
+            shrink_low(delta_low);
+        }
         else {
-            head = eds_memmap_shrink(head, length, delta_high, delta_low);
+            char* new_head;
+
+            new_head = eds_memmap_shrink(head, length, delta_high, delta_low);
+            if (new_head == nullptr) {
+                throw std::bad_alloc();
+            }
+            counters.count(new_head != head + delta_low);
+            head = new_head;
             length -= delta_high + delta_low;
         }
     }
 
 
+    /* Reserved storage is never moved, so the bytes of other
+       are copied into it, instead of moving their pages.
+    */
+    void merge(mapped_storage&& other)
+    {
+        char* new_head;
+
+        if (has_reservation() or other.has_reservation()) {
+            size_type old_length = length;
+
+            expand_high(other.length);
+            if (other.length != 0) {
+                std::memcpy(head + old_length, other.head, other.length);
+            }
+            other = mapped_storage();
+            return;
+        }
+        drop_retained();
+        other.drop_retained();
+        new_head = eds_memmap_merge(head, length, other.head, other.length);
+        if (new_head == nullptr and (head != nullptr or other.head != nullptr)) {
+            throw std::bad_alloc();
+        }
+        counters.count(head != nullptr and new_head != head);
+        head = new_head;
+        length += other.length;
+        other.head = nullptr;
+        other.length = 0;
+        settle_pages();
+    }
+
+    /* The tail split off a reserved storage is a copy,
+       without a reservation.
+    */
+    mapped_storage split(size_type cut)
+    {
+        mapped_storage tail;
+        char* new_head;
+
+        if (has_reservation()) {
+            if (cut == 0 or cut >= length) {
+                throw std::bad_alloc();
+            }
+            tail = mapped_storage(length - cut);
+            if (tail.head == nullptr) {
+                throw std::bad_alloc();
+            }
+            std::memcpy(tail.head, head + cut, length - cut);
+            shrink_high(length - cut);
+            return tail;
+        }
+        drop_retained();
+        new_head = eds_memmap_split(head, length, cut, &tail.head);
+        if (new_head == nullptr) {
+            throw std::bad_alloc();
+        }
+        counters.count(new_head != head);
+        tail.length = length - cut;
+        head = new_head;
+        length = cut;
+        return tail;
+    }
+
+    /* Moves count bytes from offset from to offset to, like memmove,
+       whole pages move with mremap, when the distance allows it.
+       The pages of a file stay where they are, and are copied.
+    */
+    void move_bytes(size_type to, size_type from, size_type count)
+    {
+        if (has_file()) {
+            std::memmove(head + to, head + from, count);
+        }
+        else if (count != 0) {
+            eds_memmap_move(region(), region_size(),
+                            retained_low + to, retained_low + from, count);
+        }
+    }
+
+    /* Takes over the storage other, which the caller moved the contents
+       into, e.g. objects which can't be moved by copying their bytes.
+       The counters carry over, and count it as a remap which moved.
+    */
+    void replace(mapped_storage&& other)
+    {
+        storage_counters old_counters = counters;
+
+        unsigned flags = populating;
+        eds_memmap_retain how = retaining;
+        size_type max_bytes = max_retained;
+        eds_memmap_numa_policy policy = placement;
+        int node = placement_node;
+        growth_policy growth_settings = growing;
+        eds_memmap_dirty* dirty_pages = tracking;
+
+        assert(other.tracking == nullptr);
+
+        release();
+        move_from(other);
+        counters = old_counters;
+        counters.count(true);
+        populating = flags;
+        retaining = how;
+        max_retained = max_bytes;
+        placement = policy;
+        placement_node = node;
+        growing = growth_settings;
+        tracking = dirty_pages;
+        settle_pages();
+    }
+
+    /* Populates, and optionally locks the pages of the storage,
+       and of the storage it grows into from now on, with
+       eds_memmap_populate_flags. The flags move along with the storage.
+       Dropping EDS_MEMMAP_LOCK_ON_FAULT unlocks the pages.
+    */
+    void populate(unsigned flags)
+    {
+        if ((populating & EDS_MEMMAP_LOCK_ON_FAULT)
+                and not (flags & EDS_MEMMAP_LOCK_ON_FAULT)
+                and owns_pages())
+        {
+            eds_memmap_unlock(head, length);
+        }
+        populating = flags;
+        populate_bytes(head, length, populating);
+    }
+
+    unsigned populate_flags() const noexcept
+    {
+        return populating;
+    }
+
+    /* Binds the pages of the storage to a NUMA policy, see
+       eds_memmap_numa_policy, moving the pages allocated already, and
+       keeps it as the storage grows and moves. The policy moves along
+       with the storage, like populate. Throws std::bad_alloc for a
+       node the host doesn't have.
+    */
+    void numa_policy(eds_memmap_numa_policy policy, int node)
+    {
+        eds_memmap_numa_policy old_policy = placement;
+
+        if ((policy == EDS_MEMMAP_NUMA_BIND
+                or policy == EDS_MEMMAP_NUMA_PREFERRED)
+            and (node < 0 or node >= eds_memmap_numa_nodes()))
+        {
+            throw std::bad_alloc();
+        }
+        placement = policy;
+        placement_node = node;
+        if (policy == EDS_MEMMAP_NUMA_DEFAULT
+                and old_policy != EDS_MEMMAP_NUMA_DEFAULT
+                and owns_pages())
+        {
+            /* Dropping the policy of the pages, which stay where
+               they are.
+            */
+            (void)eds_memmap_numa_bind(region(), region_size(),
+                                       EDS_MEMMAP_NUMA_DEFAULT, 0);
+        }
+        place_pages();
+    }
+
+    eds_memmap_numa_policy numa_policy() const noexcept
+    {
+        return placement;
+    }
+
+    int numa_node() const noexcept
+    {
+        return placement_node;
+    }
+
+    void growth(const growth_policy& policy) noexcept
+    {
+        growing = policy;
+    }
+
+    const growth_policy& growth() const noexcept
+    {
+        return growing;
+    }
+
+    /* Applies the populate flags, NUMA policy and growth policy of
+       other, to a storage about to take its place, and takes over the
+       pages tracked for checkpoints
+    */
+    void take_settings(mapped_storage& other)
+    {
+        populate(other.populating);
+        numa_policy(other.placement, other.placement_node);
+        growing = other.growing;
+        std::swap(tracking, other.tracking);
+    }
+
+    /* The number of pages of the storage allocated on each node */
+    std::vector<size_type> numa_pages() const
+    {
+        std::vector<size_type> pages(eds_memmap_numa_nodes());
+
+        if (eds_memmap_numa_pages(head, length, pages.data(),
+                                  int(pages.size())) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        return pages;
+    }
+
+    /* Shrinking keeps up to max_bytes of the bytes leaving the storage
+       mapped, and gives their pages back with how, see
+       eds_memmap_discard. Growing takes them back without a system call.
+       The settings move along with the storage, like populate.
+       With EDS_MEMMAP_RETAIN_OFF the retained bytes become part of
+       the storage again, the next shrink unmaps them.
+    */
+    void retain(eds_memmap_retain how, size_type max_bytes)
+    {
+        retaining = how;
+        max_retained = how == EDS_MEMMAP_RETAIN_OFF ? 0 : max_bytes;
+        if (how == EDS_MEMMAP_RETAIN_OFF) {
+            take_retained();
+        }
+        else {
+            (void)trim_retained(max_retained);
+        }
+    }
+
+    /* Bytes kept mapped in front of, and behind the storage */
+    size_type retained() const noexcept
+    {
+        return retained_low + retained_high;
+    }
+
+private:
+
+    void track_pages()
+    {
+        if (tracking == nullptr) {
+            tracking = eds_memmap_dirty_create();
+            if (tracking == nullptr) {
+                throw std::system_error(errno, std::generic_category(),
+                                        "eds_memmap_dirty_create");
+            }
+        }
+    }
+
+    /* Whether the storage maps the pages of the file fd privately,
+       see map_copy_on_write
+    */
+    bool maps_file(int fd) const
+    {
+        struct stat own_status;
+        struct stat status;
+
+        return has_file()
+               and fstat(file.fd, &own_status) == 0
+               and fstat(fd, &status) == 0
+               and own_status.st_dev == status.st_dev
+               and own_status.st_ino == status.st_ino;
+    }
+
+public:
+
+    /* Writes the count bytes from offset to the file fd, which ends up
+       holding them, but only the pages written since the previous
+       checkpoint, see eds_memmap_checkpoint. Tracking the pages starts
+       with the first checkpoint, which writes all of them, and moves
+       along with the storage, like populate.
+       A storage mapping fd itself (map_copy_on_write) keeps the pages
+       of the file which are left, at the same offsets: when the bytes
+       moved away from them, the storage moves to anonymous memory
+       first. Returns the number of bytes written, throws
+       std::system_error.
+    */
+    size_type checkpoint(int fd, size_type offset, size_type count,
+                         bool wait)
+    {
+        bool own_file = maps_file(fd);
+        ssize_t written;
+
+        track_pages();
+        if (own_file and head + offset != file.base) {
+            mapped_storage anonymous(length);
+
+            if (anonymous.head == nullptr) {
+                throw std::bad_alloc();
+            }
+            std::memcpy(anonymous.head, head, length);
+            replace(std::move(anonymous));
+            own_file = false;
+        }
+        else if (own_file and length != offset + count) {
+            /* The capacity would be cut off along with the file */
+            shrink_high(length - (offset + count));
+        }
+        written = eds_memmap_checkpoint(tracking, fd, head + offset, count,
+                                        wait);
+        if (written < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "eds_memmap_checkpoint");
+        }
+        if (own_file) {
+            size_type page_mask = eds_memmap_get_page_size() - 1;
+
+            file.file_size = std::min(file.file_size,
+                                      (count + page_mask) & ~page_mask);
+        }
+        return size_type(written);
+    }
+
+    /* The count bytes from offset match a checkpoint, see
+       eds_memmap_dirty_reset
+    */
+    void checkpointed(size_type offset, size_type count)
+    {
+        track_pages();
+        if (eds_memmap_dirty_reset(tracking, head + offset, count) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "eds_memmap_dirty_reset");
+        }
+    }
+
     bool empty() const noexcept
     {
         return length == 0;
@@ -226,6 +1185,29 @@ public:
     {
         std::swap(head, other.head);
         std::swap(length, other.length);
+        std::swap(reservation_begin, other.reservation_begin);
+        std::swap(reservation_end, other.reservation_end);
+        std::swap(file, other.file);
+        std::swap(populating, other.populating);
+        std::swap(retaining, other.retaining);
+        std::swap(max_retained, other.max_retained);
+        std::swap(retained_low, other.retained_low);
+        std::swap(retained_high, other.retained_high);
+        std::swap(placement, other.placement);
+        std::swap(placement_node, other.placement_node);
+        std::swap(growing, other.growing);
+        std::swap(tracking, other.tracking);
+        std::swap(counters, other.counters);
+    }
+
+    size_type remap_count() const noexcept
+    {
+        return counters.remaps;
+    }
+
+    size_type move_count() const noexcept
+    {
+        return counters.moves;
     }
 
     reference at(size_type pos)
@@ -0,0 +1,265 @@
+
+#ifndef EDS_MAPPED_VIEW_H
+#define EDS_MAPPED_VIEW_H
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+
+#include "eds_memmap.h"
+#include "memmap.h"
+
+namespace eds
+{
+
+/* The elements stored in a file, read in place, instead of copied
+   into a vector, see eds_memmap_view. The file is mapped read only,
+   and its pages come from the page cache as they are accessed, which
+   the kernel manages: reading ahead, and dropping pages under memory
+   pressure, access tells it how the elements are going to be read.
+   A trailing partial element of the file is not part of the view.
+
+   copy_on_write turns the view into a writable memmap, whose pages
+   are only copied once written to.
+*/
+template<typename type>
+class mapped_view
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "mapped_view elements are read as bytes");
+
+private:
+
+    eds_memmap_view view;
+
+    /* read_ahead advises the window_bytes from next_window on,
+       once the cursor is in the half window in front of it
+    */
+    size_t window_bytes;
+    size_t next_window;
+
+    static eds_memmap_view no_view() noexcept
+    {
+        eds_memmap_view none = {nullptr, 0, -1};
+
+        return none;
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef const type& reference;
+    typedef const type& const_reference;
+    typedef const type* pointer;
+    typedef const type* const_pointer;
+    typedef const type* iterator;
+    typedef const type* const_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef const_reverse_iterator reverse_iterator;
+
+    mapped_view():
+        view(no_view()),
+        window_bytes(0x400000),
+        next_window(0)
+    {
+    }
+
+    /* Maps the file at path, throws std::system_error on failure */
+    explicit mapped_view(const char* path):
+        view(no_view()),
+        window_bytes(0x400000),
+        next_window(0)
+    {
+        if (eds_memmap_view_open(&view, path) != 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+
+    mapped_view(mapped_view&& other) noexcept:
+        view(other.view),
+        window_bytes(other.window_bytes),
+        next_window(other.next_window)
+    {
+        other.view = no_view();
+    }
+
+    mapped_view& operator=(mapped_view&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    mapped_view(const mapped_view&) = delete;
+    mapped_view& operator=(const mapped_view&) = delete;
+
+    ~mapped_view()
+    {
+        eds_memmap_view_close(&view);
+    }
+
+    void swap(mapped_view& other) noexcept
+    {
+        std::swap(view, other.view);
+        std::swap(window_bytes, other.window_bytes);
+        std::swap(next_window, other.next_window);
+    }
+
+    /* Advises the kernel on how the whole file is going to be read,
+       e.g. EDS_MEMMAP_ACCESS_SEQUENTIAL for a single scan, or
+       EDS_MEMMAP_ACCESS_RANDOM for lookups, which would waste the
+       pages read ahead. The advice stays with the mapping.
+    */
+    void access(eds_memmap_access how)
+    {
+        (void)eds_memmap_advise(view.base, view.size, how);
+    }
+
+    /* The same, for the count elements from position pos */
+    void access(eds_memmap_access how, size_type pos, size_type count)
+    {
+        assert(pos <= size() and count <= size() - pos);
+
+        (void)eds_memmap_advise((const char*)(const void*)(data() + pos),
+                                count * sizeof(type), how);
+    }
+
+    /* The size of the windows read_ahead advises, 4 MiB by default */
+    void read_ahead_window(size_t bytes) noexcept
+    {
+        window_bytes = bytes;
+    }
+
+    /* For a cursor moving forward, at position pos: starts reading the
+       window of pages ahead of it (MADV_WILLNEED), whenever it gets
+       into the second half of the window advised before, so that the
+       reads overlap with the processing of the elements, also where
+       the kernel's own read ahead stops, e.g. with
+       EDS_MEMMAP_ACCESS_RANDOM. Skipping forward starts over at pos.
+    */
+    void read_ahead(size_type pos) noexcept
+    {
+        size_t offset = std::min(pos * sizeof(type), view.size);
+
+        if (offset + window_bytes / 2 < next_window
+                or window_bytes == 0
+                or offset >= view.size)
+        {
+            return;
+        }
+        if (offset > next_window) {
+            next_window = offset;
+        }
+        (void)eds_memmap_advise(view.base + next_window,
+                                std::min(window_bytes,
+                                         view.size - next_window),
+                                EDS_MEMMAP_ACCESS_WILLNEED);
+        next_window += window_bytes;
+    }
+
+    /* A writable copy of the elements, with room for max_count, which
+       maps the pages of the file privately: they are read as they are
+       accessed, and copied when written to. The file never changes,
+       and the view stays as it is. See memmap::map_copy_on_write.
+    */
+    memmap<type> copy_on_write(size_type max_count) const
+    {
+        memmap<type> copy;
+
+        copy.map_copy_on_write(view.fd, size(), std::max(max_count, size()));
+        return copy;
+    }
+
+    memmap<type> copy_on_write() const
+    {
+        return copy_on_write(size());
+    }
+
+    bool is_open() const noexcept
+    {
+        return view.fd >= 0;
+    }
+
+    int fd() const noexcept
+    {
+        return view.fd;
+    }
+
+    size_type size() const noexcept
+    {
+        return view.size / sizeof(type);
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    const_pointer data() const noexcept
+    {
+        return (const type*)(const void*)view.base;
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator end() const noexcept
+    {
+        return data() + size();
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return data() + size();
+    }
+
+    const_reverse_iterator rbegin() const noexcept
+    {
+        return const_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator rend() const noexcept
+    {
+        return const_reverse_iterator(cbegin());
+    }
+
+    const_reference operator[](size_type pos) const noexcept
+    {
+        return data()[pos];
+    }
+
+    const_reference at(size_type pos) const
+    {
+        if (pos >= size()) {
+            throw std::out_of_range("mapped_view::at");
+        }
+        return data()[pos];
+    }
+
+    const_reference front() const noexcept
+    {
+        return data()[0];
+    }
+
+    const_reference back() const noexcept
+    {
+        return data()[size() - 1];
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_MAPPED_VIEW_H */
@@ -3,21 +3,96 @@
 #define EDS_MEMMAP_H
 
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
 #include <algorithm>
 #include <memory>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
 #include <stdexcept>
+#include <system_error>
 #include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "mapped_storage.h"
 
 namespace eds
 {
 
+struct memmap_stats
+{
+    /* times the storage was grown, shrunk, merged or split */
+    size_t remaps;
+
+    /* remaps which moved the elements to a new address */
+    size_t moves;
+
+    /* unused capacity in front of, and behind the elements */
+    size_t slack_low;
+    size_t slack_high;
+
+    /* bytes kept mapped beyond the capacity, see memmap::retain */
+    size_t retained;
+};
+
+/* Whether objects of a type stay valid when their bytes are moved to
+   another address, without calling their move constructor and destructor.
+   The elements of such types move along with their pages, using mremap,
+   elements of other types are moved one by one into new storage.
+   Trivially copyable types qualify, other types can be opted in with
+   a specialization, e.g.:
+
+       namespace eds
+       {
+       template<>
+       struct is_trivially_relocatable<my_type> : std::true_type {};
+       }
+
+   Types holding pointers into themselves must not be opted in, such as
+   std::string of libstdc++, which points into its own short string buffer.
+*/
+template<typename type>
+struct is_trivially_relocatable :
+    std::integral_constant<bool, std::is_trivially_copyable<type>::value>
+{
+};
+
+template<typename type>
+struct is_trivially_relocatable<std::unique_ptr<type>> : std::true_type
+{
+};
+
+template<typename type>
+struct is_trivially_relocatable<std::shared_ptr<type>> : std::true_type
+{
+};
+
+/* Whether a type is an iterator, which tells the iterator overloads of
+   insert and assign from the (count, value) ones, as in std::vector:
+   memmap<int>::insert(pos, 3, 7) inserts three sevens.
+*/
+template<typename iterator, typename = void>
+struct is_input_iterator : std::false_type
+{
+};
+
+template<typename iterator>
+struct is_input_iterator<iterator, typename std::enable_if<
+    std::is_convertible<
+        typename std::iterator_traits<iterator>::iterator_category,
+        std::input_iterator_tag>::value>::type> : std::true_type
+{
+};
+
 template<typename type>
-class memmap 
+class memmap
 {
 private:
 
@@ -41,7 +116,7 @@ private:
     static void create(type* address, arg_types&&... ctor_args)
     {
         if (address != nullptr) {
-            ::new(address) type(ctor_args...);
+            ::new(address) type(std::forward<arg_types>(ctor_args)...);
         }
         else {
             /* Placement new must check for null pointer according to ISO,
@@ -63,23 +138,68 @@ public:
     {
     }
 
+    /* Copies of a copy-on-write memmap take constant time,
+       see reserve_copy_on_write.
+    */
     explicit memmap(const memmap& other):
-        storage(other.length * sizeof(type)),
-        head((type*)storage.begin()),
+        head(nullptr),
+        length(0)
+    {
+        if (other.storage.has_file()
+                and std::is_trivially_copyable<type>::value)
+        {
+            storage = other.storage.copy_on_write();
+            head = (type*)(storage.begin()
+                           + (other.char_cbegin() - other.storage.cbegin()));
+            length = other.length;
+            return;
+        }
+        storage = mapped_storage<char>(other.length * sizeof(type));
+        head = (type*)storage.begin();
+        try {
+            copy_elements(other.cbegin(), other.size());
+        }
+        catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    memmap(memmap&& other) noexcept:
+        storage(std::move(other.storage)),
+        head(other.head),
         length(other.length)
     {
-        std::memcpy(begin(), other.cbegin(), size());
+        other.head = nullptr;
+        other.length = 0;
+    }
+
+    ~memmap()
+    {
+        clear();
+    }
+
+    memmap& operator=(memmap&& other) noexcept
+    {
+        swap(other);
+        return *this;
     }
 
     memmap& operator=(const memmap& other)
     {
-        if (this != &other) {
+        if (this != &other
+                and other.storage.has_file()
+                and std::is_trivially_copyable<type>::value)
+        {
+            memmap copy(other);
+
+            copy.storage.take_settings(storage);
+            swap(copy);
+        }
+        else if (this != &other) {
+            clear();
             reserve_high(other.size());
-            for (size_t index = length; index < length; ++index) {
-                (head + index)->~type();
-            }
-            length = other.length;
-            std::memcpy(begin(), other.cbegin(), size());
+            copy_elements(other.cbegin(), other.size());
         }
         return *this;
     }
@@ -126,15 +246,30 @@ public:
         return capacity_high();
     }
 
-    typename std::enable_if<std::is_trivially_move_constructible<type>::value>::type
-    reserve_high(size_type count)
+    /* The remap counts are zero when built with EDS_MEMMAP_NO_STATS */
+    memmap_stats stats() const noexcept
+    {
+        memmap_stats result;
+
+        result.remaps = storage.remap_count();
+        result.moves = storage.move_count();
+        result.slack_low = capacity_low() - size();
+        result.slack_high = capacity_high() - size();
+        result.retained = storage.retained();
+        return result;
+    }
+
+    void reserve_high(size_type count)
     {
         if (count > max_size()) {
             throw std::bad_alloc();
         }
-        if (capacity_high() < count) {
+        if (capacity_high() < count and moves_one_by_one()) {
+            relocate(count, (char_cbegin() - storage.cbegin()) / sizeof(type));
+        }
+        else if (capacity_high() < count) {
             char* old_storage_begin = storage.begin();
-            storage.expand_high((count - length) * sizeof(type));
+            storage.expand_high(count * sizeof(type) - capacity_high_raw());
             head = (type*)(storage.begin() + (char_cbegin() - old_storage_begin));
         }
     }
@@ -144,9 +279,12 @@ public:
         if (count > max_size()) {
             throw std::bad_alloc();
         }
-        if (capacity_low() < count) {
+        if (capacity_low() < count and moves_one_by_one()) {
+            relocate(capacity_high(), count - length);
+        }
+        else if (capacity_low() < count) {
             char* old_storage_begin = storage.begin();
-            storage.expand_high((count - length) * sizeof(type));
+            storage.expand_low((count - length) * sizeof(type));
             head = (type*)(storage.begin() + (char_cbegin() - old_storage_begin));
             head += count - length;
         }
@@ -157,11 +295,247 @@ public:
         reserve_high(new_cap);
     }
 
+    /* Moves the elements into a newly reserved range of address space,
+       with room for count elements from the first one, and count_low
+       elements in front of it. The range is not backed by memory until
+       the memmap grows into it.
+       From then on, growing at either end never moves the elements:
+       pointers and iterators stay valid across push_back and push_front,
+       and growing beyond the reserved range throws std::bad_alloc.
+    */
+    void reserve_address_space(size_type count, size_type count_low = 0)
+    {
+        if (count < length
+                or count > max_size()
+                or count_low > max_size() - count)
+        {
+            throw std::length_error("memmap::reserve_address_space");
+        }
+        if (not is_trivially_relocatable<type>::value and not empty()) {
+            memmap reserved;
+
+            reserved.storage.take_settings(storage);
+            reserved.reserve_address_space(count, count_low);
+            reserved.move_back_from(*this);
+            swap(reserved);
+            return;
+        }
+        shrink_to_fit();
+        storage.reserve_address_space(count * sizeof(type),
+                                      count_low * sizeof(type));
+        head = (type*)storage.begin();
+    }
+
+    /* Like reserve_address_space, and the elements are stored in
+       a memfd. Copying the memmap then only maps the same pages in the
+       copy, in constant time, the kernel duplicates each page when
+       either side first writes to it. Copies are copy-on-write memmaps
+       themselves, each holding a file descriptor.
+       A page written by the original since its previous copy is copied
+       right away though, which makes repeated snapshots of a memmap
+       cost as much as the pages changed between them.
+       Requires Linux 3.17 (memfd_create).
+    */
+    void reserve_copy_on_write(size_type count, size_type count_low = 0)
+    {
+        if (count < length
+                or count > max_size()
+                or count_low > max_size() - count)
+        {
+            throw std::length_error("memmap::reserve_copy_on_write");
+        }
+        if (not is_trivially_relocatable<type>::value and not empty()) {
+            memmap reserved;
+
+            reserved.storage.take_settings(storage);
+            reserved.reserve_copy_on_write(count, count_low);
+            reserved.move_back_from(*this);
+            swap(reserved);
+            return;
+        }
+        shrink_to_fit();
+        storage.reserve_copy_on_write(count * sizeof(type),
+                                      count_low * sizeof(type));
+        head = (type*)storage.begin();
+    }
+
+    /* Replaces the elements with the count elements at the start of the
+       file fd, e.g. of a mapped_view, mapped privately, like
+       reserve_copy_on_write with room for max_count elements: instead
+       of reading the file, the pages are read in as they are accessed,
+       and only copied once written to. The file never changes.
+    */
+    void map_copy_on_write(int fd, size_type count, size_type max_count)
+    {
+        static_assert(std::is_trivially_copyable<type>::value,
+                      "the elements are mapped from a file");
+
+        if (count > max_count or max_count > max_size()) {
+            throw std::length_error("memmap::map_copy_on_write");
+        }
+        clear();
+        storage.map_copy_on_write(fd, count * sizeof(type),
+                                  max_count * sizeof(type));
+        head = (type*)storage.begin();
+        length = count;
+    }
+
+    /* Writes the elements to the file fd, e.g. a checkpoint of a large
+       state, which ends up holding just them, like write_to_fd, but
+       only the pages written to since the previous checkpoint: it
+       costs as much as the elements changed, not the size of the memmap.
+       The first checkpoint writes all elements, and starts tracking the
+       pages by write protecting them, so the first write to each page
+       afterwards takes a page fault, or with soft-dirty bits when
+       chosen, see eds_memmap_set_dirty_tracking. Elements moving, e.g.
+       in pop_front, or as the memmap grows by moving its pages, take a
+       full checkpoint. With write protection, system calls reading
+       into the elements, e.g. read(2) or recv(2), fail with EFAULT,
+       unless eds_memmap_dirty_write makes the pages writable first,
+       as append_from_fd does.
+       No other thread may write to the elements meanwhile, and the
+       file must not be mapped elsewhere, its end may be cut off.
+       Waits for the writes to reach the disk, unless wait is false.
+       Returns the number of bytes written, throws std::system_error.
+    */
+    size_type checkpoint(int fd, bool wait = true)
+    {
+        static_assert(std::is_trivially_copyable<type>::value,
+                      "the elements are written as bytes");
+
+        size_t offset = char_cbegin() - storage.cbegin();
+        size_type written;
+
+        written = storage.checkpoint(fd, offset, length * sizeof(type), wait);
+        head = (type*)(storage.begin() + offset);
+        return written;
+    }
+
+    /* Replaces the elements with the ones of the checkpoint file fd,
+       mapped like map_copy_on_write, with room for max_count elements,
+       so the pages are only read as they are accessed. By default the
+       room behind the elements of the file is as large as they are,
+       and 64 GiB at least, which only takes address space. Growing
+       beyond it throws std::bad_alloc. Checkpoints to the same file
+       continue from there, writing the pages written to since.
+       Throws std::system_error when fd can't be read.
+    */
+    void restore(int fd, size_type max_count = 0)
+    {
+        struct stat status;
+        size_type count;
+
+        if (fstat(fd, &status) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "memmap::restore");
+        }
+        count = size_type(status.st_size) / sizeof(type);
+        if (max_count == 0) {
+            size_type room = restore_reserve_bytes / sizeof(type);
+
+            max_count = std::min(max_size(), count + std::max(count, room));
+        }
+        map_copy_on_write(fd, count, std::max(count, max_count));
+        storage.checkpointed(0, count * sizeof(type));
+    }
+
+    /* Takes the page faults of the storage now, and of the storage it
+       grows into from now on, in reserve, resize or push_back,
+       see eds_memmap_populate_flags. E.g. EDS_MEMMAP_POPULATE_WRITE
+       | EDS_MEMMAP_LOCK_ON_FAULT keeps the capacity faulted in and
+       locked, so writing to it later never faults. Zero stops it,
+       and unlocks the pages.
+       The flags move along with the storage, when moving or swapping
+       memmaps, copies and split off tails start without them.
+       Storage below the mmap treshold is left alone, it shares its
+       pages with malloc'd memory. Throws std::bad_alloc when the
+       pages can't be faulted in, or locked.
+    */
+    void populate(unsigned flags)
+    {
+        storage.populate(flags);
+    }
+
+    unsigned populate_flags() const noexcept
+    {
+        return storage.populate_flags();
+    }
+
+    /* For buffers shrinking after a burst, and growing again soon after:
+       shrink_to_fit keeps up to max_bytes of the capacity it gives up
+       mapped, and only returns their memory to the kernel, with
+       MADV_FREE or MADV_DONTNEED, see eds_memmap_retain. Growing again
+       takes them back without a system call, or a fresh mapping.
+       Storage in reserved address space keeps its range anyway.
+       With EDS_MEMMAP_RETAIN_OFF, the retained bytes are capacity again,
+       for shrink_to_fit to unmap. Like populate, the setting moves
+       along with the storage.
+    */
+    void retain(eds_memmap_retain how, size_type max_bytes = size_t(0) - 1)
+    {
+        storage.retain(how, max_bytes);
+    }
+
+    /* How push_back, push_front, insert and append grow the capacity,
+       see growth_policy, e.g. growth_policy::next_page() for storage
+       in reserved address space, or growth_policy::geometric(1.5)
+       .linear_above(1 << 30, 1 << 26) to stop doubling at 1 GiB.
+       resize and reserve take the size asked for. Like populate, the
+       policy moves along with the storage.
+    */
+    void growth(const growth_policy& policy) noexcept
+    {
+        storage.growth(policy);
+    }
+
+    const growth_policy& growth() const noexcept
+    {
+        return storage.growth();
+    }
+
+    /* Places the pages of the storage on NUMA nodes with policy, see
+       eds_memmap_numa_policy, e.g. EDS_MEMMAP_NUMA_INTERLEAVE for a
+       table scanned by threads on all nodes, or EDS_MEMMAP_NUMA_BIND
+       to node for one used by threads pinned to it. The pages already
+       allocated migrate, and the storage keeps the policy as it grows,
+       also when it moves. Like populate, the policy moves along with
+       the storage, new storage follows eds_memmap_set_numa_policy.
+       On a single node host it does nothing. Throws std::bad_alloc
+       for a node the host doesn't have.
+    */
+    void numa_policy(eds_memmap_numa_policy policy, int node = 0)
+    {
+        storage.numa_policy(policy, node);
+    }
+
+    eds_memmap_numa_policy numa_policy() const noexcept
+    {
+        return storage.numa_policy();
+    }
+
+    /* The number of pages of the capacity allocated on each node,
+       indexed by node
+    */
+    std::vector<size_type> numa_pages() const
+    {
+        return storage.numa_pages();
+    }
+
+    /* Growing with zero values, e.g. value initialized ints,
+       skips writing to the fresh pages.
+    */
     void resize(size_type count)
     {
         for (size_t index = count; index < length; ++index) {
             (head + index)->~type();
         }
+        if (count > length
+                and std::is_trivially_default_constructible<type>::value
+                and is_zero(type()))
+        {
+            zero_fill_high(count);
+            return;
+        }
         reserve(count);
         for (size_t index = length; index < count; ++index) {
             create(head + index);
@@ -174,7 +548,21 @@ public:
         for (size_t index = count; index < length; ++index) {
             (head + index)->~type();
         }
+        if (count > length and is_zero(value)) {
+            zero_fill_high(count);
+            return;
+        }
         reserve(count);
+        if (std::is_trivially_copyable<type>::value
+                and count > length
+                and (count - length) * sizeof(type) >= bulk_bytes)
+        {
+            eds_memmap_fill((char*)(void*)(head + length),
+                            (count - length) * sizeof(type),
+                            (const char*)(const void*)&value, sizeof(type));
+            length = count;
+            return;
+        }
         for (size_t index = length; index < count; ++index) {
             create(head + index, value);
         }
@@ -274,23 +662,213 @@ public:
 
 private:
 
-    void reserve_for_push(bool at_high)
+    size_type max_size_in_reservation(bool at_high) const noexcept
+    {
+        if (at_high) {
+            return (capacity_high_raw() + storage.headroom_high())
+                   / sizeof(type);
+        }
+        else {
+            return size() + storage.headroom_low() / sizeof(type);
+        }
+    }
+
+    /* Fills and copies of at least this many bytes are left to
+       eds_memmap_fill and eds_memmap_copy, which use non-temporal
+       stores and worker threads when they are large enough.
+    */
+    static constexpr size_t bulk_bytes = 0x10000;
+
+    /* The address space restore reserves at least, by default */
+    static constexpr size_t restore_reserve_bytes = size_t(1) << 36;
+
+    /* Copies count elements to the beginning */
+    void copy_bytes(const type* from, size_type count)
+    {
+        if (count * sizeof(type) >= bulk_bytes) {
+            eds_memmap_copy((char*)(void*)head, (const char*)(const void*)from,
+                            count * sizeof(type));
+        }
+        else if (count != 0) {
+            std::memcpy((void*)head, (const void*)from, count * sizeof(type));
+        }
+    }
+
+    /* Copies count elements to the beginning, where there are none yet */
+    void copy_elements(const type* from, size_type count)
+    {
+        if (std::is_trivially_copyable<type>::value) {
+            copy_bytes(from, count);
+            length = count;
+            return;
+        }
+        for (; length < count; ++length) {
+            create(head + length, from[length]);
+        }
+    }
+
+    /* Elements which aren't trivially relocatable can't move along with
+       the storage, unless it grows in place, inside its reservation.
+    */
+    bool moves_one_by_one() const noexcept
+    {
+        return not is_trivially_relocatable<type>::value
+               and not storage.has_reservation();
+    }
+
+    /* Moves the elements one by one into new storage, with room for
+       count_high elements from the first one, and count_low elements
+       in front of it. When a copy constructor throws, like std::vector
+       this leaves the elements as they were.
+    */
+    void relocate(size_type count_high, size_type count_low)
+    {
+        mapped_storage<char> new_storage((count_high + count_low)
+                                         * sizeof(type));
+        type* new_head = (type*)(new_storage.begin()
+                                 + count_low * sizeof(type));
+        size_t index = 0;
+
+        if (new_storage.begin() == nullptr) {
+            throw std::bad_alloc();
+        }
+        try {
+            for (; index < length; ++index) {
+                create(new_head + index, std::move_if_noexcept(head[index]));
+            }
+        }
+        catch (...) {
+            while (index != 0) {
+                --index;
+                new_head[index].~type();
+            }
+            throw;
+        }
+        for (index = 0; index < length; ++index) {
+            head[index].~type();
+        }
+        storage.replace(std::move(new_storage));
+        head = new_head;
+    }
+
+    /* Moves the elements of other from position pos on one by one
+       behind the elements, instead of moving their pages.
+    */
+    void move_back_from(memmap& other, size_type pos = 0)
+    {
+        reserve_high(size() + other.size() - pos);
+        for (size_t index = pos; index < other.length; ++index) {
+            create(head + length, std::move(other.head[index]));
+            ++length;
+        }
+        while (other.length > pos) {
+            other.pop_back();
+        }
+    }
+
+    /* Moves count elements from index from to index to, as bytes,
+       whole pages are moved instead of copied when possible.
+    */
+    void move_elements(size_type to, size_type from, size_type count)
+    {
+        size_t low_offset = char_cbegin() - storage.cbegin();
+
+        storage.move_bytes(low_offset + to * sizeof(type),
+                           low_offset + from * sizeof(type),
+                           count * sizeof(type));
+    }
+
+    /* Makes room for count elements at index, the elements from
+       index on move up, and the room is left uninitialized.
+       Elements which aren't trivially relocatable are inserted
+       at the end instead, see insert.
+    */
+    void open_gap(size_type index, size_type count)
+    {
+        reserve_for_push(true, count);
+        move_elements(index + count, index, length - index);
+    }
+
+    void close_gap(size_type index, size_type count)
+    {
+        move_elements(index, index + count, length - index);
+    }
+
+    /* Whether copies of value can be made by zeroing memory */
+    static bool is_zero(const type& value) noexcept
+    {
+        const unsigned char* bytes = (const unsigned char*)(const void*)&value;
+
+        if (not std::is_trivially_copyable<type>::value) {
+            return false;
+        }
+        for (size_t index = 0; index < sizeof(type); ++index) {
+            if (bytes[index] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Grows to count zero elements. Only the spare capacity is cleared,
+       the pages the storage grows into are zero already, and are left
+       untouched, instead of being faulted in just to write zeros.
+    */
+    void zero_fill_high(size_type count)
+    {
+        size_t spare = capacity_high_raw() - length * sizeof(type);
+
+        if (count > max_size()) {
+            throw std::bad_alloc();
+        }
+        if (count <= capacity_high()) {
+            std::memset((void*)(head + length), 0, (count - length) * sizeof(type));
+        }
+        else {
+            char* old_storage_begin = storage.begin();
+
+            if (spare != 0) {
+                std::memset((void*)(head + length), 0, spare);
+            }
+            storage.expand_high_zeroed(count * sizeof(type)
+                                       - capacity_high_raw());
+            head = (type*)(storage.begin() + (char_cbegin() - old_storage_begin));
+        }
+        length = count;
+    }
+
+    /* Makes room for count more elements at either end, growing the
+       capacity as the growth policy says, see growth.
+    */
+    void reserve_for_push(bool at_high, size_type count = 1)
     {
         size_t new_size;
+        size_t offset;
 
-        if (at_high and capacity_high() != size()) {
+        if (at_high and capacity_high() - size() >= count) {
             return;
         }
-        if (not at_high and capacity_low() != size()) {
+        if (not at_high and capacity_low() - size() >= count) {
             return;
         }
-        new_size = size() * 2;
-        if (new_size < 1) {
-            new_size = 1;
+        if (count > max_size() - size()) {
+            throw std::bad_alloc();
         }
-        else if (new_size > max_size()) {
+        if (at_high) {
+            offset = char_cbegin() - storage.cbegin();
+        }
+        else {
+            offset = storage.cend() - char_cend();
+        }
+        new_size = storage.growth().grow(size() * sizeof(type),
+                                         (size() + count) * sizeof(type),
+                                         offset) / sizeof(type);
+        if (new_size > max_size()) {
             new_size = max_size();
-            if (new_size == size()) {
+        }
+        if (storage.has_reservation()) {
+            new_size = std::min(new_size, max_size_in_reservation(at_high));
+            if (new_size < size() + count) {
                 throw std::bad_alloc();
             }
         }
@@ -308,7 +886,7 @@ public:
     void emplace_back(arg_types&&... ctor_args)
     {
         reserve_for_push(true);
-        create(head + length, ctor_args...);
+        create(head + length, std::forward<arg_types>(ctor_args)...);
         ++length;
     }
 
@@ -317,7 +895,7 @@ public:
     {
         reserve_for_push(false);
         --head;
-        create(head, ctor_args...);
+        create(head, std::forward<arg_types>(ctor_args)...);
         ++length;
     }
 
@@ -333,30 +911,214 @@ public:
 
     void push_back(type&& value)
     {
-        emplace_back(value);
+        emplace_back(std::move(value));
     }
 
     void push_front(type&& value)
     {
-        emplace_front(value);
+        emplace_front(std::move(value));
+    }
+
+    /* Inserts before pos. Elements which are trivially relocatable
+       are moved up as bytes, large moves by a multiple of the page size
+       move whole pages, only updating page tables, see eds_memmap_move.
+       Other elements are inserted at the end, and rotated into place.
+    */
+    iterator insert(const_iterator pos, const type& value)
+    {
+        return insert(pos, 1, value);
+    }
+
+    iterator insert(const_iterator pos, size_type count, const type& value)
+    {
+        size_type index = pos - cbegin();
+        size_type done = 0;
+        type copy(value);
+
+        if (not is_trivially_relocatable<type>::value) {
+            size_type old_length = length;
+
+            reserve_for_push(true, count);
+            try {
+                for (; done < count; ++done) {
+                    emplace_back(copy);
+                }
+            }
+            catch (...) {
+                truncate(old_length);
+                throw;
+            }
+            std::rotate(begin() + index, begin() + old_length, end());
+            return begin() + index;
+        }
+        open_gap(index, count);
+        if (std::is_trivially_copyable<type>::value
+                and count * sizeof(type) >= bulk_bytes)
+        {
+            eds_memmap_fill((char*)(void*)(head + index), count * sizeof(type),
+                            (const char*)(const void*)&copy, sizeof(type));
+            length += count;
+            return begin() + index;
+        }
+        try {
+            for (; done < count; ++done) {
+                create(head + index + done, copy);
+            }
+        }
+        catch (...) {
+            destroy_gap(index, count, done);
+            throw;
+        }
+        length += count;
+        return begin() + index;
+    }
+
+    /* The elements in [first, last) must not be elements of this memmap.
+       Input iterators, which can be read once, are inserted at the end,
+       and rotated into place.
+    */
+    template<class input_iterator,
+             typename = typename std::enable_if<
+                 is_input_iterator<input_iterator>::value>::type>
+    iterator insert(const_iterator pos,
+                    input_iterator first, input_iterator last)
+    {
+        return insert_range(pos - cbegin(), first, last,
+                            typename std::iterator_traits<
+                                input_iterator>::iterator_category());
+    }
+
+    /* Erasing moves the elements behind the erased ones down,
+       like insert moves them up.
+    */
+    iterator erase(const_iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        size_type index = first - cbegin();
+        size_type count = last - first;
+
+        if (count == 0) {
+            return begin() + index;
+        }
+        if (not is_trivially_relocatable<type>::value) {
+            std::move(head + index + count, head + length, head + index);
+            truncate(length - count);
+            return begin() + index;
+        }
+        for (size_t item = index; item < index + count; ++item) {
+            head[item].~type();
+        }
+        length -= count;
+        close_gap(index, count);
+        return begin() + index;
+    }
+
+private:
+
+    /* Destroys the first done elements constructed in the room opened
+       for count elements at index, and closes it again.
+    */
+    void destroy_gap(size_type index, size_type count, size_type done)
+    {
+        while (done != 0) {
+            --done;
+            head[index + done].~type();
+        }
+        close_gap(index, count);
+    }
+
+    /* Destroys the elements from index count on */
+    void truncate(size_type count) noexcept
+    {
+        while (length > count) {
+            pop_back();
+        }
+    }
+
+    template<class forward_iterator>
+    iterator insert_range(size_type index,
+                          forward_iterator first, forward_iterator last,
+                          std::forward_iterator_tag)
+    {
+        size_type count = std::distance(first, last);
+        size_type done = 0;
+
+        if (not is_trivially_relocatable<type>::value) {
+            size_type old_length = length;
+
+            reserve_for_push(true, count);
+            try {
+                for (; first != last; ++first) {
+                    emplace_back(*first);
+                }
+            }
+            catch (...) {
+                truncate(old_length);
+                throw;
+            }
+            std::rotate(begin() + index, begin() + old_length, end());
+            return begin() + index;
+        }
+        open_gap(index, count);
+        try {
+            for (; first != last; ++first, ++done) {
+                create(head + index + done, *first);
+            }
+        }
+        catch (...) {
+            destroy_gap(index, count, done);
+            throw;
+        }
+        length += count;
+        return begin() + index;
+    }
+
+    template<class input_iterator>
+    iterator insert_range(size_type index,
+                          input_iterator first, input_iterator last,
+                          std::input_iterator_tag)
+    {
+        size_type old_length = length;
+
+        try {
+            for (; first != last; ++first) {
+                emplace_back(*first);
+            }
+        }
+        catch (...) {
+            truncate(old_length);
+            throw;
+        }
+        std::rotate(begin() + index, begin() + old_length, end());
+        return begin() + index;
     }
 
+public:
+
     void pop_back()
     {
         --length;
         head[length].~type();
     }
 
+    /* The capacity the first element leaves behind can be taken again
+       by push_front, see release_front to give it back
+    */
     void pop_front()
     {
-        --length;
         head->~type();
+        ++head;
+        --length;
     }
 
     void clear() noexcept
     {
-        for (auto item : *this) {
-            item->~type();
+        for (auto& item : *this) {
+            item.~type();
         }
         length = 0;
     }
@@ -378,31 +1140,250 @@ public:
         std::swap(length, other.length);
     }
 
+    /* Moves all elements of other to the end of this memmap.
+       The pages holding the elements of other are moved
+       using mremap when possible, instead of copying them,
+       unless the elements aren't trivially relocatable.
+    */
+    void append(memmap&& other)
+    {
+        size_t low_offset;
+
+        if (other.empty()) {
+            return;
+        }
+        if (empty()) {
+            swap(other);
+            return;
+        }
+        if (size() + other.size() > max_size()) {
+            throw std::bad_alloc();
+        }
+        if (not is_trivially_relocatable<type>::value) {
+            move_back_from(other);
+            return;
+        }
+        low_offset = char_cbegin() - storage.cbegin();
+        storage.shrink_high(storage.cend() - char_cend());
+        other.storage.shrink_low(other.char_cbegin() - other.storage.cbegin());
+        storage.merge(std::move(other.storage));
+        head = (type*)(storage.begin() + low_offset);
+        length += other.length;
+        other.head = nullptr;
+        other.length = 0;
+    }
+
+    /* Moves the elements starting at position pos into a new memmap,
+       leaving the first pos elements in this one.
+    */
+    memmap split_off(size_type pos)
+    {
+        memmap tail;
+        size_t low_offset;
+
+        if (pos > length) {
+            throw std::out_of_range("memmap::split_off");
+        }
+        if (pos == 0) {
+            tail.swap(*this);
+            return tail;
+        }
+        if (pos == length) {
+            return tail;
+        }
+        if (not is_trivially_relocatable<type>::value) {
+            tail.move_back_from(*this, pos);
+            return tail;
+        }
+        low_offset = char_cbegin() - storage.cbegin();
+        storage.shrink_high(storage.cend() - char_cend());
+        tail.storage = storage.split(low_offset + pos * sizeof(type));
+        tail.head = (type*)tail.storage.begin();
+        tail.length = length - pos;
+        head = (type*)(storage.begin() + low_offset);
+        length = pos;
+        return tail;
+    }
+
+    /* Reads up to max_bytes from fd right behind the last element, into
+       the capacity, which grows as push_back grows it, instead of
+       reading into a buffer, and appending that. For memmaps of bytes.
+       Returns the number of bytes read, and added, 0 at the end of the
+       file, or -1 setting errno, like read(2), e.g. EAGAIN.
+    */
+    ssize_t append_from_fd(int fd, size_type max_bytes)
+    {
+        static_assert(std::is_trivially_copyable<type>::value
+                      and sizeof(type) == 1,
+                      "append_from_fd reads bytes");
+
+        ssize_t result;
+
+        if (max_bytes == 0) {
+            return 0;
+        }
+        reserve_for_push(true, max_bytes);
+        /* The kernel doesn't take the faults of write protected pages */
+        eds_memmap_dirty_write((const char*)(const void*)(head + length),
+                               max_bytes);
+        do {
+            result = ::read(fd, (void*)(head + length), max_bytes);
+        } while (result < 0 and errno == EINTR);
+        if (result > 0) {
+            length += size_t(result);
+        }
+        return result;
+    }
+
+    /* Writes the bytes of count elements from position pos to fd,
+       from the elements, as write(2) does, until all are written.
+       Returns the number of bytes written, fewer when fd would block,
+       or -1 setting errno, when it fails before writing any.
+       This is write(2), which copies the bytes into the kernel once,
+       not vmsplice and splice: those leave the pages referenced by the
+       pipe, and a socket sends them later, so the elements changed
+       after write_to_fd returned would reach the other end. Where the
+       elements stay unchanged until sent, splice_to_pipe and splice(2)
+       pass them without copying.
+    */
+    ssize_t write_to_fd(int fd, size_type pos, size_type count) const
+    {
+        static_assert(std::is_trivially_copyable<type>::value,
+                      "write_to_fd writes bytes");
+
+        const char* from = (const char*)(const void*)(head + pos);
+        size_t left = count * sizeof(type);
+        size_t written = 0;
+        ssize_t result;
+
+        assert(pos <= length and count <= length - pos);
+
+        while (written < left) {
+            result = ::write(fd, from + written, left - written);
+            if (result < 0 and errno == EINTR) {
+                continue;
+            }
+            else if (result <= 0) {
+                return written != 0 ? ssize_t(written) : result;
+            }
+            written += size_t(result);
+        }
+        return ssize_t(written);
+    }
+
+    /* Hands the bytes of count elements from position pos to the pipe
+       pipe_fd with vmsplice, which makes the pipe refer to their pages,
+       instead of copying them, e.g. for splice(2) to pass them on to a
+       socket or a file. The pages are only read once the reader of the
+       pipe consumes them: the elements must not change, or be removed,
+       until then, while moving the storage leaves the pipe's
+       references valid. flags are those of vmsplice, e.g.
+       SPLICE_F_NONBLOCK. Returns the number of bytes the pipe took,
+       fewer when it fills, or -1 setting errno, like vmsplice(2).
+    */
+    ssize_t splice_to_pipe(int pipe_fd, size_type pos, size_type count,
+                           unsigned flags = 0) const
+    {
+        static_assert(std::is_trivially_copyable<type>::value,
+                      "splice_to_pipe passes bytes");
+
+        struct iovec range;
+        ssize_t result;
+
+        assert(pos <= length and count <= length - pos);
+
+        range.iov_base = (void*)(head + pos);
+        range.iov_len = count * sizeof(type);
+        do {
+            result = ::vmsplice(pipe_fd, &range, 1, flags);
+        } while (result < 0 and errno == EINTR);
+        return result;
+    }
+
+    /* Gives back the capacity in front of the first element, which
+       pop_front leaves behind, without moving the elements: the whole
+       pages are unmapped, or discarded when the memmap retains them,
+       see retain, and a reserved storage decommits them. Only storage
+       below the mmap treshold, in malloc'd memory, is copied, and
+       elements which aren't trivially relocatable move one by one,
+       like in shrink_to_fit.
+    */
+    void release_front()
+    {
+        size_t low_offset = char_cbegin() - storage.cbegin();
+
+        if (low_offset == 0) {
+            return;
+        }
+        if (moves_one_by_one()) {
+            relocate(capacity_high(), 0);
+            return;
+        }
+        storage.shrink_low(low_offset);
+        head = (type*)storage.begin();
+    }
+
     void shrink_to_fit()
     {
-        storage.shrink(char_cend() - storage.cend(),
-                       char_cbegin() - storage.begin());
+        size_t low_offset = char_cbegin() - storage.cbegin();
+
+        if (empty()) {
+            storage.clear();
+            head = (type*)storage.begin();
+            return;
+        }
+        if (moves_one_by_one()) {
+            if (low_offset != 0 or char_cend() != storage.cend()) {
+                relocate(length, 0);
+            }
+            return;
+        }
+        storage.shrink(storage.cend() - char_cend(), low_offset);
+        head = (type*)storage.begin();
     }
 
     void assign(size_type count, const type& value )
     {
         clear();
+        if (count > capacity_high() and is_zero(value)) {
+            /* The old contents would have to be cleared,
+               fresh storage is zero already.
+            */
+            shrink_to_fit();
+        }
         resize(count, value);
     }
 
-    template<class input_iterator>
+    template<class input_iterator,
+             typename = typename std::enable_if<
+                 is_input_iterator<input_iterator>::value>::type>
     void assign(input_iterator first, input_iterator last)
     {
-        pointer item;
-        input_iterator input;
-
         clear();
-        input = first;
-        item = head;
-        reserve(last - first);
-        while (input != last) {
-            const type& input_item = *input;
-            create(item, input_item);
+        assign_range(first, last,
+                     typename std::iterator_traits<
+                         input_iterator>::iterator_category());
+    }
+
+private:
+
+    template<class forward_iterator>
+    void assign_range(forward_iterator first, forward_iterator last,
+                      std::forward_iterator_tag)
+    {
+        reserve(std::distance(first, last));
+        for (; first != last; ++first) {
+            create(head + length, *first);
+            ++length;
+        }
+    }
+
+    template<class input_iterator>
+    void assign_range(input_iterator first, input_iterator last,
+                      std::input_iterator_tag)
+    {
+        for (; first != last; ++first) {
+            emplace_back(*first);
         }
     }
 
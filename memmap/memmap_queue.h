@@ -0,0 +1,166 @@
+
+#ifndef EDS_MEMMAP_QUEUE_H
+#define EDS_MEMMAP_QUEUE_H
+
+#include <cstddef>
+#include <utility>
+
+#include "eds_memmap.h"
+#include "memmap.h"
+
+namespace eds
+{
+
+/* A first in, first out queue on a memmap, e.g. a work queue which runs
+   for days: push appends at the back, and pop takes the element at the
+   front, leaving its capacity behind. Once release_treshold bytes of it
+   add up, their whole pages are given back, see memmap::release_front,
+   so the memory follows the elements queued, instead of all elements
+   ever queued. The elements never move down to reuse the front: the
+   memmap grows at the back with mremap, and shrinks at the front by
+   unmapping pages.
+
+   The treshold defaults to the mmap treshold, smaller memmaps live in
+   malloc'd memory, which can't give pages back without copying.
+   Retaining memmaps discard the pages instead of unmapping them, see
+   memmap::retain. A memmap in reserved address space decommits them,
+   its elements move up through the reservation, until they reach its
+   end, where push throws std::bad_alloc.
+*/
+template<typename type>
+class memmap_queue
+{
+private:
+
+    memmap<type> elements;
+    size_t release_bytes;
+
+    size_t released_bytes() const noexcept
+    {
+        return (elements.capacity_low() - elements.size()) * sizeof(type);
+    }
+
+public:
+
+    typedef memmap<type> container_type;
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef type& reference;
+    typedef const type& const_reference;
+
+    memmap_queue():
+        release_bytes(eds_memmap_get_mmap_treshold())
+    {
+    }
+
+    /* Takes over the elements of a memmap, the first one is the front */
+    explicit memmap_queue(memmap<type>&& other):
+        elements(std::move(other)),
+        release_bytes(eds_memmap_get_mmap_treshold())
+    {
+    }
+
+    void swap(memmap_queue& other)
+    {
+        elements.swap(other.elements);
+        std::swap(release_bytes, other.release_bytes);
+    }
+
+    /* The bytes popped, in front of the first element, which are given
+       back at once
+    */
+    void release_treshold(size_t bytes) noexcept
+    {
+        release_bytes = bytes;
+    }
+
+    size_t release_treshold() const noexcept
+    {
+        return release_bytes;
+    }
+
+    /* The memmap holding the elements, e.g. to retain, populate, or
+       reserve it
+    */
+    container_type& container() noexcept
+    {
+        return elements;
+    }
+
+    const container_type& container() const noexcept
+    {
+        return elements;
+    }
+
+    bool empty() const noexcept
+    {
+        return elements.empty();
+    }
+
+    size_type size() const noexcept
+    {
+        return elements.size();
+    }
+
+    reference front() noexcept
+    {
+        return elements.front();
+    }
+
+    const_reference front() const noexcept
+    {
+        return elements.front();
+    }
+
+    reference back() noexcept
+    {
+        return elements.back();
+    }
+
+    const_reference back() const noexcept
+    {
+        return elements.back();
+    }
+
+    void push(const type& value)
+    {
+        elements.push_back(value);
+    }
+
+    void push(type&& value)
+    {
+        elements.push_back(std::move(value));
+    }
+
+    template<typename... arg_types>
+    void emplace(arg_types&&... ctor_args)
+    {
+        elements.emplace_back(std::forward<arg_types>(ctor_args)...);
+    }
+
+    void pop()
+    {
+        elements.pop_front();
+        if (released_bytes() >= release_bytes) {
+            elements.release_front();
+        }
+    }
+
+    /* Gives back the capacity popped, whatever its size */
+    void release()
+    {
+        elements.release_front();
+    }
+
+    /* The memmap's statistics, slack_low is the capacity popped, which
+       wasn't given back yet
+    */
+    memmap_stats stats() const noexcept
+    {
+        return elements.stats();
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_MEMMAP_QUEUE_H */
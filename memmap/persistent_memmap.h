@@ -0,0 +1,343 @@
+
+#ifndef EDS_PERSISTENT_MEMMAP_H
+#define EDS_PERSISTENT_MEMMAP_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "eds_memmap.h"
+#include "growth_policy.h"
+
+namespace eds
+{
+
+/* An array of trivially copyable elements in a file, which outlives
+   the process, see eds_memmap_persistent. The file is mapped shared,
+   and grows with ftruncate and mremap, so the elements are never
+   copied. The header of the file holds the number of elements,
+   updated as it changes.
+   Opening the file again takes a single mmap, whatever its size, the
+   pages are read in as they are accessed, so a process restarting
+   finds a large lookup table as it left it, instead of building it
+   again. flush writes the elements to disk, otherwise the kernel
+   writes them back in its own time, which survives the process
+   exiting, or crashing, but not the host going down.
+
+   The elements are stored as bytes, in the byte order of the host,
+   the header only checks their size.
+*/
+template<typename type>
+class persistent_memmap
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "persistent_memmap elements are stored as bytes");
+
+private:
+
+    eds_memmap_persistent file;
+    growth_policy growing;
+
+    static eds_memmap_persistent no_file() noexcept
+    {
+        eds_memmap_persistent none = {nullptr, nullptr, 0, -1};
+
+        return none;
+    }
+
+    size_t count() const noexcept
+    {
+        return file.header == nullptr ? 0 : size_t(file.header->count);
+    }
+
+    void set_count(size_t new_count) noexcept
+    {
+        file.header->count = new_count;
+    }
+
+    /* Grows the capacity to count elements, as the growth policy says
+       when grow is set, or exactly. Fresh file pages read as zero.
+    */
+    void reserve_bytes(size_t new_count, bool grow)
+    {
+        size_t bytes;
+
+        if (file.header == nullptr) {
+            throw std::bad_alloc();
+        }
+        else if (new_count > max_size()) {
+            throw std::bad_alloc();
+        }
+        else if (new_count <= capacity()) {
+            return;
+        }
+        bytes = new_count * sizeof(type);
+        if (grow) {
+            bytes = std::max(bytes,
+                             std::min(growing.grow(count() * sizeof(type),
+                                                   bytes),
+                                      max_size() * sizeof(type)));
+        }
+        if (eds_memmap_persistent_resize(&file, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef type& reference;
+    typedef const type& const_reference;
+    typedef type* iterator;
+    typedef const type* const_iterator;
+
+    persistent_memmap():
+        file(no_file())
+    {
+    }
+
+    /* Opens the file at path, see open */
+    explicit persistent_memmap(const char* path):
+        file(no_file())
+    {
+        open(path);
+    }
+
+    persistent_memmap(persistent_memmap&& other) noexcept:
+        file(other.file),
+        growing(other.growing)
+    {
+        other.file = no_file();
+    }
+
+    persistent_memmap& operator=(persistent_memmap&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    persistent_memmap(const persistent_memmap&) = delete;
+    persistent_memmap& operator=(const persistent_memmap&) = delete;
+
+    ~persistent_memmap()
+    {
+        close();
+    }
+
+    void swap(persistent_memmap& other) noexcept
+    {
+        std::swap(file, other.file);
+        std::swap(growing, other.growing);
+    }
+
+    /* Opens the file at path, with the elements stored in it, creating
+       an empty one when there is none. Throws std::system_error when
+       it can't be opened, when it holds elements of another size
+       (std::errc::invalid_argument), or when it is open already
+       (std::errc::operation_would_block).
+    */
+    void open(const char* path)
+    {
+        eds_memmap_persistent opened;
+
+        if (eds_memmap_persistent_open(&opened, path, sizeof(type)) != 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        close();
+        file = opened;
+    }
+
+    /* The kernel writes the elements back to the file, see flush */
+    void close() noexcept
+    {
+        eds_memmap_persistent_close(&file);
+    }
+
+    bool is_open() const noexcept
+    {
+        return file.header != nullptr;
+    }
+
+    /* Writes the elements, and their number, to disk, waiting for the
+       writes to complete, unless wait is false. Throws std::system_error
+       on failure.
+    */
+    void flush(bool wait = true)
+    {
+        if (is_open()
+                and eds_memmap_persistent_flush(&file, count() * sizeof(type),
+                                                wait) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "persistent_memmap::flush");
+        }
+    }
+
+    /* See memmap::growth, the capacity is whole pages of the file,
+       and the pages the elements don't reach yet are holes in it.
+    */
+    void growth(const growth_policy& policy) noexcept
+    {
+        growing = policy;
+    }
+
+    const growth_policy& growth() const noexcept
+    {
+        return growing;
+    }
+
+    size_type size() const noexcept
+    {
+        return count();
+    }
+
+    size_type capacity() const noexcept
+    {
+        return file.capacity / sizeof(type);
+    }
+
+    size_type max_size() const noexcept
+    {
+        return (size_t(0) - 1) / 2 / sizeof(type);
+    }
+
+    bool empty() const noexcept
+    {
+        return count() == 0;
+    }
+
+    type* data() noexcept
+    {
+        return (type*)(void*)file.data;
+    }
+
+    const type* data() const noexcept
+    {
+        return (const type*)(const void*)file.data;
+    }
+
+    iterator begin() noexcept
+    {
+        return data();
+    }
+
+    iterator end() noexcept
+    {
+        return data() + count();
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return data() + count();
+    }
+
+    reference operator[](size_type position) noexcept
+    {
+        return data()[position];
+    }
+
+    const_reference operator[](size_type position) const noexcept
+    {
+        return data()[position];
+    }
+
+    reference front() noexcept
+    {
+        return data()[0];
+    }
+
+    reference back() noexcept
+    {
+        return data()[count() - 1];
+    }
+
+    void reserve(size_type new_cap)
+    {
+        reserve_bytes(new_cap, false);
+    }
+
+    void push_back(const type& value)
+    {
+        reserve_bytes(count() + 1, true);
+        std::memcpy((void*)(data() + count()), (const void*)&value,
+                    sizeof(type));
+        set_count(count() + 1);
+    }
+
+    void append(const type* items, size_type item_count)
+    {
+        if (item_count > max_size() - count()) {
+            throw std::bad_alloc();
+        }
+        reserve_bytes(count() + item_count, true);
+        std::memcpy((void*)(data() + count()), (const void*)items,
+                    item_count * sizeof(type));
+        set_count(count() + item_count);
+    }
+
+    void pop_back() noexcept
+    {
+        set_count(count() - 1);
+    }
+
+    /* The elements added read as zero bytes. Only the capacity the
+       file had already is cleared, it grows by holes.
+    */
+    void resize(size_type new_count)
+    {
+        size_t old_capacity = capacity();
+
+        reserve_bytes(new_count, false);
+        if (new_count > count()) {
+            std::memset((void*)(data() + count()), 0,
+                        (std::min(new_count, old_capacity) - count())
+                        * sizeof(type));
+        }
+        set_count(new_count);
+    }
+
+    void resize(size_type new_count, const value_type& value)
+    {
+        size_t old_count = count();
+
+        reserve_bytes(new_count, false);
+        for (size_t index = old_count; index < new_count; ++index) {
+            std::memcpy((void*)(data() + index), (const void*)&value,
+                        sizeof(type));
+        }
+        set_count(new_count);
+    }
+
+    void clear() noexcept
+    {
+        if (is_open()) {
+            set_count(0);
+        }
+    }
+
+    /* Truncates the file to the pages the elements take */
+    void shrink_to_fit()
+    {
+        if (is_open()
+                and eds_memmap_persistent_resize(&file, count() * sizeof(type))
+                    != 0)
+        {
+            throw std::bad_alloc();
+        }
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_PERSISTENT_MEMMAP_H */
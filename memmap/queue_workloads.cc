@@ -0,0 +1,262 @@
+#include "benchmark.h"
+#include "eds_memmap.h"
+#include "memmap_queue.h"
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace benchmark
+{
+
+namespace
+{
+
+/* The blocks of ring_wrap_workload, of a size not dividing a page */
+constexpr size_t ring_block = 307;
+
+/* The elements queued at a time in memmap_queue_workload */
+constexpr size_t queue_window = 1024;
+
+/* Pushes count elements, popping one for every two pushed, so the ring
+   grows while its elements wrap around its end.
+*/
+double ring_grow_workload(size_t count, latency_recorder& latency)
+{
+  eds::ring_buffer<int> ring;
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    if (ring.size() == ring.capacity()) {
+      clock::time_point step = clock::now();
+      ring.push_back(static_cast<int>(n));
+      latency.add(step, clock::now());
+    }
+    else {
+      ring.push_back(static_cast<int>(n));
+    }
+    if (n % 2 == 1) {
+      ring.pop_front();
+    }
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* Passes count elements through a ring of one page, in blocks of a size
+   not dividing the ring, which straddle its end.
+*/
+double ring_wrap_workload(size_t count, latency_recorder&)
+{
+  eds::ring_buffer<int> ring(ring_block);
+  size_t pushed = 0;
+  clock::time_point start = clock::now();
+
+  while (pushed < count) {
+    size_t items = std::min(ring_block, count - pushed);
+    int* room = ring.prepare(items);
+
+    for (size_t index = 0; index < items; ++index) {
+      room[index] = static_cast<int>(pushed + index);
+    }
+    ring.commit(items);
+    ring.consume(items);
+    pushed += items;
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* A producer thread pushes count elements one by one, the consumer
+   reads them in blocks, as they come, into items. Returns whether the
+   ring ends empty.
+*/
+bool spsc_transfer(size_t count, std::vector<int>& items)
+{
+  static constexpr size_t block = 256;
+
+  eds::spsc_ring_buffer<int> ring(1024);
+  size_t received = 0;
+
+  items.resize(count);
+  std::thread producer([&ring, count]() {
+      for (size_t n = 0; n < count; ++n) {
+        while (not ring.push(static_cast<int>(n))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+
+  while (received < count) {
+    size_t read_count = ring.read(items.data() + received,
+                                  std::min(block, count - received));
+
+    if (read_count == 0) {
+      std::this_thread::yield();
+    }
+    received += read_count;
+  }
+  producer.join();
+  return ring.read_available() == 0;
+}
+
+double spsc_workload(size_t count, latency_recorder&)
+{
+  std::vector<int> items;
+
+  items.reserve(count);
+
+  clock::time_point start = clock::now();
+
+  spsc_transfer(count, items);
+  return elapsed_ns(start, clock::now());
+}
+
+/* A grown ring keeps its elements in order, also those which had
+   wrapped around its end, and blocks straddling the end are
+   contiguous, without growing the ring.
+*/
+void check_ring_buffers()
+{
+  static constexpr size_t count = 100000;
+
+  eds::ring_buffer<int> ring;
+  size_t popped = 0;
+  bool in_order = true;
+
+  for (size_t n = 0; n < count; ++n) {
+    ring.push_back(static_cast<int>(n));
+    if (n % 2 == 1) {
+      in_order = in_order and ring.front() == static_cast<int>(popped);
+      ring.pop_front();
+      ++popped;
+    }
+  }
+  check(in_order and ring.size() == count - popped,
+        "ring_buffer keeps its elements in order while growing");
+  for (size_t index = 0; index < ring.size(); ++index) {
+    in_order = in_order and ring[index] == static_cast<int>(popped + index);
+  }
+  check(in_order, "ring_buffer elements are contiguous after growing");
+
+  eds::ring_buffer<int> wrapping(ring_block);
+  size_t capacity = wrapping.capacity();
+
+  for (size_t pushed = 0; pushed < count; pushed += ring_block) {
+    int* room = wrapping.prepare(ring_block);
+
+    for (size_t index = 0; index < ring_block; ++index) {
+      room[index] = static_cast<int>(pushed + index);
+    }
+    wrapping.commit(ring_block);
+
+    const int* data = wrapping.data();
+
+    for (size_t index = 0; index < ring_block; ++index) {
+      in_order = in_order and data[index] == static_cast<int>(pushed + index);
+    }
+    wrapping.consume(ring_block);
+  }
+  check(in_order, "ring_buffer blocks are contiguous across the end");
+  check(wrapping.capacity() == capacity,
+        "ring_buffer doesn't grow when empty");
+
+  std::vector<int> items;
+
+  check(spsc_transfer(count, items), "spsc_ring_buffer ends empty");
+  for (size_t index = 0; index < count; ++index) {
+    in_order = in_order and items[index] == static_cast<int>(index);
+  }
+  check(in_order, "spsc_ring_buffer passes elements in order");
+}
+
+/* Pushes count elements through a memmap_queue holding a page of
+   them at a time, which gives back the capacity popped whenever it
+   reaches the release treshold.
+*/
+double memmap_queue_workload(size_t count, latency_recorder& latency)
+{
+  eds::memmap_queue<int> queue;
+  size_t release_elements = queue.release_treshold() / sizeof(int);
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    queue.push(static_cast<int>(n));
+    if (queue.size() > queue_window) {
+      if (queue.container().capacity_low() - queue.size() + 1
+            >= release_elements)
+      {
+        clock::time_point step = clock::now();
+        queue.pop();
+        latency.add(step, clock::now());
+      }
+      else {
+        queue.pop();
+      }
+    }
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* memmap_queue pops its elements in order, and the capacity popped
+   never reaches the release treshold, past which it is given back,
+   but for a partial page, which release gives back too.
+*/
+void check_memmap_queue()
+{
+  static constexpr size_t count = 1 << 20;
+
+  eds::memmap_queue<int> queue;
+  size_t page_elements = eds_memmap_get_page_size() / sizeof(int);
+  size_t slack_limit = std::max(queue.release_treshold() / sizeof(int),
+                                page_elements);
+  size_t popped = 0;
+  bool in_order = true;
+  bool released = true;
+
+  for (size_t n = 0; n < count; ++n) {
+    queue.push(static_cast<int>(n));
+    if (queue.size() > queue_window) {
+      in_order = in_order and queue.front() == static_cast<int>(popped);
+      queue.pop();
+      ++popped;
+      released = released and queue.stats().slack_low < slack_limit;
+    }
+  }
+  check(in_order and queue.size() == queue_window
+        and queue.back() == static_cast<int>(count - 1),
+        "memmap_queue pops its elements in order");
+  check(released, "memmap_queue gives back the capacity popped");
+  queue.release();
+  check(queue.stats().slack_low < page_elements
+        and queue.front() == static_cast<int>(popped),
+        "memmap_queue::release leaves a partial page at most");
+}
+
+}
+
+void run_queue_benchmarks(const options& opts, std::ostream& out)
+{
+  result config;
+
+  check_ring_buffers();
+  check_memmap_queue();
+
+  config.element = "int";
+  config.element_size = sizeof(int);
+
+  config.container = "ring_buffer";
+  config.workload = "grow";
+  run_workload(opts, out, config, ring_grow_workload);
+  config.workload = "wrap";
+  run_workload(opts, out, config, ring_wrap_workload);
+
+  config.container = "memmap_queue";
+  config.workload = "push_pop";
+  run_workload(opts, out, config, memmap_queue_workload);
+
+  config.container = "spsc_ring_buffer";
+  config.workload = "threads";
+  run_workload(opts, out, config, spsc_workload);
+}
+
+}
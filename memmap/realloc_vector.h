@@ -4,9 +4,12 @@
 
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <new>
 
+#include "growth_policy.h"
+
 namespace eds
 {
 
@@ -18,27 +21,28 @@ private:
   type* raw_data;
   size_t allocated_count;
   size_t raw_count;
+  growth_policy growing;
 
   static constexpr size_t max_count = 
     std::numeric_limits<size_t>::max() / sizeof(*raw_data);
 
   size_t get_new_size(size_t required_increase)
   {
-    static constexpr size_t growth_rate = 2;
-
     size_t new_count = allocated_count + required_increase;
+    size_t grown_count;
 
-    if (new_count < allocated_count * growth_rate) {
-      if (allocated_count * growth_rate <= max_count) {
-        new_count = allocated_count * growth_rate;
-      }
-    }
-    else if (new_count < allocated_count) {
+    if (new_count < allocated_count) {
       throw std::bad_alloc();
     }
     else if (new_count > max_count) {
       throw std::bad_alloc();
     }
+    grown_count = growing.grow(allocated_count * sizeof(*raw_data),
+                               new_count * sizeof(*raw_data))
+                  / sizeof(*raw_data);
+    if (grown_count < max_count) {
+      new_count = grown_count;
+    }
     return new_count;
   }
 
@@ -63,6 +67,32 @@ public:
   {
   }
 
+  realloc_vector(const realloc_vector& other):
+    raw_data(nullptr),
+    allocated_count(0),
+    raw_count(0)
+  {
+    if (other.raw_count != 0) {
+      raw_data = static_cast<type*>(
+        std::malloc(other.raw_count * sizeof(*raw_data)));
+      if (raw_data == nullptr) {
+        throw std::bad_alloc();
+      }
+      std::memcpy(raw_data, other.raw_data,
+                  other.raw_count * sizeof(*raw_data));
+      allocated_count = other.raw_count;
+      raw_count = other.raw_count;
+    }
+  }
+
+  realloc_vector& operator=(const realloc_vector&) = delete;
+
+  /* How push_back and resize grow the capacity, doubling it by default */
+  void growth(const growth_policy& policy) noexcept
+  {
+    growing = policy;
+  }
+
   size_t capacity() const noexcept
   {
     return allocated_count;
@@ -106,6 +136,23 @@ public:
     raw_count = count;
   }
 
+  void shrink_to_fit()
+  {
+    if (raw_count == 0) {
+      std::free(raw_data);
+      raw_data = nullptr;
+      allocated_count = 0;
+      return;
+    }
+
+    void* new_pointer = std::realloc(raw_data, raw_count * sizeof(*raw_data));
+
+    if (new_pointer != nullptr) {
+      raw_data = static_cast<type*>(new_pointer);
+      allocated_count = raw_count;
+    }
+  }
+
   ~realloc_vector()
   {
     std::free(raw_data);
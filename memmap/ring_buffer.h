@@ -0,0 +1,522 @@
+
+#ifndef EDS_RING_BUFFER_H
+#define EDS_RING_BUFFER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#include "eds_memmap.h"
+
+namespace eds
+{
+
+/* The memfd of a ring buffer, mapped twice in a row, see eds_memmap_ring.
+   The element at index capacity() + i is the element at index i,
+   so any capacity() elements from an index below capacity()
+   are contiguous in memory.
+   The capacity is a multiple of the page size in bytes, so elements
+   never straddle the end of the ring.
+*/
+template<typename type>
+class mapped_ring
+{
+private:
+
+    eds_memmap_ring ring;
+    size_t count;
+
+    static eds_memmap_ring no_ring() noexcept
+    {
+        eds_memmap_ring none = {nullptr, -1};
+
+        return none;
+    }
+
+    static size_t gcd(size_t a, size_t b) noexcept
+    {
+        while (b != 0) {
+            size_t rest = a % b;
+
+            a = b;
+            b = rest;
+        }
+        return a;
+    }
+
+public:
+
+    typedef size_t size_type;
+
+    mapped_ring():
+        ring(no_ring()),
+        count(0)
+    {
+    }
+
+    /* Room for at least min_count elements */
+    explicit mapped_ring(size_type min_count):
+        ring(no_ring()),
+        count(round_count(min_count))
+    {
+        if (eds_memmap_ring_create(&ring, count * sizeof(type)) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    mapped_ring(mapped_ring&& other) noexcept:
+        ring(other.ring),
+        count(other.count)
+    {
+        other.ring = no_ring();
+        other.count = 0;
+    }
+
+    mapped_ring& operator=(mapped_ring&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    mapped_ring(const mapped_ring&) = delete;
+    mapped_ring& operator=(const mapped_ring&) = delete;
+
+    ~mapped_ring()
+    {
+        eds_memmap_ring_release(&ring, count * sizeof(type));
+    }
+
+    void swap(mapped_ring& other) noexcept
+    {
+        std::swap(ring, other.ring);
+        std::swap(count, other.count);
+    }
+
+    /* Both mappings of the ring fit in half the address space */
+    static constexpr size_type max_count() noexcept
+    {
+        return (size_t(0) - 1) / 4 / sizeof(type);
+    }
+
+    /* The smallest number of elements, of at least min_count,
+       filling whole pages.
+    */
+    static size_type round_count(size_type min_count)
+    {
+        size_t page_size = eds_memmap_get_page_size();
+        size_t unit = page_size / gcd(page_size, sizeof(type));
+
+        if (min_count > max_count() - unit) {
+            throw std::bad_alloc();
+        }
+        return std::max(unit, (min_count + unit - 1) / unit * unit);
+    }
+
+    size_type capacity() const noexcept
+    {
+        return count;
+    }
+
+    /* index is below 2 * capacity() */
+    type* at(size_type index) const noexcept
+    {
+        return (type*)(void*)(ring.base + index * sizeof(type));
+    }
+
+    /* Grows to at least min_count elements, keeping the used elements
+       from index first at the same index.
+    */
+    void grow(size_type first, size_type used, size_type min_count)
+    {
+        size_t new_count = round_count(min_count);
+
+        if (ring.base == nullptr) {
+            mapped_ring(new_count).swap(*this);
+        }
+        else if (eds_memmap_ring_grow(&ring, count * sizeof(type),
+                                      first * sizeof(type),
+                                      used * sizeof(type),
+                                      new_count * sizeof(type)) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        count = new_count;
+    }
+};
+
+/* A queue of trivially copyable elements, such as bytes or records,
+   in a mapped_ring. The elements are always contiguous in memory,
+   even when they wrap around the end of the ring, so they can be
+   passed to write(2) or a parser as a single pointer, and never need
+   to be copied at the boundary.
+   Growing maps a larger file, only copying the elements which had
+   wrapped around.
+*/
+template<typename type>
+class ring_buffer
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "ring_buffer elements are copied as bytes");
+
+private:
+
+    mapped_ring<type> storage;
+
+    /* index of the first element, below capacity() */
+    size_t head;
+    size_t length;
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef type& reference;
+    typedef const type& const_reference;
+    typedef type* pointer;
+    typedef const type* const_pointer;
+    typedef type* iterator;
+    typedef const type* const_iterator;
+
+    ring_buffer():
+        head(0),
+        length(0)
+    {
+    }
+
+    explicit ring_buffer(size_type capacity):
+        storage(capacity),
+        head(0),
+        length(0)
+    {
+    }
+
+    ring_buffer(ring_buffer&& other) noexcept:
+        storage(std::move(other.storage)),
+        head(other.head),
+        length(other.length)
+    {
+        other.head = 0;
+        other.length = 0;
+    }
+
+    ring_buffer& operator=(ring_buffer&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    void swap(ring_buffer& other) noexcept
+    {
+        storage.swap(other.storage);
+        std::swap(head, other.head);
+        std::swap(length, other.length);
+    }
+
+    size_type size() const noexcept
+    {
+        return length;
+    }
+
+    size_type capacity() const noexcept
+    {
+        return storage.capacity();
+    }
+
+    bool empty() const noexcept
+    {
+        return length == 0;
+    }
+
+    /* The elements, contiguous from the first one */
+    pointer data() noexcept
+    {
+        return storage.at(head);
+    }
+
+    const_pointer data() const noexcept
+    {
+        return storage.at(head);
+    }
+
+    iterator begin() noexcept
+    {
+        return data();
+    }
+
+    iterator end() noexcept
+    {
+        return data() + length;
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return data() + length;
+    }
+
+    reference operator[](size_type position) noexcept
+    {
+        return data()[position];
+    }
+
+    const_reference operator[](size_type position) const noexcept
+    {
+        return data()[position];
+    }
+
+    reference front() noexcept
+    {
+        return data()[0];
+    }
+
+    reference back() noexcept
+    {
+        return data()[length - 1];
+    }
+
+    void reserve(size_type count)
+    {
+        if (count > capacity()) {
+            storage.grow(head, length, std::max(count, 2 * capacity()));
+        }
+    }
+
+    /* Room for count more elements behind the last one, contiguous
+       like the elements, to be filled by the caller, and added with
+       commit.
+    */
+    pointer prepare(size_type count)
+    {
+        if (count > capacity() - length) {
+            if (count > mapped_ring<type>::max_count() - length) {
+                throw std::bad_alloc();
+            }
+            reserve(length + count);
+        }
+        return data() + length;
+    }
+
+    void commit(size_type count) noexcept
+    {
+        length += count;
+    }
+
+    void push_back(const type& value)
+    {
+        ::new(prepare(1)) type(value);
+        ++length;
+    }
+
+    void append(const type* items, size_type count)
+    {
+        std::memcpy((void*)prepare(count), (const void*)items,
+                    count * sizeof(type));
+        length += count;
+    }
+
+    /* Removes the first count elements */
+    void consume(size_type count) noexcept
+    {
+        head += count;
+        if (head >= capacity()) {
+            head -= capacity();
+        }
+        length -= count;
+    }
+
+    void pop_front() noexcept
+    {
+        consume(1);
+    }
+
+    void clear() noexcept
+    {
+        head = 0;
+        length = 0;
+    }
+};
+
+/* A fixed capacity ring_buffer for one producer thread and one consumer
+   thread, without locks. The producer fills the free room (write_data),
+   and publishes it (commit), the consumer reads the published elements
+   (read_data), and releases them (consume), each seeing a contiguous
+   block, as in ring_buffer.
+   Positions run from 0 to 2 * capacity(), to tell a full ring from an
+   empty one. Each side keeps the last position of the other side it
+   saw, and only loads the shared one again once that runs out, so the
+   cache lines of both positions aren't passed back and forth on every
+   element.
+*/
+template<typename type>
+class spsc_ring_buffer
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "spsc_ring_buffer elements are copied as bytes");
+
+private:
+
+    static constexpr size_t cache_line = 64;
+
+    const mapped_ring<type> storage;
+    const size_t count;
+    char storage_padding[cache_line];
+
+    /* Written by the consumer */
+    std::atomic<size_t> head;
+    size_t tail_seen;
+    char head_padding[cache_line];
+
+    /* Written by the producer */
+    std::atomic<size_t> tail;
+    size_t head_seen;
+
+    size_t advance(size_t position, size_t delta) const noexcept
+    {
+        position += delta;
+        if (position >= 2 * count) {
+            position -= 2 * count;
+        }
+        return position;
+    }
+
+    size_t used(size_t from, size_t to) const noexcept
+    {
+        return to >= from ? to - from : to + 2 * count - from;
+    }
+
+    type* element(size_t position) const noexcept
+    {
+        return storage.at(position >= count ? position - count : position);
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+
+    /* Room for at least capacity elements */
+    explicit spsc_ring_buffer(size_type capacity):
+        storage(capacity),
+        count(storage.capacity()),
+        head(0),
+        tail_seen(0),
+        tail(0),
+        head_seen(0)
+    {
+    }
+
+    spsc_ring_buffer(const spsc_ring_buffer&) = delete;
+    spsc_ring_buffer& operator=(const spsc_ring_buffer&) = delete;
+
+    size_type capacity() const noexcept
+    {
+        return count;
+    }
+
+    /* Producer side */
+
+    /* The number of elements which fit at write_data */
+    size_type write_available() noexcept
+    {
+        head_seen = head.load(std::memory_order_acquire);
+        return count - used(head_seen, tail.load(std::memory_order_relaxed));
+    }
+
+    type* write_data() noexcept
+    {
+        return element(tail.load(std::memory_order_relaxed));
+    }
+
+    /* Publishes the first written elements at write_data */
+    void commit(size_type written) noexcept
+    {
+        tail.store(advance(tail.load(std::memory_order_relaxed), written),
+                   std::memory_order_release);
+    }
+
+    bool push(const type& value) noexcept
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+
+        if (used(head_seen, position) == count) {
+            head_seen = head.load(std::memory_order_acquire);
+            if (used(head_seen, position) == count) {
+                return false;
+            }
+        }
+        ::new(element(position)) type(value);
+        tail.store(advance(position, 1), std::memory_order_release);
+        return true;
+    }
+
+    /* Writes as many of the item_count items as fit, returns how many */
+    size_type write(const type* items, size_type item_count) noexcept
+    {
+        size_t written = std::min(item_count, write_available());
+
+        std::memcpy((void*)write_data(), (const void*)items,
+                    written * sizeof(type));
+        commit(written);
+        return written;
+    }
+
+    /* Consumer side */
+
+    /* The number of elements at read_data */
+    size_type read_available() noexcept
+    {
+        tail_seen = tail.load(std::memory_order_acquire);
+        return used(head.load(std::memory_order_relaxed), tail_seen);
+    }
+
+    const type* read_data() const noexcept
+    {
+        return element(head.load(std::memory_order_relaxed));
+    }
+
+    /* Releases the first read elements at read_data */
+    void consume(size_type read) noexcept
+    {
+        head.store(advance(head.load(std::memory_order_relaxed), read),
+                   std::memory_order_release);
+    }
+
+    bool pop(type& value) noexcept
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+
+        if (position == tail_seen) {
+            tail_seen = tail.load(std::memory_order_acquire);
+            if (position == tail_seen) {
+                return false;
+            }
+        }
+        std::memcpy((void*)&value, (const void*)element(position),
+                    sizeof(type));
+        head.store(advance(position, 1), std::memory_order_release);
+        return true;
+    }
+
+    /* Reads up to item_count items, returns how many */
+    size_type read(type* items, size_type item_count) noexcept
+    {
+        size_t read_count = std::min(item_count, read_available());
+
+        std::memcpy((void*)items, (const void*)read_data(),
+                    read_count * sizeof(type));
+        consume(read_count);
+        return read_count;
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_RING_BUFFER_H */
@@ -0,0 +1,431 @@
+
+#ifndef EDS_SHARED_MEMMAP_H
+#define EDS_SHARED_MEMMAP_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "eds_memmap.h"
+#include "growth_policy.h"
+
+namespace eds
+{
+
+/* An array of trivially copyable elements in shared memory, which
+   other processes read in place, through a shared_memmap_view, instead
+   of receiving a serialized copy, see eds_memmap_shared.
+   The memory is named, for the readers to open, or anonymous, a memfd,
+   whose fd() is passed to them, e.g. over a unix socket.
+   Only this process writes to it. The elements reach the readers
+   as size() grows, which push_back, append and resize publish once
+   the elements are written. Elements below size() should not change
+   while readers may be reading them.
+   Growing maps a larger file, and tells the readers to do the same,
+   the file never shrinks.
+*/
+template<typename type>
+class shared_memmap
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "shared_memmap elements are shared as bytes");
+
+private:
+
+    eds_memmap_shared memory;
+    std::string memory_name;
+    growth_policy growing;
+
+    static eds_memmap_shared no_memory() noexcept
+    {
+        eds_memmap_shared none = {nullptr, nullptr, 0, -1, 0};
+
+        return none;
+    }
+
+    size_t count() const noexcept
+    {
+        return memory.header == nullptr ? 0 : size_t(memory.header->count);
+    }
+
+    void publish(size_t new_count) noexcept
+    {
+        __atomic_store_n(&memory.header->count, uint64_t(new_count),
+                         __ATOMIC_RELEASE);
+    }
+
+    void reserve_bytes(size_t new_count, bool grow)
+    {
+        size_t bytes;
+
+        if (memory.header == nullptr or new_count > max_size()) {
+            throw std::bad_alloc();
+        }
+        else if (new_count <= capacity()) {
+            return;
+        }
+        bytes = new_count * sizeof(type);
+        if (grow) {
+            bytes = std::max(bytes,
+                             std::min(growing.grow(count() * sizeof(type),
+                                                   bytes),
+                                      max_size() * sizeof(type)));
+        }
+        if (eds_memmap_shared_grow(&memory, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef type& reference;
+    typedef const type& const_reference;
+    typedef type* iterator;
+    typedef const type* const_iterator;
+
+    /* Creates anonymous shared memory, see fd */
+    shared_memmap():
+        memory(no_memory())
+    {
+        create(nullptr);
+    }
+
+    /* Creates the shared memory named name, e.g. "/sidecar.table",
+       which goes away along with the shared_memmap, see create.
+    */
+    explicit shared_memmap(const char* name):
+        memory(no_memory())
+    {
+        create(name);
+    }
+
+    shared_memmap(shared_memmap&& other) noexcept:
+        memory(other.memory),
+        memory_name(std::move(other.memory_name)),
+        growing(other.growing)
+    {
+        other.memory = no_memory();
+        other.memory_name.clear();
+    }
+
+    shared_memmap& operator=(shared_memmap&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    shared_memmap(const shared_memmap&) = delete;
+    shared_memmap& operator=(const shared_memmap&) = delete;
+
+    /* Readers keep their mappings, the name is removed */
+    ~shared_memmap()
+    {
+        release();
+    }
+
+    void swap(shared_memmap& other) noexcept
+    {
+        std::swap(memory, other.memory);
+        memory_name.swap(other.memory_name);
+        std::swap(growing, other.growing);
+    }
+
+    /* Replaces the memory with new, empty memory, named name, or
+       anonymous when name is nullptr. Throws std::system_error when it
+       can't be created, e.g. when the name exists
+       (std::errc::file_exists).
+    */
+    void create(const char* name)
+    {
+        eds_memmap_shared created;
+
+        if (eds_memmap_shared_create(&created, name, sizeof(type)) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    name != nullptr ? name : "memfd");
+        }
+        release();
+        memory = created;
+        memory_name = name != nullptr ? name : "";
+    }
+
+    void release() noexcept
+    {
+        if (not memory_name.empty()) {
+            (void)eds_memmap_shared_unlink(memory_name.c_str());
+            memory_name.clear();
+        }
+        eds_memmap_shared_release(&memory);
+    }
+
+    /* For readers to attach to, see shared_memmap_view */
+    int fd() const noexcept
+    {
+        return memory.fd;
+    }
+
+    const std::string& name() const noexcept
+    {
+        return memory_name;
+    }
+
+    /* See memmap::growth */
+    void growth(const growth_policy& policy) noexcept
+    {
+        growing = policy;
+    }
+
+    const growth_policy& growth() const noexcept
+    {
+        return growing;
+    }
+
+    size_type size() const noexcept
+    {
+        return count();
+    }
+
+    size_type capacity() const noexcept
+    {
+        return memory.capacity / sizeof(type);
+    }
+
+    size_type max_size() const noexcept
+    {
+        return (size_t(0) - 1) / 2 / sizeof(type);
+    }
+
+    bool empty() const noexcept
+    {
+        return count() == 0;
+    }
+
+    type* data() noexcept
+    {
+        return (type*)(void*)memory.data;
+    }
+
+    const type* data() const noexcept
+    {
+        return (const type*)(const void*)memory.data;
+    }
+
+    iterator begin() noexcept
+    {
+        return data();
+    }
+
+    iterator end() noexcept
+    {
+        return data() + count();
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return data() + count();
+    }
+
+    reference operator[](size_type position) noexcept
+    {
+        return data()[position];
+    }
+
+    const_reference operator[](size_type position) const noexcept
+    {
+        return data()[position];
+    }
+
+    void reserve(size_type new_cap)
+    {
+        reserve_bytes(new_cap, false);
+    }
+
+    void push_back(const type& value)
+    {
+        reserve_bytes(count() + 1, true);
+        std::memcpy((void*)(data() + count()), (const void*)&value,
+                    sizeof(type));
+        publish(count() + 1);
+    }
+
+    void append(const type* items, size_type item_count)
+    {
+        if (item_count > max_size() - count()) {
+            throw std::bad_alloc();
+        }
+        reserve_bytes(count() + item_count, true);
+        std::memcpy((void*)(data() + count()), (const void*)items,
+                    item_count * sizeof(type));
+        publish(count() + item_count);
+    }
+
+    void resize(size_type new_count, const value_type& value = value_type())
+    {
+        size_t old_count = count();
+
+        reserve_bytes(new_count, false);
+        for (size_t index = old_count; index < new_count; ++index) {
+            std::memcpy((void*)(data() + index), (const void*)&value,
+                        sizeof(type));
+        }
+        publish(new_count);
+    }
+
+    /* Readers may still be reading the elements removed */
+    void clear() noexcept
+    {
+        if (memory.header != nullptr) {
+            publish(0);
+        }
+    }
+};
+
+/* A read only view of the elements of a shared_memmap, in another
+   process. refresh maps the memory the owner grew into, size() are
+   the elements published in the memory the view maps.
+*/
+template<typename type>
+class shared_memmap_view
+{
+    static_assert(std::is_trivially_copyable<type>::value,
+                  "shared_memmap elements are shared as bytes");
+
+private:
+
+    eds_memmap_shared memory;
+
+    static eds_memmap_shared no_memory() noexcept
+    {
+        eds_memmap_shared none = {nullptr, nullptr, 0, -1, 0};
+
+        return none;
+    }
+
+    static void check(int result, const char* what)
+    {
+        if (result < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+    }
+
+public:
+
+    typedef type value_type;
+    typedef size_t size_type;
+    typedef const type& const_reference;
+    typedef const type* const_iterator;
+
+    shared_memmap_view():
+        memory(no_memory())
+    {
+    }
+
+    /* Attaches to the shared memory named name. Throws
+       std::system_error when it doesn't exist, or holds elements of
+       another size (std::errc::invalid_argument).
+    */
+    explicit shared_memmap_view(const char* name):
+        memory(no_memory())
+    {
+        check(eds_memmap_shared_open(&memory, name, sizeof(type)), name);
+    }
+
+    /* Attaches to the shared memory fd, which stays open */
+    explicit shared_memmap_view(int fd):
+        memory(no_memory())
+    {
+        check(eds_memmap_shared_attach(&memory, fd, sizeof(type)),
+              "shared_memmap_view");
+    }
+
+    shared_memmap_view(shared_memmap_view&& other) noexcept:
+        memory(other.memory)
+    {
+        other.memory = no_memory();
+    }
+
+    shared_memmap_view& operator=(shared_memmap_view&& other) noexcept
+    {
+        std::swap(memory, other.memory);
+        return *this;
+    }
+
+    shared_memmap_view(const shared_memmap_view&) = delete;
+    shared_memmap_view& operator=(const shared_memmap_view&) = delete;
+
+    ~shared_memmap_view()
+    {
+        eds_memmap_shared_release(&memory);
+    }
+
+    /* Maps the memory the owner grew into since, when the generation
+       changed. Returns true when it remapped, which may move the
+       elements, the pointers taken before are stale then.
+    */
+    bool refresh()
+    {
+        int result = eds_memmap_shared_refresh(&memory);
+
+        check(result, "shared_memmap_view::refresh");
+        return result != 0;
+    }
+
+    /* The elements published, up to the capacity mapped */
+    size_type size() const noexcept
+    {
+        if (memory.header == nullptr) {
+            return 0;
+        }
+        return std::min(size_t(__atomic_load_n(&memory.header->count,
+                                               __ATOMIC_ACQUIRE)),
+                        memory.capacity / sizeof(type));
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    /* Changes when the owner grows the memory */
+    uint64_t generation() const noexcept
+    {
+        return memory.generation;
+    }
+
+    const type* data() const noexcept
+    {
+        return (const type*)(const void*)memory.data;
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return data();
+    }
+
+    /* The end of the elements published when it is called */
+    const_iterator cend() const noexcept
+    {
+        return data() + size();
+    }
+
+    const_reference operator[](size_type position) const noexcept
+    {
+        return data()[position];
+    }
+};
+
+} /* namespace eds */
+
+#endif /* EDS_SHARED_MEMMAP_H */
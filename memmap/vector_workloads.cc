@@ -0,0 +1,821 @@
+
+#include "benchmark.h"
+#include "concurrent_memmap.h"
+#include "eds_memmap.h"
+#include "memmap.h"
+#include "realloc_vector.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace benchmark
+{
+
+namespace
+{
+
+template<size_t size>
+struct pod
+{
+  unsigned char bytes[size];
+};
+
+template<typename type>
+struct element_traits;
+
+template<>
+struct element_traits<int>
+{
+  static const char* name() { return "int"; }
+  static int make(size_t n) { return static_cast<int>(n); }
+};
+
+template<size_t size>
+struct element_traits<pod<size>>
+{
+  static const char* name()
+  {
+    return size == 64 ? "pod64" : "pod4096";
+  }
+
+  /* Never zero, zero values take a shortcut in memmap::resize */
+  static pod<size> make(size_t n)
+  {
+    pod<size> value = {};
+    value.bytes[0] = static_cast<unsigned char>(n % 255 + 1);
+    return value;
+  }
+};
+
+/* Not trivially relocatable, memmap moves these one by one */
+template<>
+struct element_traits<std::string>
+{
+  static const char* name() { return "string"; }
+  static std::string make(size_t n) { return std::to_string(n); }
+};
+
+/* The benchmarked containers don't share the exact same interface,
+   these traits fill the gaps.
+   full_high / full_low tell whether the next push at that end
+   has to grow the container.
+   insert_block / erase_block insert or erase a range in the middle.
+*/
+template<typename vector_type>
+struct vector_traits;
+
+template<typename type>
+struct vector_traits<std::vector<type>>
+{
+  static const char* name() { return "std::vector"; }
+  static constexpr bool has_push_front = false;
+
+  static bool full_high(const std::vector<type>& vector)
+  {
+    return vector.size() == vector.capacity();
+  }
+
+  static bool full_low(const std::vector<type>&) { return false; }
+  static void push_front(std::vector<type>&, const type&) {}
+
+  static constexpr bool has_insert = true;
+
+  static void insert_block(std::vector<type>& vector, size_t pos,
+                           const std::vector<type>& block)
+  {
+    vector.insert(vector.begin() + pos, block.begin(), block.end());
+  }
+
+  static void erase_block(std::vector<type>& vector, size_t pos, size_t count)
+  {
+    vector.erase(vector.begin() + pos, vector.begin() + pos + count);
+  }
+};
+
+template<typename type>
+struct vector_traits<eds::realloc_vector<type>>
+{
+  static const char* name() { return "realloc_vector"; }
+  static constexpr bool has_push_front = false;
+
+  static bool full_high(const eds::realloc_vector<type>& vector)
+  {
+    return vector.size() == vector.capacity();
+  }
+
+  static bool full_low(const eds::realloc_vector<type>&) { return false; }
+  static void push_front(eds::realloc_vector<type>&, const type&) {}
+
+  static constexpr bool has_insert = false;
+
+  static void insert_block(eds::realloc_vector<type>&, size_t,
+                           const std::vector<type>&) {}
+  static void erase_block(eds::realloc_vector<type>&, size_t, size_t) {}
+};
+
+template<typename type>
+struct vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap"; }
+  static constexpr bool has_push_front = true;
+
+  static bool full_high(const eds::memmap<type>& vector)
+  {
+    return vector.size() == vector.capacity_high();
+  }
+
+  static bool full_low(const eds::memmap<type>& vector)
+  {
+    return vector.size() == vector.capacity_low();
+  }
+
+  static void push_front(eds::memmap<type>& vector, const type& value)
+  {
+    vector.push_front(value);
+  }
+
+  static constexpr bool has_insert = true;
+
+  static void insert_block(eds::memmap<type>& vector, size_t pos,
+                           const std::vector<type>& block)
+  {
+    vector.insert(vector.cbegin() + pos, block.begin(), block.end());
+  }
+
+  static void erase_block(eds::memmap<type>& vector, size_t pos, size_t count)
+  {
+    vector.erase(vector.cbegin() + pos, vector.cbegin() + pos + count);
+  }
+};
+
+/* A memmap growing in place, inside 64 GiB of reserved address space
+   at each end.
+*/
+template<typename type>
+struct reserved_memmap : eds::memmap<type>
+{
+  reserved_memmap()
+  {
+    static constexpr size_t reserved_bytes = size_t(1) << 36;
+
+    this->reserve_address_space(reserved_bytes / sizeof(type),
+                                reserved_bytes / sizeof(type));
+  }
+};
+
+template<typename type>
+struct vector_traits<reserved_memmap<type>> : vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap_reserved"; }
+};
+
+/* A reserved memmap in a memfd, copied in constant time */
+template<typename type>
+struct cow_memmap : eds::memmap<type>
+{
+  cow_memmap()
+  {
+    static constexpr size_t reserved_bytes = size_t(1) << 36;
+
+    this->reserve_copy_on_write(reserved_bytes / sizeof(type),
+                                reserved_bytes / sizeof(type));
+  }
+
+  cow_memmap(const cow_memmap& other):
+    eds::memmap<type>(other)
+  {
+  }
+};
+
+template<typename type>
+struct vector_traits<cow_memmap<type>> : vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap_cow"; }
+};
+
+/* A memmap faulting its pages in when it grows, in parallel when large,
+   instead of on the first write to each of them.
+*/
+template<typename type>
+struct populated_memmap : eds::memmap<type>
+{
+  populated_memmap()
+  {
+    this->populate(EDS_MEMMAP_POPULATE_WRITE | EDS_MEMMAP_POPULATE_PARALLEL);
+  }
+
+  populated_memmap(const populated_memmap& other):
+    eds::memmap<type>(other)
+  {
+    this->populate(other.populate_flags());
+  }
+};
+
+template<typename type>
+struct vector_traits<populated_memmap<type>> : vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap_populated"; }
+};
+
+/* A memmap keeping the capacity it gives up mapped, with MADV_FREE */
+template<typename type>
+struct retaining_memmap : eds::memmap<type>
+{
+  retaining_memmap()
+  {
+    this->retain(EDS_MEMMAP_RETAIN_FREE);
+  }
+
+  retaining_memmap(const retaining_memmap& other):
+    eds::memmap<type>(other)
+  {
+  }
+};
+
+template<typename type>
+struct vector_traits<retaining_memmap<type>> : vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap_retaining"; }
+};
+
+/* A memmap growing by the pages it needs only, trading mremap calls
+   for slack
+*/
+template<typename type>
+struct paged_memmap : eds::memmap<type>
+{
+  paged_memmap()
+  {
+    this->growth(eds::growth_policy::next_page());
+  }
+
+  paged_memmap(const paged_memmap& other):
+    eds::memmap<type>(other)
+  {
+    this->growth(other.growth());
+  }
+};
+
+template<typename type>
+struct vector_traits<paged_memmap<type>> : vector_traits<eds::memmap<type>>
+{
+  static const char* name() { return "memmap_paged"; }
+};
+
+template<typename vector_type, typename type>
+double push_back_workload(size_t count, latency_recorder& latency)
+{
+  typedef vector_traits<vector_type> traits;
+
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    type value = element_traits<type>::make(n);
+
+    if (traits::full_high(vector)) {
+      clock::time_point step = clock::now();
+      vector.push_back(value);
+      latency.add(step, clock::now());
+    }
+    else {
+      vector.push_back(value);
+    }
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+template<typename vector_type, typename type>
+double push_front_workload(size_t count, latency_recorder& latency)
+{
+  typedef vector_traits<vector_type> traits;
+
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  for (size_t n = 0; n < count; ++n) {
+    type value = element_traits<type>::make(n);
+
+    if (traits::full_low(vector)) {
+      clock::time_point step = clock::now();
+      traits::push_front(vector, value);
+      latency.add(step, clock::now());
+    }
+    else {
+      traits::push_front(vector, value);
+    }
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+template<typename vector_type, typename type>
+double resize_workload(size_t count, latency_recorder& latency)
+{
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  for (size_t size = 1; vector.size() < count; size *= 2) {
+    clock::time_point step = clock::now();
+    vector.resize(std::min(size, count), element_traits<type>::make(size));
+    latency.add(step, clock::now());
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* Zero values, which memmap doesn't need to write to fresh pages */
+template<typename vector_type, typename type>
+double resize_zero_workload(size_t count, latency_recorder& latency)
+{
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  for (size_t size = 1; vector.size() < count; size *= 2) {
+    clock::time_point step = clock::now();
+    vector.resize(std::min(size, count), type());
+    latency.add(step, clock::now());
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* A single resize, filling all the elements with the same value */
+template<typename vector_type, typename type>
+double fill_workload(size_t count, latency_recorder& latency)
+{
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  vector.resize(count, element_traits<type>::make(1));
+  latency.add(start, clock::now());
+  return elapsed_ns(start, clock::now());
+}
+
+template<typename vector_type, typename type>
+double copy_workload(size_t count, latency_recorder& latency)
+{
+  vector_type vector;
+
+  vector.resize(count, element_traits<type>::make(1));
+
+  clock::time_point start = clock::now();
+  {
+    vector_type copy(vector);
+  }
+  latency.add(start, clock::now());
+  return elapsed_ns(start, clock::now());
+}
+
+template<typename vector_type, typename type>
+double shrink_workload(size_t count, latency_recorder& latency)
+{
+  vector_type vector;
+
+  vector.resize(count, element_traits<type>::make(count));
+
+  clock::time_point start = clock::now();
+
+  while (vector.size() > 1) {
+    clock::time_point step = clock::now();
+    vector.resize(vector.size() / 2, element_traits<type>::make(0));
+    vector.shrink_to_fit();
+    latency.add(step, clock::now());
+  }
+  return elapsed_ns(start, clock::now());
+}
+
+/* A buffer shrinking after each burst, and growing back soon after */
+template<typename vector_type, typename type>
+double oscillate_workload(size_t count, latency_recorder& latency)
+{
+  static constexpr unsigned cycles = 8;
+
+  vector_type vector;
+  clock::time_point start = clock::now();
+
+  for (unsigned cycle = 0; cycle < cycles; ++cycle) {
+    clock::time_point step = clock::now();
+    vector.resize(count, element_traits<type>::make(cycle));
+    latency.add(step, clock::now());
+    step = clock::now();
+    vector.resize(count / 16, element_traits<type>::make(0));
+    vector.shrink_to_fit();
+    latency.add(step, clock::now());
+  }
+  return elapsed_ns(start, clock::now()) / cycles;
+}
+
+/* Inserts a block of a quarter as many elements in the middle,
+   and erases it again. memmap moves the elements behind it by
+   whole pages, once the block is large enough.
+*/
+template<typename vector_type, typename type>
+double insert_workload(size_t count, latency_recorder& latency)
+{
+  typedef vector_traits<vector_type> traits;
+
+  vector_type vector;
+  std::vector<type> block(count / 4 + 1, element_traits<type>::make(1));
+
+  vector.resize(count, element_traits<type>::make(count));
+
+  clock::time_point start = clock::now();
+  clock::time_point step = start;
+
+  traits::insert_block(vector, count / 2, block);
+  latency.add(step, clock::now());
+  step = clock::now();
+  traits::erase_block(vector, count / 2, block.size());
+  latency.add(step, clock::now());
+  return elapsed_ns(start, clock::now());
+}
+
+/* The pattern of the old loop_stress_vector binary:
+   containers created, grown, and destroyed over and over again.
+*/
+template<typename vector_type, typename type>
+double churn_workload(size_t count, latency_recorder& latency)
+{
+  static constexpr unsigned cycles = 16;
+
+  clock::time_point start = clock::now();
+
+  for (unsigned cycle = 0; cycle < cycles; ++cycle) {
+    clock::time_point step = clock::now();
+    {
+      vector_type vector;
+
+      for (size_t size = 1; vector.size() < count; size *= 2) {
+        vector.resize(std::min(size, count), element_traits<type>::make(size));
+      }
+    }
+    latency.add(step, clock::now());
+  }
+  return elapsed_ns(start, clock::now()) / cycles;
+}
+
+/* threads append count elements to a concurrent_memmap of count
+   elements, while this thread reads the published ones as they come.
+   Thread t appends t, t + threads, t + 2 * threads, and so on. Returns
+   whether the elements read were published ones.
+*/
+template<unsigned threads>
+bool concurrent_push_back(eds::concurrent_memmap<int>& vector, size_t count)
+{
+  std::vector<std::thread> appenders;
+  size_t published = 0;
+  bool valid = true;
+
+  for (unsigned thread = 0; thread < threads; ++thread) {
+    appenders.emplace_back([&vector, count, thread]() {
+        for (size_t n = thread; n < count; n += threads) {
+          vector.push_back(static_cast<int>(n));
+        }
+      });
+  }
+  while (published < count) {
+    size_t size = vector.size();
+
+    valid = valid and size >= published;
+    for (; published < size; ++published) {
+      valid = valid and size_t(vector[published]) < count;
+    }
+    std::this_thread::yield();
+  }
+  for (std::thread& appender : appenders) {
+    appender.join();
+  }
+  return valid;
+}
+
+template<unsigned threads>
+double concurrent_push_back_workload(size_t count, latency_recorder&)
+{
+  eds::concurrent_memmap<int> vector(count);
+  clock::time_point start = clock::now();
+
+  concurrent_push_back<threads>(vector, count);
+  return elapsed_ns(start, clock::now());
+}
+
+/* The published size never goes back, and the elements of each thread
+   end up in the order it appended them, each exactly once.
+*/
+template<unsigned threads>
+void check_concurrent_push_back(size_t count)
+{
+  eds::concurrent_memmap<int> vector(count);
+  bool valid = concurrent_push_back<threads>(vector, count);
+  std::vector<bool> seen(count);
+  std::vector<size_t> next(threads);
+
+  for (size_t index = 0; index < count; ++index) {
+    size_t n = vector[index];
+
+    valid = valid and n < count and not seen[n] and n >= next[n % threads];
+    seen[n] = true;
+    next[n % threads] = n + 1;
+  }
+  check(valid and vector.size() == count,
+        "concurrent_memmap publishes each element once, in order per thread");
+}
+
+void check_concurrent_memmap()
+{
+  static constexpr size_t count = 1 << 20;
+
+  check_concurrent_push_back<1>(count);
+  check_concurrent_push_back<2>(count);
+  check_concurrent_push_back<4>(count);
+  check_concurrent_push_back<8>(count);
+}
+
+template<typename vector_type, typename type>
+void run_workload(const options& opts, std::ostream& out,
+                  const char* workload_name, workload_function workload)
+{
+  result config;
+
+  config.container = vector_traits<vector_type>::name();
+  config.element = element_traits<type>::name();
+  config.workload = workload_name;
+  config.element_size = sizeof(type);
+  run_workload(opts, out, config, workload);
+}
+
+template<typename vector_type, typename type>
+void run_container(const options& opts, std::ostream& out)
+{
+  run_workload<vector_type, type>(opts, out, "push_back",
+                                  push_back_workload<vector_type, type>);
+  if (vector_traits<vector_type>::has_push_front) {
+    run_workload<vector_type, type>(opts, out, "push_front",
+                                    push_front_workload<vector_type, type>);
+  }
+  run_workload<vector_type, type>(opts, out, "resize",
+                                  resize_workload<vector_type, type>);
+  run_workload<vector_type, type>(opts, out, "resize_zero",
+                                  resize_zero_workload<vector_type, type>);
+  run_workload<vector_type, type>(opts, out, "fill",
+                                  fill_workload<vector_type, type>);
+  run_workload<vector_type, type>(opts, out, "copy",
+                                  copy_workload<vector_type, type>);
+  run_workload<vector_type, type>(opts, out, "shrink",
+                                  shrink_workload<vector_type, type>);
+  run_workload<vector_type, type>(opts, out, "oscillate",
+                                  oscillate_workload<vector_type, type>);
+  if (vector_traits<vector_type>::has_insert) {
+    run_workload<vector_type, type>(opts, out, "insert",
+                                    insert_workload<vector_type, type>);
+  }
+  run_workload<vector_type, type>(opts, out, "churn",
+                                  churn_workload<vector_type, type>);
+}
+
+/* The same appends from 1 to 8 threads, to see them scale */
+void run_concurrent(const options& opts, std::ostream& out)
+{
+  result config;
+
+  config.container = "concurrent_memmap";
+  config.element = element_traits<int>::name();
+  config.element_size = sizeof(int);
+  config.workload = "push_back_1t";
+  run_workload(opts, out, config, concurrent_push_back_workload<1>);
+  config.workload = "push_back_2t";
+  run_workload(opts, out, config, concurrent_push_back_workload<2>);
+  config.workload = "push_back_4t";
+  run_workload(opts, out, config, concurrent_push_back_workload<4>);
+  config.workload = "push_back_8t";
+  run_workload(opts, out, config, concurrent_push_back_workload<8>);
+}
+
+template<typename type>
+void run_element(const options& opts, std::ostream& out)
+{
+  run_container<std::vector<type>, type>(opts, out);
+  run_container<eds::realloc_vector<type>, type>(opts, out);
+  run_container<eds::memmap<type>, type>(opts, out);
+  run_container<reserved_memmap<type>, type>(opts, out);
+  run_container<cow_memmap<type>, type>(opts, out);
+  run_container<populated_memmap<type>, type>(opts, out);
+  run_container<retaining_memmap<type>, type>(opts, out);
+  run_container<paged_memmap<type>, type>(opts, out);
+}
+
+/* realloc_vector moves its elements bytewise, which breaks strings */
+template<typename type>
+void run_non_relocatable_element(const options& opts, std::ostream& out)
+{
+  run_container<std::vector<type>, type>(opts, out);
+  run_container<eds::memmap<type>, type>(opts, out);
+  run_container<reserved_memmap<type>, type>(opts, out);
+}
+
+/* insert(pos, 3, 7) and assign(3, 7) of a memmap of ints fill, they
+   aren't taken for the iterator overloads.
+*/
+void check_integral_fill()
+{
+  eds::memmap<int> vector;
+  const int expected[] = {1, 7, 7, 7, 2};
+
+  vector.push_back(1);
+  vector.push_back(2);
+  vector.insert(vector.cbegin() + 1, 3, 7);
+  check(vector.size() == 5
+        and std::equal(vector.begin(), vector.end(), expected),
+        "memmap<int>::insert(pos, count, value)");
+  vector.assign(3, 7);
+  check(vector.size() == 3 and vector[0] == 7 and vector[2] == 7,
+        "memmap<int>::assign(count, value)");
+}
+
+/* insert and assign take any input iterators, reading those which can
+   be read only once, like istream_iterator, only once.
+*/
+void check_iterator_ranges()
+{
+  const std::list<int> list = {100, 101, 102};
+  const int inserted[] = {0, 1, 100, 101, 102, 2, 3};
+  eds::memmap<int> vector;
+  std::istringstream numbers("100 101 102");
+
+  for (int n = 0; n < 4; ++n) {
+    vector.push_back(n);
+  }
+  vector.insert(vector.cbegin() + 2, list.begin(), list.end());
+  check(vector.size() == 7
+        and std::equal(vector.begin(), vector.end(), inserted),
+        "memmap<int>::insert(pos, list iterators)");
+  vector.erase(vector.cbegin() + 2, vector.cbegin() + 5);
+  vector.insert(vector.cbegin() + 2, std::istream_iterator<int>(numbers),
+                std::istream_iterator<int>());
+  check(vector.size() == 7
+        and std::equal(vector.begin(), vector.end(), inserted),
+        "memmap<int>::insert(pos, istream_iterators)");
+
+  vector.assign(list.begin(), list.end());
+  check(vector.size() == 3
+        and std::equal(vector.begin(), vector.end(), list.begin()),
+        "memmap<int>::assign(list iterators)");
+  numbers.clear();
+  numbers.str("4 5");
+  vector.assign(std::istream_iterator<int>(numbers),
+                std::istream_iterator<int>());
+  check(vector.size() == 2 and vector[0] == 4 and vector[1] == 5,
+        "memmap<int>::assign(istream_iterators)");
+
+  eds::memmap<std::string> strings;
+
+  strings.assign(2, "a");
+  numbers.clear();
+  numbers.str("b c");
+  strings.insert(strings.cbegin() + 1,
+                 std::istream_iterator<std::string>(numbers),
+                 std::istream_iterator<std::string>());
+  check(strings.size() == 4 and strings[0] == "a" and strings[1] == "b"
+        and strings[2] == "c" and strings[3] == "a",
+        "memmap<std::string>::insert(pos, istream_iterators)");
+}
+
+/* The count values from first on, the first front of them pushed at
+   the front, which leaves capacity in front of them.
+*/
+eds::memmap<int> make_sequence(int first, size_t count, size_t front)
+{
+  eds::memmap<int> vector;
+
+  for (size_t n = front; n < count; ++n) {
+    vector.push_back(first + static_cast<int>(n));
+  }
+  for (size_t n = front; n > 0; --n) {
+    vector.push_front(first + static_cast<int>(n - 1));
+  }
+  return vector;
+}
+
+bool is_sequence(const eds::memmap<int>& vector, int first, size_t count)
+{
+  bool valid = vector.size() == count;
+
+  for (size_t index = 0; valid and index < count; ++index) {
+    valid = vector[index] == first + static_cast<int>(index);
+  }
+  return valid;
+}
+
+/* append and split_off move whole pages between the storages where
+   they can, and copy the bytes of the pages where they meet, or the
+   whole of small storages, in malloc'd memory.
+*/
+void check_append_split()
+{
+  struct append_split_case
+  {
+    size_t count_a;
+    size_t front_a;
+    size_t count_b;
+    size_t front_b;
+    size_t cut;
+    const char* what;
+  };
+
+  size_t page = eds_memmap_get_page_size() / sizeof(int);
+  size_t large = eds_memmap_get_mmap_treshold() / sizeof(int) / page * page
+                 + 4 * page;
+  const append_split_case cases[] = {
+    {large, 0, large, 0, large + 3 * page,
+     "memmap::append and split_off at page boundaries"},
+    {large + 3, 0, large + 5, 0, large + 7,
+     "memmap::append and split_off within pages"},
+    {large, page + 1, large, 5, large - 1,
+     "memmap::append and split_off after push_front"},
+    {10, 0, 20, 2, 15,
+     "memmap::append and split_off below the mmap treshold"},
+    {10, 3, large, 0, 5,
+     "memmap::append of a large memmap to a small one"},
+    {large, 0, 10, 0, large + 5,
+     "memmap::append of a small memmap to a large one"},
+  };
+
+  for (const append_split_case& test : cases) {
+    size_t count = test.count_a + test.count_b;
+    eds::memmap<int> vector = make_sequence(0, test.count_a, test.front_a);
+    eds::memmap<int> other = make_sequence(static_cast<int>(test.count_a),
+                                           test.count_b, test.front_b);
+
+    vector.append(std::move(other));
+    check(is_sequence(vector, 0, count) and other.empty(), test.what);
+
+    eds::memmap<int> tail = vector.split_off(test.cut);
+
+    check(is_sequence(vector, 0, test.cut)
+          and is_sequence(tail, static_cast<int>(test.cut), count - test.cut),
+          test.what);
+    vector.push_back(static_cast<int>(test.cut));
+    tail.push_back(static_cast<int>(count));
+    check(is_sequence(vector, 0, test.cut + 1)
+          and is_sequence(tail, static_cast<int>(test.cut),
+                          count - test.cut + 1),
+          test.what);
+  }
+
+  eds::memmap<int> vector = make_sequence(0, large, page + 1);
+  size_t capacity_high = vector.capacity_high();
+
+  vector.reserve_low(2 * large);
+  check(vector.capacity_low() >= 2 * large
+        and vector.capacity_high() == capacity_high
+        and is_sequence(vector, 0, large),
+        "memmap::reserve_low grows the low end alone");
+  vector.shrink_to_fit();
+  check(vector.capacity_low() - vector.size() < page
+        and vector.capacity_high() - vector.size() < page
+        and is_sequence(vector, 0, large),
+        "memmap::shrink_to_fit gives back the capacity at both ends");
+
+  size_t size_a = eds_memmap_get_mmap_treshold() + 100;
+  size_t size_b = eds_memmap_get_mmap_treshold() + 300;
+  char* mem_a = eds_memmap_create(size_a);
+  char* mem_b = eds_memmap_create(size_b);
+  char* tail = nullptr;
+
+  check(mem_a != nullptr and mem_b != nullptr, "eds_memmap_create");
+  std::memset(mem_a, 'a', size_a);
+  std::memset(mem_b, 'b', size_b);
+  mem_a = eds_memmap_merge(mem_a, size_a, mem_b, size_b);
+  check(mem_a != nullptr
+        and std::count(mem_a, mem_a + size_a, 'a') == ssize_t(size_a)
+        and std::count(mem_a + size_a, mem_a + size_a + size_b, 'b')
+              == ssize_t(size_b),
+        "eds_memmap_merge");
+  mem_a = eds_memmap_split(mem_a, size_a + size_b, size_a, &tail);
+  check(mem_a != nullptr and tail != nullptr
+        and std::count(mem_a, mem_a + size_a, 'a') == ssize_t(size_a)
+        and std::count(tail, tail + size_b, 'b') == ssize_t(size_b),
+        "eds_memmap_split");
+  eds_memmap_destroy(mem_a, size_a);
+  eds_memmap_destroy(tail, size_b);
+}
+
+}
+
+void run_vector_benchmarks(const options& opts, std::ostream& out)
+{
+  check_integral_fill();
+  check_iterator_ranges();
+  check_append_split();
+  check_concurrent_memmap();
+  run_element<int>(opts, out);
+  run_element<pod<64>>(opts, out);
+  run_element<pod<4096>>(opts, out);
+  run_non_relocatable_element<std::string>(opts, out);
+  run_concurrent(opts, out);
+}
+
+}